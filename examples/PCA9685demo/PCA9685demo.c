@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <signal.h>
@@ -21,6 +22,7 @@ int __addr;  // needed for cleanup()
 int debug = 0;
 int validate = 0;
 int ncmode = 0;
+volatile sig_atomic_t caught = 0;
 
 
 void cleanup() {
@@ -33,10 +35,12 @@ void cleanup() {
 } // cleanup
 
 
-void intHandler(int dummy) {
-  cleanup();
-  fprintf(stdout, "Caught signal, exiting (%d)\n", dummy);
-  exit(0);
+// only async-signal-safe calls here, the lights go off at once and the
+// main loop stops before its next write and cleans up
+void intHandler(int sig) {
+  unsigned char addr = __addr;
+  PCA9685_blackoutPWMs(__fd, 1, &addr);
+  caught = sig;
 } // intHandler 
 
 
@@ -379,8 +383,12 @@ int main(int argc, char **argv) {
     manual = false;
   } // if ncmode
 
-  // register the signal handler to catch interrupts
-  signal(SIGINT, intHandler);
+  // register the signal handler to catch interrupts, without SA_RESTART
+  // so a blocking getch() returns
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = intHandler;
+  sigaction(SIGINT, &sa, NULL);
 
   // initialize the I2C bus adpt and a PCA9685 at addr with freq
   fd = initHardware(adpt, addr, freq);
@@ -442,8 +450,8 @@ int main(int argc, char **argv) {
     HSV.s = 1.0;
     HSV.v = 1.0;
 
-    // blink endlessly 
-    while (1) {
+    // blink until interrupted
+    while (!caught) {
 
       if (automatic) {
         // read a char (non-blocking)
@@ -546,6 +554,9 @@ int main(int argc, char **argv) {
       } // if manual
 
 
+      // a signal during getch() must not be followed by another write
+      if (caught) break;
+
       // SET THE VALS, EVERY TIME THROUGH THE LOOP
       ret = PCA9685_setPWMVals(fd, addr, setOnVals, setOffVals);
       if (ret != 0) {
@@ -638,8 +649,10 @@ int main(int argc, char **argv) {
         } // if ncmode
 
       } // if update screen
-    } // while forever
+    } // while !caught
   } // perf context 
 
+  cleanup();
+  fprintf(stdout, "Caught signal, exiting (%d)\n", (int) caught);
   return 0;
 } // main 
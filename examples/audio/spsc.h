@@ -0,0 +1,104 @@
+#ifndef _SPSC_H
+#define _SPSC_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// single producer single consumer ring of fixed size slots
+typedef struct spscs {
+  _Alignas(64) atomic_uint head;   // next slot to publish
+  _Alignas(64) atomic_uint tail;   // next slot to consume
+  _Alignas(64) unsigned int slots; // power of two
+  size_t slotSize;
+  char *buf;
+} spsc;
+
+static inline int spsc_init(spsc *r, unsigned int slots, size_t slotSize) {
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  r->slots = slots;
+  r->slotSize = (slotSize + 63) & ~(size_t) 63;
+  r->buf = (char *) aligned_alloc(64, r->slotSize * slots);
+  return r->buf ? 0 : -1;
+}
+
+// free slot for the producer to fill, NULL if the ring is full
+static inline void *spsc_claim(spsc *r) {
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail == r->slots) return NULL;
+  return r->buf + (head & (r->slots - 1)) * r->slotSize;
+}
+
+// hand the claimed slot to the consumer
+static inline void spsc_publish(spsc *r) {
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// oldest published slot, NULL if the ring is empty
+static inline void *spsc_peek(spsc *r) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return NULL;
+  return r->buf + (tail & (r->slots - 1)) * r->slotSize;
+}
+
+// hand the peeked slot back to the producer
+static inline void spsc_release(spsc *r) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+// number of published slots not yet released
+static inline unsigned int spsc_depth(spsc *r) {
+  return atomic_load_explicit(&r->head, memory_order_acquire) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+// newest-value mailbox (triple buffer), the consumer only sees the latest
+#define LATEST_FRESH 4
+
+typedef struct latests {
+  _Alignas(64) atomic_uint middle; // shared slot, LATEST_FRESH if unread
+  _Alignas(64) unsigned int back;  // slot the producer fills
+  _Alignas(64) unsigned int front; // slot the consumer reads
+  size_t slotSize;
+  char *buf;
+} latest;
+
+static inline int latest_init(latest *m, size_t slotSize) {
+  atomic_init(&m->middle, 1);
+  m->back = 0;
+  m->front = 2;
+  m->slotSize = (slotSize + 63) & ~(size_t) 63;
+  m->buf = (char *) aligned_alloc(64, m->slotSize * 3);
+  return m->buf ? 0 : -1;
+}
+
+// slot for the producer to fill
+static inline void *latest_back(latest *m) {
+  return m->buf + m->back * m->slotSize;
+}
+
+// publish the filled slot, returns 1 if an unread value was replaced
+static inline int latest_publish(latest *m) {
+  unsigned int prev = atomic_exchange_explicit(&m->middle,
+      m->back | LATEST_FRESH, memory_order_acq_rel);
+  m->back = prev & 3;
+  return (prev & LATEST_FRESH) != 0;
+}
+
+// newest published slot, NULL if nothing was published since the last take
+static inline void *latest_take(latest *m) {
+  if (!(atomic_load_explicit(&m->middle, memory_order_relaxed) & LATEST_FRESH)) {
+    return NULL;
+  } // if nothing new
+  unsigned int prev = atomic_exchange_explicit(&m->middle, m->front,
+                                               memory_order_acq_rel);
+  m->front = prev & 3;
+  return m->buf + m->front * m->slotSize;
+}
+
+#endif
@@ -0,0 +1,137 @@
+// microbenchmark for the vupeak sample kernels on synthetic buffers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+// fftw3.h declares every precision, only the fftwf_ one of libfftw3f is used
+#include <fftw3.h>
+
+#include "vukernels.h"
+
+
+double nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// a sine on each channel plus noise, with full scale peaks
+void fill(int16_t *buf, unsigned int frames, unsigned int channels) {
+  unsigned int i, c;
+  for (i = 0; i < frames; i++) {
+    for (c = 0; c < channels; c++) {
+      double s = sin(2 * M_PI * (c + 1) * 440.0 * i / 44100.0);
+      s = s * 30000 + (rand() % 5535) - 2767;
+      if (s > 32767) s = 32767;
+      if (s < -32768) s = -32768;
+      buf[i * channels + c] = (int16_t) s;
+    } // for c
+  } // for i
+  buf[0] = -32768;
+  buf[(frames - 1) * channels] = 32767;
+}
+
+
+int main(int argc, char **argv) {
+  unsigned int period = 1024;
+  unsigned int iters = 20000;
+  int c;
+  while ((c = getopt(argc, argv, "p:i:")) != -1) {
+    switch (c) {
+      case 'p':
+        period = atoi(optarg);
+        break;
+      case 'i':
+        iters = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-p period] [-i iterations]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+
+  unsigned int channelCounts[] = { 1, 2, 4, 8 };
+  unsigned int n;
+  printf("period %u frames, %u iterations\n", period, iters);
+  printf("channels  scalar ns/frame  simd ns/frame  speedup\n");
+  for (n = 0; n < sizeof(channelCounts) / sizeof(channelCounts[0]); n++) {
+    unsigned int channels = channelCounts[n];
+    int16_t *buf = (int16_t *) malloc(period * channels * sizeof(int16_t));
+    fill(buf, period, channels);
+
+    // both versions must agree on every channel
+    unsigned int chan;
+    for (chan = 0; chan < channels; chan++) {
+      s16stats a, b;
+      s16_stats_scalar(buf, period, channels, chan, &a);
+      s16_stats(buf, period, channels, chan, &b);
+      if (a.min != b.min || a.max != b.max || a.sumsq != b.sumsq ||
+          a.frames != b.frames) {
+        fprintf(stderr, "mismatch on %u channels, chan %u\n", channels, chan);
+        exit(1);
+      } // if mismatch
+    } // for chan
+
+    volatile uint64_t sink = 0;
+    s16stats st;
+    unsigned int i;
+    double start = nowSec();
+    for (i = 0; i < iters; i++) {
+      s16_stats_scalar(buf, period, channels, 0, &st);
+      sink += st.sumsq;
+    } // for scalar
+    double scalar = (nowSec() - start) / iters / period * 1e9;
+    start = nowSec();
+    for (i = 0; i < iters; i++) {
+      s16_stats(buf, period, channels, 0, &st);
+      sink += st.sumsq;
+    } // for simd
+    double simd = (nowSec() - start) / iters / period * 1e9;
+
+    printf("%8u  %15.3f  %13.3f  %6.2fx\n", channels, scalar, simd, scalar / simd);
+    free(buf);
+  } // for channel counts
+
+  // the onset detector runs once per period after the fft of the period,
+  // planned as vupeak plans it, measuring overwrites the input
+  float *in = fftwf_alloc_real(period);
+  fftwf_complex *out = fftwf_alloc_complex(period / 2 + 1);
+  fftwf_plan plan = fftwf_plan_dft_r2c_1d(period, in, out, FFTW_MEASURE);
+  unsigned int i;
+  for (i = 0; i < period; i++) in[i] = sinf(2.0f * (float) M_PI * 440.0f * i / 44100.0f);
+  double start = nowSec();
+  for (i = 0; i < iters; i++) fftwf_execute(plan);
+  double fft = (nowSec() - start) / iters * 1e9;
+  printf("\nfft %u points %.0f ns/period\n", period, fft);
+
+  unsigned int bandCounts[] = { 16, 64, 128 };
+  printf("bands  onset ns/period  of fft\n");
+  for (n = 0; n < sizeof(bandCounts) / sizeof(bandCounts[0]); n++) {
+    unsigned int bands = bandCounts[n];
+    float *power = (float *) malloc(sizeof(float) * bands);
+    onset o;
+    onset_init(&o, bands, 0.02, 2.0, 1.0, 4);
+    volatile int sink = 0;
+    start = nowSec();
+    for (i = 0; i < iters; i++) {
+      unsigned int b;
+      // alternate two spectra so the flux is never zero
+      for (b = 0; b < bands; b++) power[b] = (i & 1) ? b + 1 : bands - b;
+      sink += onset_update(&o, power);
+    } // for iters
+    double ns = (nowSec() - start) / iters * 1e9;
+    printf("%5u  %15.0f  %5.1f%%\n", bands, ns, 100.0 * ns / fft);
+    onset_free(&o);
+    free(power);
+  } // for band counts
+
+  fftwf_destroy_plan(plan);
+  fftwf_free(in);
+  fftwf_free(out);
+  return 0;
+}
@@ -0,0 +1,209 @@
+// sample kernels for vupeak
+// S16_LE buffers are read as native int16_t, which is correct on the
+// little-endian hosts (ARM, x86) the examples run on
+
+#include <math.h>
+#include <stdlib.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vukernels.h"
+
+
+void s16_stats_scalar(const int16_t *buf, unsigned int frames,
+                      unsigned int channels, unsigned int chan, s16stats *st) {
+  int min = 32767;
+  int max = -32768;
+  uint64_t sumsq = 0;
+  unsigned int i;
+  for (i = 0; i < frames; i++) {
+    int sample = buf[i * channels + chan];
+    if (sample < min) min = sample;
+    if (sample > max) max = sample;
+    sumsq += (int64_t) sample * sample;
+  } // for i
+  st->min = min;
+  st->max = max;
+  st->sumsq = sumsq;
+  st->frames = frames;
+}
+
+
+#if defined(__ARM_NEON) || defined(__SSE2__)
+
+// merge the stats of a loop tail into st
+static void merge_tail(const int16_t *buf, unsigned int frames,
+                       unsigned int channels, unsigned int chan, s16stats *st) {
+  s16stats tail;
+  if (frames == 0) return;
+  s16_stats_scalar(buf, frames, channels, chan, &tail);
+  if (tail.min < st->min) st->min = tail.min;
+  if (tail.max > st->max) st->max = tail.max;
+  st->sumsq += tail.sumsq;
+  st->frames += frames;
+}
+
+#endif
+
+
+#if defined(__ARM_NEON)
+
+void s16_stats(const int16_t *buf, unsigned int frames,
+               unsigned int channels, unsigned int chan, s16stats *st) {
+  if (channels > 2) {
+    s16_stats_scalar(buf, frames, channels, chan, st);
+    return;
+  } // if channels
+
+  int16x8_t vmin = vdupq_n_s16(32767);
+  int16x8_t vmax = vdupq_n_s16(-32768);
+  int64x2_t vsum = vdupq_n_s64(0);
+  unsigned int i;
+  // 8 frames per pass, vld2q deinterleaves stereo
+  for (i = 0; i + 8 <= frames; i += 8) {
+    int16x8_t v;
+    if (channels == 1) {
+      v = vld1q_s16(buf + i);
+    } else {
+      int16x8x2_t lr = vld2q_s16(buf + i * 2);
+      v = chan ? lr.val[1] : lr.val[0];
+    } // if channels
+    vmin = vminq_s16(vmin, v);
+    vmax = vmaxq_s16(vmax, v);
+    int32x4_t sqlo = vmull_s16(vget_low_s16(v), vget_low_s16(v));
+    int32x4_t sqhi = vmull_s16(vget_high_s16(v), vget_high_s16(v));
+    vsum = vpadalq_s32(vsum, sqlo);
+    vsum = vpadalq_s32(vsum, sqhi);
+  } // for i
+
+  int16x4_t m = vpmin_s16(vget_low_s16(vmin), vget_high_s16(vmin));
+  m = vpmin_s16(m, m);
+  m = vpmin_s16(m, m);
+  st->min = vget_lane_s16(m, 0);
+  m = vpmax_s16(vget_low_s16(vmax), vget_high_s16(vmax));
+  m = vpmax_s16(m, m);
+  m = vpmax_s16(m, m);
+  st->max = vget_lane_s16(m, 0);
+  st->sumsq = vgetq_lane_s64(vsum, 0) + vgetq_lane_s64(vsum, 1);
+  st->frames = i;
+  merge_tail(buf + i * channels, frames - i, channels, chan, st);
+}
+
+#elif defined(__SSE2__)
+
+void s16_stats(const int16_t *buf, unsigned int frames,
+               unsigned int channels, unsigned int chan, s16stats *st) {
+  if (channels > 2) {
+    s16_stats_scalar(buf, frames, channels, chan, st);
+    return;
+  } // if channels
+
+  __m128i vmin = _mm_set1_epi16(32767);
+  __m128i vmax = _mm_set1_epi16(-32768);
+  __m128i vsum = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  unsigned int i;
+  // 8 frames per pass, stereo is split with shifts on 32-bit lanes
+  for (i = 0; i + 8 <= frames; i += 8) {
+    __m128i v;
+    if (channels == 1) {
+      v = _mm_loadu_si128((const __m128i *) (buf + i));
+    } else {
+      __m128i a = _mm_loadu_si128((const __m128i *) (buf + i * 2));
+      __m128i b = _mm_loadu_si128((const __m128i *) (buf + i * 2 + 8));
+      if (chan == 0) {
+        a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+      } else {
+        a = _mm_srai_epi32(a, 16);
+        b = _mm_srai_epi32(b, 16);
+      } // if chan
+      v = _mm_packs_epi32(a, b);
+    } // if channels
+    vmin = _mm_min_epi16(vmin, v);
+    vmax = _mm_max_epi16(vmax, v);
+    // pairs of squares fit in 32 bits only as unsigned, so widen unsigned
+    __m128i sq = _mm_madd_epi16(v, v);
+    vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(sq, zero));
+    vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(sq, zero));
+  } // for i
+
+  int16_t mins[8], maxs[8];
+  uint64_t sums[2];
+  _mm_storeu_si128((__m128i *) mins, vmin);
+  _mm_storeu_si128((__m128i *) maxs, vmax);
+  _mm_storeu_si128((__m128i *) sums, vsum);
+  st->min = 32767;
+  st->max = -32768;
+  int j;
+  for (j = 0; j < 8; j++) {
+    if (mins[j] < st->min) st->min = mins[j];
+    if (maxs[j] > st->max) st->max = maxs[j];
+  } // for j
+  st->sumsq = sums[0] + sums[1];
+  st->frames = i;
+  merge_tail(buf + i * channels, frames - i, channels, chan, st);
+}
+
+#else
+
+void s16_stats(const int16_t *buf, unsigned int frames,
+               unsigned int channels, unsigned int chan, s16stats *st) {
+  s16_stats_scalar(buf, frames, channels, chan, st);
+}
+
+#endif
+
+
+double s16_rms(const s16stats *st) {
+  if (st->frames == 0) return 0;
+  return sqrt((double) st->sumsq / st->frames);
+}
+
+
+int onset_init(onset *o, unsigned int bands, float alpha, float k,
+               float floor, unsigned int holdoff) {
+  o->prev = (float *) calloc(bands, sizeof(float));
+  o->bands = bands;
+  o->alpha = alpha;
+  o->k = k;
+  o->floor = floor;
+  o->holdoff = holdoff;
+  // let the running averages settle before the first onset
+  o->wait = 1.0f / alpha;
+  o->mean = 0;
+  o->dev = 0;
+  o->flux = 0;
+  return o->prev ? 0 : -1;
+}
+
+
+int onset_update(onset *o, const float *power) {
+  // half wave rectified rise of the band amplitudes
+  float flux = 0;
+  unsigned int b;
+  for (b = 0; b < o->bands; b++) {
+    float amp = sqrtf(power[b]);
+    float rise = amp - o->prev[b];
+    if (rise > 0) flux += rise;
+    o->prev[b] = amp;
+  } // for b
+  o->flux = flux;
+
+  int hit = o->wait == 0 && flux > o->floor && flux > o->mean + o->k * o->dev;
+  if (o->wait > 0) o->wait--;
+  if (hit) o->wait = o->holdoff;
+
+  o->dev += o->alpha * (fabsf(flux - o->mean) - o->dev);
+  o->mean += o->alpha * (flux - o->mean);
+  return hit;
+}
+
+
+void onset_free(onset *o) {
+  free(o->prev);
+  o->prev = NULL;
+}
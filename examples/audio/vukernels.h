@@ -0,0 +1,49 @@
+#ifndef _VUKERNELS_H
+#define _VUKERNELS_H
+
+#include <stdint.h>
+
+// min, max and sum of squares of one channel over a period
+typedef struct s16statss {
+  int min;
+  int max;
+  uint64_t sumsq;
+  unsigned int frames;
+} s16stats;
+
+// stats of channel chan of interleaved S16 frames, SIMD where available
+void s16_stats(const int16_t *buf, unsigned int frames,
+               unsigned int channels, unsigned int chan, s16stats *st);
+
+// portable version of s16_stats, also used for the loop tails
+void s16_stats_scalar(const int16_t *buf, unsigned int frames,
+                      unsigned int channels, unsigned int chan, s16stats *st);
+
+// root mean square of the samples in st
+double s16_rms(const s16stats *st);
+
+// onset detector, spectral flux of band powers against an adaptive
+// threshold of the running mean plus k running mean deviations
+typedef struct onsets {
+  float *prev;                      // band amplitudes of the last period
+  unsigned int bands;
+  float alpha;                      // running average weight per period
+  float k;                          // deviations above the mean for an onset
+  float floor;                      // flux below this is never an onset
+  unsigned int holdoff;             // periods ignored after an onset
+  unsigned int wait;                // periods left to ignore
+  float mean;                       // running mean of the flux
+  float dev;                        // running mean deviation of the flux
+  float flux;                       // flux of the last period
+} onset;
+
+// set up o for bands band powers, 0 on success
+int onset_init(onset *o, unsigned int bands, float alpha, float k,
+               float floor, unsigned int holdoff);
+
+// feed the band powers of one period, 1 if it is an onset
+int onset_update(onset *o, const float *power);
+
+void onset_free(onset *o);
+
+#endif
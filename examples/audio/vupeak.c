@@ -1,4 +1,6 @@
 #include "vupeak.h"
+#include "vukernels.h"
+#include "spsc.h"
 
 /* Use the newer ALSA API */
 #define ALSA_PCM_NEW_HW_PARAMS_API
@@ -8,45 +10,121 @@
 #include <signal.h>
 #include <fftw3.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include "config.h"
 
-// globals, defined here only for intHandler() to cleanup
+// periods buffered between the capture and dsp stages, power of two
+#define AUDIO_SLOTS 16
+
+// spectrum band levels, power thresholds between BAND_MIN_DB and BAND_MAX_DB
+#define BAND_LEVELS 256
+#define BAND_MIN_DB 10.0
+#define BAND_MAX_DB 77.0
+
+// one captured period of interleaved samples
+typedef struct periods {
+  struct timespec stamp;
+  int16_t samples[];
+} period;
+
+// fft state of one analysed channel
+typedef struct spectrums {
+  float *hist;                      // last fft_size samples
+  float *in;                        // windowed history
+  fftwf_complex *out;
+  unsigned int *off;                // smoothed OFF value of each band
+  float *power;                     // summed bin power of each band
+  onset beat;
+} spectrum;
+
+// one dsp result for the output stage
+typedef struct results {
+  struct timespec stamp;            // capture time of the newest period
+  int all;                          // ALL_LED OFF value, -1 to use off[]
+  unsigned int off[];               // _PCA9685_CHANS per chip
+} result;
+
+// globals, shared by the pipeline stages and main() for cleanup
 audiopwm args;
 int fd;
-char *buffer;
+unsigned char *addrs;
 snd_pcm_t *handle;
+// input file instead of ALSA, mapped interleaved S16_LE frames
+const int16_t *fileSamples;
+size_t fileFrames;
+// every dsp result as text for golden comparisons
+FILE *dump;
 // verbosity flag
 bool verbose = false;
+// cleared by main() to stop the stages
+atomic_bool running = true;
 
+// capture -> dsp ring of periods, dsp -> output newest result
+spsc audioRing;
+latest resultBox;
+sem_t audioReady;
+sem_t resultReady;
 
-void intHandler(int dummy) {
-  // turn off all channels
-  PCA9685_setAllPWM(fd, args.pwm_addr, _PCA9685_MINVAL, _PCA9685_MINVAL);
+// pipeline counters, each written by one stage and read by main()
+atomic_uint capturePeriods;   // periods read from ALSA
+atomic_uint captureXruns;     // ALSA overruns (-EPIPE)
+atomic_uint captureDropped;   // periods dropped because the dsp ring was full
+atomic_uint dspPeriods;       // periods processed
+atomic_uint dspMaxDepth;      // deepest dsp ring since the last report
+atomic_ullong dspCpuNs;       // dsp time including the worker pool
+atomic_uint dspCpuMaxNs;      // slowest period since the last report
+atomic_uint outputFrames;     // frames sent to the PCA9685
+atomic_uint outputSkipped;    // results replaced before the output sent them
+atomic_ullong outputLatencyNs; // capture to i2c write complete
+atomic_uint outputLatencyMaxNs;
+atomic_uint dspOnsets;        // onsets over all analysed channels
 
-  // cleanup alsa
-  snd_pcm_drain(handle);
-  snd_pcm_close(handle);
-  //free(buffer);
+// onsets of each analysed channel, counted by the dsp and flashed by the
+// output stage so that none is lost when a result is skipped
+atomic_uint *onsetCount;
 
-  // cleanup fftw
-  //fftw_destroy_plan(p);
-  //fftw_free(in);
-  //fftw_free(out);
+// dsp state, the plan is shared by every analysed channel
+fftwf_plan plan;
+spectrum *spec;                       // one per analysed channel
+float *han;                           // window with the 2/N amplitude scale
+
+// spectrum bands, one per pwm channel over the chips of an analysed channel
+unsigned int bands;
+unsigned int *bandLo;                 // first fft bin of each band
+unsigned int *bandHi;                 // last fft bin of each band
+
+// dsp worker pool, worker w analyses channels w, w + dsp_threads, ...
+// the dsp thread itself is worker 0
+pthread_t *workers;
+sem_t *workStart;                     // one per worker
+sem_t workDone;
+const int16_t *workSamples;
+result *workResult;
+float levelPower[BAND_LEVELS];        // summed bin power at each level
+unsigned int levelVal[BAND_LEVELS];   // OFF value of each level
 
-  exit(dummy);
-}
 
 int initPCA9685(audiopwm args) {
   _PCA9685_DEBUG = args.pwm_debug;
   int afd = PCA9685_openI2C(args.pwm_bus, args.pwm_addr);
-  PCA9685_initPWM(afd, args.pwm_addr, args.pwm_freq);
+  // chips are at consecutive addresses from -a
+  addrs = (unsigned char *) malloc(args.pwm_chips);
+  unsigned int i;
+  for (i = 0; i < args.pwm_chips; i++) addrs[i] = args.pwm_addr + i;
+  PCA9685_initPWMs(afd, args.pwm_chips, addrs, args.pwm_freq);
   return afd;
 }
 
 
-snd_pcm_t* initALSA(audiopwm args, char **bufferPtr) {
+snd_pcm_t* initALSA(audiopwm args) {
   int rc;
   int size;
   snd_pcm_t *handle;
@@ -60,11 +138,12 @@ snd_pcm_t* initALSA(audiopwm args, char **bufferPtr) {
   snd_pcm_hw_params_alloca(&params);
   rc = snd_pcm_hw_params_any(handle, params);
   if (rc < 0) fprintf(stderr, "snd_pcm_hw_params_any() failed %d\n", rc);
-  rc = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+  rc = snd_pcm_hw_params_set_access(handle, params, args.audio_mmap ?
+                                    SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
   if (rc < 0) fprintf(stderr, "snd_pcm_hw_params_set_access() failed %d\n", rc);
   rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
   if (rc < 0) fprintf(stderr, "snd_pcm_hw_params_set_format() failed %d\n", rc);
-  rc = snd_pcm_hw_params_set_channels(handle, params, 2);
+  rc = snd_pcm_hw_params_set_channels(handle, params, args.audio_channels);
   if (rc < 0) fprintf(stderr, "snd_pcm_hw_params_set_channels() failed %d\n", rc);
   //unsigned int rate = args.audio_rate;
   rc = snd_pcm_hw_params_set_rate_near(handle, params, &args.audio_rate, NULL);
@@ -83,22 +162,91 @@ snd_pcm_t* initALSA(audiopwm args, char **bufferPtr) {
     exit(1);
   }
   snd_pcm_hw_params_get_period_size(params, framesPtr, NULL);
-  size = *framesPtr * 2 * args.audio_channels; /* 2 bytes/sample, 2 channels */
+  size = *framesPtr * 2 * args.audio_channels; /* 2 bytes/sample */
   fprintf(stdout, "buffer size %d\n", size);
-  *bufferPtr = (char *) malloc(size);
   rc = snd_pcm_hw_params_get_period_time(params, &val, NULL);
   if (rc < 0) fprintf(stderr, "snd_pcm_hw_params_get_period_time() failed %d\n", rc);
+  if (args.audio_mmap) {
+    // poll() wakes once a whole period is in the ring
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+    rc = snd_pcm_sw_params_current(handle, swparams);
+    if (rc < 0) fprintf(stderr, "snd_pcm_sw_params_current() failed %d\n", rc);
+    rc = snd_pcm_sw_params_set_avail_min(handle, swparams, *framesPtr);
+    if (rc < 0) fprintf(stderr, "snd_pcm_sw_params_set_avail_min() failed %d\n", rc);
+    rc = snd_pcm_sw_params(handle, swparams);
+    if (rc < 0) fprintf(stderr, "snd_pcm_sw_params() failed %d\n", rc);
+  } // if mmap
   return handle;
 }
 
 
 
-double *hanning(int N) {
+// map a WAV or raw S16_LE input file, a WAV header overrides -r and -c
+void initFile(audiopwm *args) {
+  int ffd = open(args->input_file, O_RDONLY);
+  struct stat st;
+  if (ffd < 0 || fstat(ffd, &st) < 0) {
+    fprintf(stderr, "unable to open input file '%s'\n", args->input_file);
+    exit(1);
+  } // if ffd
+  const unsigned char *map = NULL;
+  if (st.st_size > 0) map = (const unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ffd, 0);
+  close(ffd);
+  if (map == NULL || map == MAP_FAILED) {
+    fprintf(stderr, "unable to map input file '%s'\n", args->input_file);
+    exit(1);
+  } // if map
+
+  const unsigned char *data = map;
+  size_t size = st.st_size;
+  if (size >= 12 && memcmp(map, "RIFF", 4) == 0 && memcmp(map + 8, "WAVE", 4) == 0) {
+    // walk the chunks for fmt and data
+    size_t pos = 12;
+    uint16_t format = 0, bits = 0;
+    data = NULL;
+    while (pos + 8 <= (size_t) st.st_size) {
+      uint32_t len;
+      memcpy(&len, map + pos + 4, 4);
+      const unsigned char *chunk = map + pos + 8;
+      size_t avail = st.st_size - pos - 8;
+      if (len > avail) len = avail;
+      if (memcmp(map + pos, "fmt ", 4) == 0 && len >= 16) {
+        uint16_t channels;
+        uint32_t rate;
+        memcpy(&format, chunk, 2);
+        memcpy(&channels, chunk + 2, 2);
+        memcpy(&rate, chunk + 4, 4);
+        memcpy(&bits, chunk + 14, 2);
+        args->audio_channels = channels;
+        args->audio_rate = rate;
+      } else if (memcmp(map + pos, "data", 4) == 0) {
+        data = chunk;
+        size = len;
+        break;
+      } // if chunk
+      pos += 8 + len + (len & 1);
+    } // while pos
+    if (data == NULL || (format != 1 && format != 0xFFFE) || bits != 16) {
+      fprintf(stderr, "'%s' is not a 16 bit PCM WAV file\n", args->input_file);
+      exit(1);
+    } // if data
+  } // if WAV
+
+  fileSamples = (const int16_t *) data;
+  fileFrames = size / (sizeof(int16_t) * args->audio_channels);
+  fprintf(stdout, "input '%s' %zu frames %u channels at %u Hz\n",
+          args->input_file, fileFrames, args->audio_channels, args->audio_rate);
+}
+
+
+// hanning window with scale folded in, aligned for the fftw simd codelets
+float *hanning(int N, double scale) {
   int i;
-  double *window = (double *) malloc(sizeof(double) * N);
+  float *window = fftwf_alloc_real(N);
   if (verbose) fprintf(stdout, "hanning: ");
   for (i = 0; i < N; i++) {
-    window[i] = 0.5 * (1 - cos(2 * M_PI * i / N));
+    window[i] = scale * 0.5 * (1 - cos(2 * M_PI * i / N));
     if (verbose) fprintf(stdout, "%f ", window[i]);
   }
   if (verbose) fprintf(stdout, "\n");
@@ -106,23 +254,149 @@ double *hanning(int N) {
 }
 
 
+// log spaced bands from band_low to band_high Hz, each summing a range of
+// fft bins, and the bin power thresholds of each output level so that
+// processSpectrum() needs no sqrt() or log() per bin
+void initBands(audiopwm args) {
+  unsigned int N = args.fft_size;
+  double binHz = (double) args.audio_rate / N;
+  double span = (double) args.band_high / args.band_low;
+  bands = args.pwm_chips / args.audio_analysed * _PCA9685_CHANS;
+  bandLo = (unsigned int *) malloc(sizeof(unsigned int) * bands);
+  bandHi = (unsigned int *) malloc(sizeof(unsigned int) * bands);
+  unsigned int ch;
+  for (ch = 0; ch < args.audio_analysed; ch++) {
+    spec[ch].off = (unsigned int *) calloc(bands, sizeof(unsigned int));
+  } // for ch
+
+  unsigned int b;
+  for (b = 0; b < bands; b++) {
+    double fLo = args.band_low * pow(span, (double) b / bands);
+    double fHi = args.band_low * pow(span, (double) (b + 1) / bands);
+    long lo = lround(fLo / binHz);
+    long hi = lround(fHi / binHz) - 1;
+    // low bands narrower than a bin share it
+    if (lo < 1) lo = 1;
+    if (lo > (long) N / 2) lo = N / 2;
+    if (hi < lo) hi = lo;
+    if (hi > (long) N / 2) hi = N / 2;
+    bandLo[b] = lo;
+    bandHi[b] = hi;
+    if (verbose) fprintf(stdout, "band %2u: %6.0f - %6.0f Hz bins %3ld - %3ld\n", b, fLo, fHi, lo, hi);
+  } // for b
+
+  // the window carries the 2/N amplitude scale, so a level of dB
+  // 20 * log10(sqrt(power)) needs a power of 10^(dB/10)
+  unsigned int k;
+  for (k = 0; k < BAND_LEVELS; k++) {
+    double ratio = (double) k / (BAND_LEVELS - 1);
+    double dB = BAND_MIN_DB + ratio * (BAND_MAX_DB - BAND_MIN_DB);
+    levelPower[k] = pow(10.0, dB / 10.0);
+    ratio *= ratio;
+    ratio *= ratio;
+    ratio *= ratio;
+    levelVal[k] = _PCA9685_MAXVAL * ratio;
+  } // for k
+
+  // onsets against a one second running average, at most ten a second,
+  // with a flux of at least the amplitude of the lowest level
+  float alpha = (float) args.audio_period / args.audio_rate;
+  unsigned int holdoff = args.audio_rate / 10 / args.audio_period;
+  onsetCount = (atomic_uint *) calloc(args.audio_analysed, sizeof(atomic_uint));
+  for (ch = 0; ch < args.audio_analysed; ch++) {
+    spec[ch].power = (float *) calloc(bands, sizeof(float));
+    onset_init(&spec[ch].beat, bands, alpha > 1 ? 1 : alpha, args.onset_k,
+               sqrtf(levelPower[0]), holdoff);
+  } // for ch
+}
+
+
+// highest level whose threshold the power reaches, -1 below the first
+int bandLevel(float power) {
+  if (power < levelPower[0]) return -1;
+  unsigned int lo = 0;
+  unsigned int hi = BAND_LEVELS - 1;
+  while (lo < hi) {
+    unsigned int mid = (lo + hi + 1) / 2;
+    if (power >= levelPower[mid]) lo = mid;
+    else hi = mid - 1;
+  } // while
+  return lo;
+}
+
+
+// fftw plan for fft_size points, measured once and then loaded from the
+// wisdom file, run every period over the history of the last fft_size samples
+void initFFT(audiopwm args) {
+  int N = args.fft_size;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // fftwf_alloc keeps every channel's buffers at the alignment of the plan
+  spec = (spectrum *) calloc(args.audio_analysed, sizeof(spectrum));
+  unsigned int ch;
+  for (ch = 0; ch < args.audio_analysed; ch++) {
+    spec[ch].in = fftwf_alloc_real(N);
+    spec[ch].out = fftwf_alloc_complex(N / 2 + 1);
+    spec[ch].hist = (float *) calloc(N, sizeof(float));
+    if (spec[ch].in == NULL || spec[ch].out == NULL || spec[ch].hist == NULL) {
+      fprintf(stderr, "unable to allocate fft buffers\n");
+      exit(1);
+    } // if alloc
+  } // for ch
+  han = hanning(N, 2.0 / N);
+
+  // a wisdom file without a plan for N gets one added once it is measured
+  if (args.fft_wisdom[0]) fftwf_import_wisdom_from_filename(args.fft_wisdom);
+  plan = fftwf_plan_dft_r2c_1d(N, spec[0].in, spec[0].out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+  bool wise = plan != NULL;
+  if (!wise) {
+    plan = fftwf_plan_dft_r2c_1d(N, spec[0].in, spec[0].out, FFTW_MEASURE);
+    if (args.fft_wisdom[0] && !fftwf_export_wisdom_to_filename(args.fft_wisdom)) {
+      fprintf(stderr, "unable to save fftw wisdom to %s\n", args.fft_wisdom);
+    } // if !export
+  } // if !wise
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stdout, "fft plan %d points %s %.1f ms\n", N, wise ? "from wisdom" : "measured",
+          (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+  fprintf(stdout, "fft window %.1f ms every %.1f ms, %.1f Hz bins\n",
+          1000.0 * N / args.audio_rate, 1000.0 * args.audio_period / args.audio_rate,
+          (double) args.audio_rate / N);
+}
+
+
 // period p 1024, rate r 44100, bus b 1, address a 0x40, pwm freq f 200, audio device d default, mode m level (spectrum)
 void process_args(int argc, char **argv) {
   // default values
   args.mode = 1;
   args.audio_device = "default";
+  args.input_file = NULL;
+  args.input_fast = false;
+  args.frame_dump = NULL;
   args.audio_period = 1024;
   args.audio_rate = 44100;
   args.audio_channels = 2;
+  args.audio_mmap = false;
+  args.audio_analysed = 1;
+  args.dsp_threads = 0;
   args.pwm_bus = 1;
   args.pwm_addr = 0x40;
+  args.pwm_chips = 1;
   args.pwm_freq = 200;
   args.pwm_debug = false;
   args.pwm_smoothing = 10;
+  args.stats_interval = 0;
+  args.band_low = 40;
+  args.band_high = 12000;
+  args.onset_fade = 0;
+  args.onset_k = 2.0;
+  args.fft_size = 0;
+  args.fft_wisdom = "/var/cache/vupeak.wisdom";
 
   opterr = 0;
   int c;
-  while ((c = getopt(argc, argv, "m:d:p:r:c:b:a:f:vDs:")) != -1) {
+  while ((c = getopt(argc, argv, "m:d:Mi:xo:p:r:c:A:T:b:a:n:f:vDs:S:L:H:O:K:N:W:")) != -1) {
     switch (c) {
       case 'm':
         args.mode = 0;
@@ -136,6 +410,18 @@ void process_args(int argc, char **argv) {
       case 'd':
         args.audio_device = optarg;
         break;
+      case 'M':
+        args.audio_mmap = true;
+        break;
+      case 'i':
+        args.input_file = optarg;
+        break;
+      case 'x':
+        args.input_fast = true;
+        break;
+      case 'o':
+        args.frame_dump = optarg;
+        break;
       case 'p':
         args.audio_period = atoi(optarg);
         break;
@@ -145,12 +431,21 @@ void process_args(int argc, char **argv) {
       case 'c':
         args.audio_channels = atoi(optarg);
         break;
+      case 'A':
+        args.audio_analysed = atoi(optarg);
+        break;
+      case 'T':
+        args.dsp_threads = atoi(optarg);
+        break;
       case 'b':
         args.pwm_bus = atoi(optarg);
         break;
       case 'a':
         args.pwm_addr = atoi(optarg);
         break;
+      case 'n':
+        args.pwm_chips = atoi(optarg);
+        break;
       case 'f':
         args.pwm_freq = atoi(optarg);
         break;
@@ -163,6 +458,27 @@ void process_args(int argc, char **argv) {
       case 's':
         args.pwm_smoothing = atoi(optarg);
         break;
+      case 'S':
+        args.stats_interval = atoi(optarg);
+        break;
+      case 'L':
+        args.band_low = atoi(optarg);
+        break;
+      case 'H':
+        args.band_high = atoi(optarg);
+        break;
+      case 'O':
+        args.onset_fade = atoi(optarg);
+        break;
+      case 'K':
+        args.onset_k = atof(optarg);
+        break;
+      case 'N':
+        args.fft_size = atoi(optarg);
+        break;
+      case 'W':
+        args.fft_wisdom = optarg;
+        break;
       case '?':
         fprintf(stderr, "problem\n");
         exit(-1);
@@ -172,12 +488,34 @@ void process_args(int argc, char **argv) {
     } //switch
   } // while
   // sanity checks
+  if (args.fft_size == 0) args.fft_size = args.audio_period;
+  if (args.fft_size < args.audio_period) {
+    fprintf(stderr, "Illegal fft size %u, must be at least the period %u\n", args.fft_size, args.audio_period);
+    exit(-1);
+  } // if fft
+  if (args.pwm_chips < 1 || args.pwm_addr + args.pwm_chips > 0x80) {
+    fprintf(stderr, "Illegal chip count %u at address 0x%02x\n", args.pwm_chips, args.pwm_addr);
+    exit(-1);
+  } // if chips
+  if (args.audio_analysed < 1 || args.pwm_chips % args.audio_analysed != 0) {
+    fprintf(stderr, "Illegal analysed channel count %u for %u chips\n", args.audio_analysed, args.pwm_chips);
+    exit(-1);
+  } // if analysed
+  if (args.dsp_threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    args.dsp_threads = cores < 1 ? 1 : cores;
+  } // if threads
+  if (args.dsp_threads > args.audio_analysed) args.dsp_threads = args.audio_analysed;
+  if (args.band_low < 1 || args.band_high <= args.band_low) {
+    fprintf(stderr, "Illegal band range %u - %u Hz\n", args.band_low, args.band_high);
+    exit(-1);
+  } // if bands
   if (args.mode == 1) {
     fprintf(stdout, "'level' mode suggested args: -p 24 -r 44100 -s 1\n");
     fprintf(stdout, "'level' mode suggested input volume at 100%%\n");
   } // if mode && period
   else if (args.mode == 2) {
-    fprintf(stdout, "'spectrum' mode suggested args: -p 1024 -r 44100 -s 3\n");
+    fprintf(stdout, "'spectrum' mode suggested args: -p 256 -N 2048 -r 44100 -s 3\n");
     fprintf(stdout, "'spectrum' mode suggested cut input volume to 50%%\n");
   } // if mode && period
 } // process_args
@@ -185,143 +523,533 @@ void process_args(int argc, char **argv) {
 
 
 
-int main(int argc, char **argv) {
-  setvbuf(stdout, NULL, _IONBF, 0);
-  fprintf(stdout, "vupeak %d.%d\n", libPCA9685_VERSION_MAJOR, libPCA9685_VERSION_MINOR);
-  process_args(argc, argv);
 
-  signal(SIGINT, intHandler);
 
-  // ALSA init
-  handle = initALSA(args, &buffer);
+// level mode, peak-to-peak range of the first channel drives all channels
+void processLevel(const int16_t *samples, result *r) {
+  static int average = 0;
+  static int minValue = 32000;
 
-  // libPCA9685 init
-  fd = initPCA9685(args);
+  // find the min and max value of the first channel in all frames
+  s16stats st;
+  s16_stats(samples, args.audio_period, args.audio_channels, 0, &st);
 
-  // fftw init
-  int N = args.audio_period;
-  fftw_plan p;
-  fftw_complex *out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * N);
-  double in[N];
-  p = fftw_plan_dft_r2c_1d(N, in, out, FFTW_ESTIMATE);
-  double *han = hanning(N);
-
-  int average = 0;
-  int minValue = 32000;
-  int rc = 64;
-  rc = 1024;
-  int count = 0;
-  double min[16] = { 10,15,25, 10,10,10, 9,9,9, 8,8,8, 8,8,8, 0 };
-  double max[16] = { 77,77,77, 77,77,77, 77,77,77, 77,77,77, 77,77,77, 0 };
+  // intensity-based value
+  int intensity_value = st.max - st.min;
+
+  // minValue is the smallest value seen, use for offset
+  if (intensity_value < minValue) {
+    minValue = intensity_value;
+  }
+  intensity_value -= minValue;
+
+  // modified moving average for smoothing
+  int alpha = args.pwm_smoothing;
+  average = (intensity_value + (alpha-1) * average) / alpha;
+
+  int ratio = 100.0 * average / 65535;
+  ratio = (ratio / 10.0) * (ratio / 10.0);
+  ratio = (ratio / 10.0) * (ratio / 10.0);
+  if (ratio < 0) ratio = 0;
+  if (ratio > 100) ratio = 100;
+
+  r->all = ratio / 100.0 * _PCA9685_MAXVAL;
+  if (verbose) fprintf(stdout, "%d %d %.0f\n", intensity_value, ratio, s16_rms(&st));
+}
+
+
+// summed power of log spaced bands of one channel into its OFF values
+void analyseChannel(const int16_t *samples, unsigned int ch, unsigned int *off) {
+  spectrum *sp = &spec[ch];
+
+  // slide the channel of the period into the history, the fft hops
+  // one period at a time over the last fft_size samples
+  unsigned int i;
+  unsigned int N = args.fft_size;
+  unsigned int hop = args.audio_period;
+  memmove(sp->hist, sp->hist + hop, sizeof(float) * (N - hop));
+  for (i = 0; i < hop; i++) {
+    sp->hist[N - hop + i] = samples[i * args.audio_channels + ch];
+  } // for i
+
+  // window the history for fftw
+  for (i = 0; i < N; i++) {
+    sp->in[i] = sp->hist[i] * han[i];
+  } // for i
+
+  // fftw, new-array execute is safe to run on several threads at once
+  fftwf_execute_dft_r2c(plan, sp->in, sp->out);
+
+  unsigned int b;
+  int alpha = args.pwm_smoothing;
+  for (b = 0; b < bands; b++) {
+    float power = 0;
+    for (i = bandLo[b]; i <= bandHi[b]; i++) {
+      power += sp->out[i][0] * sp->out[i][0] + sp->out[i][1] * sp->out[i][1];
+    } // for i
+    sp->power[b] = power;
+    int level = bandLevel(power);
+    unsigned int val = level < 0 ? 0 : levelVal[level];
+    sp->off[b] = ((alpha - 1) * sp->off[b] + val) / alpha;
+    if (verbose && ch == 0) fprintf(stdout, "%2u:%3d  ", b, level);
+  } // for b
+  if (verbose && ch == 0) fprintf(stdout, "\n");
+
+  if (args.onset_fade && onset_update(&sp->beat, sp->power)) {
+    atomic_fetch_add(&onsetCount[ch], 1);
+    atomic_fetch_add(&dspOnsets, 1);
+  } // if onset
+
+  memcpy(off, sp->off, sizeof(unsigned int) * bands);
+}
+
+
+// analyse the channels of worker w
+void analyseChannels(unsigned int w) {
+  unsigned int ch;
+  for (ch = w; ch < args.audio_analysed; ch += args.dsp_threads) {
+    analyseChannel(workSamples, ch, workResult->off + ch * bands);
+  } // for ch
+}
+
+
+// dsp pool worker, waits for a period then analyses its channels
+void *workerThread(void *arg) {
+  unsigned int w = (uintptr_t) arg;
   while (1) {
-    rc = snd_pcm_readi(handle, buffer, args.audio_period);
+    sem_wait(&workStart[w]);
+    if (!atomic_load(&running)) break;
+    analyseChannels(w);
+    sem_post(&workDone);
+  } // while 1
+  return NULL;
+}
+
+
+// spectrum mode, each analysed channel drives the bands of its own chips,
+// the channels are spread over the worker pool
+void processSpectrum(const int16_t *samples, result *r) {
+  workSamples = samples;
+  workResult = r;
+  unsigned int w;
+  for (w = 1; w < args.dsp_threads; w++) sem_post(&workStart[w]);
+  analyseChannels(0);
+  for (w = 1; w < args.dsp_threads; w++) sem_wait(&workDone);
+  r->all = -1;
+}
+
+
+// capture stage, reads periods from ALSA straight into the dsp ring
+void *captureThread(void *arg) {
+  (void) arg;
+  size_t bytes = args.audio_period * args.audio_channels * sizeof(int16_t);
+  period *scratch = (period *) malloc(sizeof(period) + bytes);
+
+  while (atomic_load(&running)) {
+    // keep reading when the dsp is behind so ALSA never overruns
+    period *p = (period *) spsc_claim(&audioRing);
+    bool dropped = p == NULL;
+    if (dropped) p = scratch;
+
+    int rc = snd_pcm_readi(handle, p->samples, args.audio_period);
     if (rc == -EPIPE) {
-      fprintf(stderr, "overrun occurred\n");
+      atomic_fetch_add(&captureXruns, 1);
       snd_pcm_prepare(handle);
+      continue;
     } else if (rc < 0) {
       fprintf(stderr, "error from read: %s\n", snd_strerror(rc));
+      continue;
     } else if (rc != (int) args.audio_period) {
       fprintf(stderr, "short read, read %d frames\n", rc);
+      continue;
+    } // if rc
+    clock_gettime(CLOCK_MONOTONIC, &p->stamp);
+    atomic_fetch_add(&capturePeriods, 1);
+
+    if (dropped) {
+      atomic_fetch_add(&captureDropped, 1);
+      continue;
+    } // if dropped
+    spsc_publish(&audioRing);
+    sem_post(&audioReady);
+  } // while running
+
+  free(scratch);
+  return NULL;
+}
+
+
+// file stage, replaces capture with periods of the mapped input file at
+// the sample rate, or as fast as the dsp takes them with -x
+void *fileThread(void *arg) {
+  (void) arg;
+  size_t bytes = args.audio_period * args.audio_channels * sizeof(int16_t);
+  long periodNs = 1000000000LL * args.audio_period / args.audio_rate;
+  struct timespec start, next, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  next = start;
+
+  size_t frame;
+  for (frame = 0; frame + args.audio_period <= fileFrames; frame += args.audio_period) {
+    if (!args.input_fast) {
+      next.tv_nsec += periodNs;
+      while (next.tv_nsec >= 1000000000) {
+        next.tv_nsec -= 1000000000;
+        next.tv_sec++;
+      } // while
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    } // if !fast
+
+    // file periods are never dropped, wait for the dsp instead
+    period *p;
+    while ((p = (period *) spsc_claim(&audioRing)) == NULL && atomic_load(&running)) sched_yield();
+    if (p == NULL) break;
+    memcpy(p->samples, fileSamples + frame * args.audio_channels, bytes);
+    clock_gettime(CLOCK_MONOTONIC, &p->stamp);
+    atomic_fetch_add(&capturePeriods, 1);
+    spsc_publish(&audioRing);
+    sem_post(&audioReady);
+  } // for frame
+
+  // let the dsp finish the file, then stop like SIGTERM
+  while (spsc_depth(&audioRing) > 0 && atomic_load(&running)) sched_yield();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double audio = (double) frame / args.audio_rate;
+  double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  fprintf(stdout, "input %zu periods, %.2f s of audio in %.3f s, %.1fx real time\n",
+          frame / args.audio_period, audio, wall, wall > 0 ? audio / wall : 0.0);
+  kill(getpid(), SIGTERM);
+  return NULL;
+}
+
+
+// one line of OFF values per dsp result, every channel of every chip
+void dumpResult(const result *r) {
+  unsigned int i;
+  for (i = 0; i < args.pwm_chips * _PCA9685_CHANS; i++) {
+    fprintf(dump, "%s%03x", i ? " " : "", r->all >= 0 ? (unsigned int) r->all : r->off[i]);
+  } // for i
+  fprintf(dump, "\n");
+}
+
+
+// turn one period into a result and hand it to the output stage
+void dspPeriod(const int16_t *samples, const struct timespec *stamp) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  result *r = (result *) latest_back(&resultBox);
+  if (args.mode == 1) processLevel(samples, r);
+  else if (args.mode == 2) processSpectrum(samples, r);
+  r->stamp = *stamp;
+  if (dump) dumpResult(r);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned int ns = (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+  atomic_fetch_add(&dspCpuNs, ns);
+  if (ns > atomic_load(&dspCpuMaxNs)) atomic_store(&dspCpuMaxNs, ns);
+  atomic_fetch_add(&dspPeriods, 1);
+
+  // the output stage only ever sends the newest result
+  if (latest_publish(&resultBox)) atomic_fetch_add(&outputSkipped, 1);
+  sem_post(&resultReady);
+}
+
+
+// capture and dsp stage for -M, runs the dsp straight on the ALSA mmap
+// ring so a period is only copied when it wraps the end of the ring
+void *mmapThread(void *arg) {
+  (void) arg;
+  size_t frameBytes = args.audio_channels * sizeof(int16_t);
+  int16_t *scratch = (int16_t *) malloc(args.audio_period * frameBytes);
+  int nfds = snd_pcm_poll_descriptors_count(handle);
+  struct pollfd *pfds = (struct pollfd *) malloc(sizeof(struct pollfd) * nfds);
+  snd_pcm_poll_descriptors(handle, pfds, nfds);
+  snd_pcm_start(handle);
+
+  while (atomic_load(&running)) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+    if (avail == -EPIPE) {
+      atomic_fetch_add(&captureXruns, 1);
+      snd_pcm_prepare(handle);
+      snd_pcm_start(handle);
+      continue;
+    } else if (avail < 0) {
+      fprintf(stderr, "error from avail: %s\n", snd_strerror(avail));
+      snd_pcm_recover(handle, avail, 1);
+      continue;
+    } else if (avail < (snd_pcm_sframes_t) args.audio_period) {
+      // sleep until a whole period is ready, the timeout lets main() stop us
+      if (poll(pfds, nfds, 100) > 0) {
+        unsigned short revents;
+        snd_pcm_poll_descriptors_revents(handle, pfds, nfds, &revents);
+      } // if poll
+      continue;
+    } // if avail
+
+    struct timespec stamp;
+    clock_gettime(CLOCK_MONOTONIC, &stamp);
+    atomic_fetch_add(&capturePeriods, 1);
+
+    // the period is committed back to ALSA only after the dsp is done with it
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames = args.audio_period;
+    snd_pcm_uframes_t done = 0;
+    while (done < args.audio_period) {
+      frames = args.audio_period - done;
+      if (snd_pcm_mmap_begin(handle, &areas, &offset, &frames) < 0) break;
+      const int16_t *samples = (const int16_t *) ((const char *) areas[0].addr +
+                               (areas[0].first + offset * areas[0].step) / 8);
+      if (done == 0 && frames == args.audio_period) dspPeriod(samples, &stamp);
+      else memcpy((char *) scratch + done * frameBytes, samples, frames * frameBytes);
+      if (snd_pcm_mmap_commit(handle, offset, frames) != (snd_pcm_sframes_t) frames) break;
+      done += frames;
+    } // while done
+    if (done != args.audio_period) {
+      atomic_fetch_add(&captureXruns, 1);
+      snd_pcm_prepare(handle);
+      snd_pcm_start(handle);
+    } else if (frames != args.audio_period) {
+      dspPeriod(scratch, &stamp);
+    } // if done
+  } // while running
+
+  free(pfds);
+  free(scratch);
+  return NULL;
+}
+
+
+// dsp stage, turns each period into a result for the output stage
+void *dspThread(void *arg) {
+  (void) arg;
+  while (1) {
+    sem_wait(&audioReady);
+    if (!atomic_load(&running)) break;
+
+    unsigned int depth = spsc_depth(&audioRing);
+    if (depth > atomic_load(&dspMaxDepth)) atomic_store(&dspMaxDepth, depth);
+
+    const period *p = (const period *) spsc_peek(&audioRing);
+    dspPeriod(p->samples, &p->stamp);
+    spsc_release(&audioRing);
+  } // while 1
+  return NULL;
+}
+
+
+// flash level of a channel whose last onset was at flash, full on at the
+// onset and fading linearly to off over onset_fade ms
+unsigned int flashLevel(const struct timespec *flash, const struct timespec *now) {
+  if (flash->tv_sec == 0 && flash->tv_nsec == 0) return 0;
+  double ms = (now->tv_sec - flash->tv_sec) * 1000.0 + (now->tv_nsec - flash->tv_nsec) / 1000000.0;
+  if (ms >= args.onset_fade) return 0;
+  return _PCA9685_MAXVAL * (1.0 - ms / args.onset_fade);
+}
+
+
+// output stage, the only thread that blocks on the i2c bus
+void *outputThread(void *arg) {
+  (void) arg;
+  // ON values stay zero, only the OFF bytes change
+  unsigned char **frames = (unsigned char **) malloc(sizeof(unsigned char *) * args.pwm_chips);
+  unsigned int i;
+  for (i = 0; i < args.pwm_chips; i++) {
+    frames[i] = (unsigned char *) calloc(_PCA9685_FRAMELEN, 1);
+  } // for i
+  unsigned int *seen = (unsigned int *) calloc(args.audio_analysed, sizeof(unsigned int));
+  unsigned int *flash = (unsigned int *) calloc(args.audio_analysed, sizeof(unsigned int));
+  struct timespec *flashAt = (struct timespec *) calloc(args.audio_analysed, sizeof(struct timespec));
+
+  while (1) {
+    sem_wait(&resultReady);
+    while (sem_trywait(&resultReady) == 0);
+    if (!atomic_load(&running)) break;
+
+    result *r = (result *) latest_take(&resultBox);
+    if (r == NULL) continue;
+
+    // flash the chips of channels with a new onset, the counter is read
+    // at every write so an onset is shown within one period
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned int ch;
+    for (ch = 0; args.onset_fade && ch < args.audio_analysed; ch++) {
+      unsigned int count = atomic_load(&onsetCount[ch]);
+      if (count != seen[ch]) {
+        seen[ch] = count;
+        flashAt[ch] = now;
+      } // if onset
+      flash[ch] = flashLevel(&flashAt[ch], &now);
+    } // for ch
+
+    // update the pwms, every chip in one transaction in spectrum mode
+    if (r->all >= 0) {
+      for (i = 0; i < args.pwm_chips; i++) PCA9685_setAllPWM(fd, addrs[i], 0, r->all);
     } else {
+      for (i = 0; i < args.pwm_chips * _PCA9685_CHANS; i++) {
+        unsigned char *reg = frames[i / _PCA9685_CHANS] + 1 + (i % _PCA9685_CHANS) * 4;
+        unsigned int val = r->off[i];
+        if (flash[i / bands] > val) val = flash[i / bands];
+        reg[2] = val & 0xFF;
+        reg[3] = val >> 8;
+      } // for i
+      PCA9685_setPWMFrames(fd, args.pwm_chips, addrs, frames);
+    } // if all
+    atomic_fetch_add(&outputFrames, 1);
+
+    // latency from the end of the captured period to the end of the write
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned int ns = (now.tv_sec - r->stamp.tv_sec) * 1000000000 + now.tv_nsec - r->stamp.tv_nsec;
+    atomic_fetch_add(&outputLatencyNs, ns);
+    if (ns > atomic_load(&outputLatencyMaxNs)) atomic_store(&outputLatencyMaxNs, ns);
+  } // while 1
+
+  for (i = 0; i < args.pwm_chips; i++) free(frames[i]);
+  free(frames);
+  free(seen);
+  free(flash);
+  free(flashAt);
+  return NULL;
+}
+
+
+// print and reset the pipeline counters
+void reportStats() {
+  fprintf(stdout, "capture %u periods %u xruns %u dropped, ",
+          atomic_exchange(&capturePeriods, 0), atomic_exchange(&captureXruns, 0),
+          atomic_exchange(&captureDropped, 0));
+  unsigned int periods = atomic_exchange(&dspPeriods, 0);
+  unsigned long long ns = atomic_exchange(&dspCpuNs, 0);
+  fprintf(stdout, "dsp %u periods depth %u max %u time %.1f us avg %.1f us max, ",
+          periods, spsc_depth(&audioRing), atomic_exchange(&dspMaxDepth, 0),
+          periods ? ns / 1000.0 / periods : 0.0, atomic_exchange(&dspCpuMaxNs, 0) / 1000.0);
+  unsigned int frames = atomic_exchange(&outputFrames, 0);
+  ns = atomic_exchange(&outputLatencyNs, 0);
+  if (args.onset_fade) fprintf(stdout, "%u onsets, ", atomic_exchange(&dspOnsets, 0));
+  fprintf(stdout, "output %u frames %u skipped latency %.2f ms avg %.2f ms max\n",
+          frames, atomic_exchange(&outputSkipped, 0),
+          frames ? ns / 1000000.0 / frames : 0.0, atomic_exchange(&outputLatencyMaxNs, 0) / 1000000.0);
+}
+
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  fprintf(stdout, "vupeak %d.%d\n", libPCA9685_VERSION_MAJOR, libPCA9685_VERSION_MINOR);
+  process_args(argc, argv);
 
-      if (args.mode == 1) {
-        // find the min and max value
-        int sample;
-        long tmp;
-        int maxSample=-32000;
-        int minSample=32000;
-
-        // process all frames recorded
-        unsigned int i;
-        for (i = 0; i < args.audio_period; i+=2) {
-          tmp = (long) ((char*) buffer)[2 * args.audio_channels * i + 1] << 8 | ((char*) buffer)[2 * args.audio_channels * i];
-          if (tmp < 32768) sample = tmp;
-          else sample = tmp - 65536;
-          if (sample > maxSample) {
-            maxSample = sample;
-          } // if sample >
-          if (sample < minSample) {
-            minSample = sample;
-          } // if sample <
-        } // for i
-
-        // intensity-based value
-        int intensity_value = maxSample - minSample;
-
-        // minValue is the smallest value seen, use for offset
-        if (intensity_value < minValue) {
-          minValue = intensity_value;
-        }
-        intensity_value -= minValue;
-
-        // modified moving average for smoothing
-        int alpha = args.pwm_smoothing;
-        average = (intensity_value + (alpha-1) * average) / alpha;
-
-        int ratio = 100.0 * average / 65535;
-        ratio = (ratio / 10.0) * (ratio / 10.0);
-        ratio = (ratio / 10.0) * (ratio / 10.0);
-        if (ratio < 0) ratio = 0;
-        if (ratio > 100) ratio = 100;
-
-        int display = ratio / 100.0 * _PCA9685_MAXVAL;
-        if (verbose) fprintf(stdout, "%d %d\n", intensity_value, ratio);
-
-        // update the pwms
-        if (count == 0) PCA9685_setAllPWM(fd, args.pwm_addr, 0, display);
-      }
-
-      else if (args.mode == 2) {
-        // window for fftw
-        unsigned int i;
-        long tmp;
-        int sample;
-        for (i = 0; i < args.audio_period; i++) {
-          tmp = (long) ((char*) buffer)[2 * args.audio_channels * i + 1] << 8 | ((char*) buffer)[2 * args.audio_channels * i];
-          if (tmp < 32768) sample = tmp;
-          else sample = tmp - 65536;
-          in[i] = (double) sample * han[i];
-        } // for i
-
-        // fftw
-        fftw_execute(p);
-        unsigned int pwmoff[16];
-        // 4096 @ 88200 good bass bins are 2,4,7
-        // 2048 @ 88200 good bass bins are 2,3,4,5(,6) and fast (also very good and fast 256 @ 22050 wide)
-        unsigned int bins[16] = {0,0,2, 0,3,3, 0,4,0, 5,5,0, 6,0,0};
-        //unsigned int bins[16] = {4,3,2, 0,0,16, 0,20,0, 30,30,0, 90,0,0};
-        //unsigned int bins[16] = {1024,1024,1024, 1024,1024,1024, 1024,1024,1024, 1024,1024,1024, 1024,1024,1024};
-        for (i = 0; i < 16; i++) {
-            // normalize by the number of frames in a period and the hanning factor
-            //unsigned int index = minbin + (i - minbin) * gap;
-            unsigned int index = bins[i];
-            if (index == 0) {
-              pwmoff[i] = 0;
-              continue;
-            } // if index
-            double mag = 2.0 * sqrtf(out[index][0] * out[index][0] + out[index][1] * out[index][1]) / args.audio_period;
-            double amp = 20 * log10f(mag);
-            if (verbose) fprintf(stdout, "%2d:%3d  ", index, (int) amp);
-            if (amp > min[i]) {
-              double ratio = (amp - min[i]) / (max[i] - min[i]);
-              ratio *= ratio;
-              ratio *= ratio;
-              ratio *= ratio;
-              double val = _PCA9685_MAXVAL * ratio;
-              //fprintf(stdout, "%f %f\n", ratio, val);
-              if (val > 4096) val = 4096;
-              int alpha = args.pwm_smoothing;
-              double scaled = ((alpha - 1) * pwmoff[i] + val) / alpha;
-                pwmoff[i] = scaled;
-            } else {
-              pwmoff[i] = 0;
-            } // if amp
-        } // for i
-        if (verbose) fprintf(stdout, "\n");
-        // update the pwms
-        unsigned int pwmon[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-        PCA9685_setPWMVals(fd, args.pwm_addr, pwmon, pwmoff);
-      } // if mode 2
-    } // else good audio read
+  // only main() takes signals, the stage threads inherit the mask
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  // ALSA init, or the input file through the simulated PCA9685 transport
+  if (args.input_file) {
+    initFile(&args);
+    _PCA9685_TEST = true;
+    _PCA9685_QUIET = true;
+  } else {
+    handle = initALSA(args);
+  } // if file
+  if (args.frame_dump) {
+    dump = fopen(args.frame_dump, "w");
+    if (dump == NULL) {
+      fprintf(stderr, "unable to open frame dump '%s'\n", args.frame_dump);
+      exit(1);
+    } // if dump
+  } // if frame_dump
+
+  if (args.audio_analysed > args.audio_channels) {
+    fprintf(stderr, "cannot analyse %u of %u channels\n", args.audio_analysed, args.audio_channels);
+    exit(1);
+  } // if analysed
+
+  // libPCA9685 init
+  fd = initPCA9685(args);
+
+  // fftw init
+  initFFT(args);
+  initBands(args);
+
+  // pipeline init
+  size_t bytes = args.audio_period * args.audio_channels * sizeof(int16_t);
+  size_t offs = args.pwm_chips * _PCA9685_CHANS * sizeof(unsigned int);
+  if (spsc_init(&audioRing, AUDIO_SLOTS, sizeof(period) + bytes) != 0 ||
+      latest_init(&resultBox, sizeof(result) + offs) != 0) {
+    fprintf(stderr, "unable to allocate pipeline buffers\n");
+    exit(1);
+  } // if alloc
+  sem_init(&audioReady, 0, 0);
+  sem_init(&resultReady, 0, 0);
+  sem_init(&workDone, 0, 0);
+  workers = (pthread_t *) malloc(sizeof(pthread_t) * args.dsp_threads);
+  workStart = (sem_t *) malloc(sizeof(sem_t) * args.dsp_threads);
+  unsigned int w;
+  for (w = 1; w < args.dsp_threads; w++) {
+    sem_init(&workStart[w], 0, 0);
+    pthread_create(&workers[w], NULL, workerThread, (void *) (uintptr_t) w);
+  } // for w
+  pthread_t capture, dsp, output;
+  pthread_create(&output, NULL, outputThread, NULL);
+  pthread_create(&dsp, NULL, dspThread, NULL);
+  if (args.input_file) pthread_create(&capture, NULL, fileThread, NULL);
+  else if (args.audio_mmap) pthread_create(&capture, NULL, mmapThread, NULL);
+  else pthread_create(&capture, NULL, captureThread, NULL);
+
+  // report stats until SIGINT or SIGTERM
+  struct timespec interval = { args.stats_interval, 0 };
+  while (1) {
+    int sig = args.stats_interval ? sigtimedwait(&sigs, NULL, &interval)
+                                  : sigwaitinfo(&sigs, NULL);
+    if (sig > 0) break;
+    if (args.stats_interval) reportStats();
   } // while 1
+
+  // stop the stages, capture returns after its current period
+  atomic_store(&running, false);
+  pthread_join(capture, NULL);
+  sem_post(&audioReady);
+  pthread_join(dsp, NULL);
+  for (w = 1; w < args.dsp_threads; w++) {
+    sem_post(&workStart[w]);
+    pthread_join(workers[w], NULL);
+  } // for w
+  sem_post(&resultReady);
+  pthread_join(output, NULL);
+
+  // turn off all channels
+  unsigned int i;
+  for (i = 0; i < args.pwm_chips; i++) {
+    PCA9685_setAllPWM(fd, addrs[i], _PCA9685_MINVAL, _PCA9685_MINVAL);
+  } // for i
+
+  // cleanup alsa
+  if (handle) {
+    snd_pcm_drain(handle);
+    snd_pcm_close(handle);
+  } // if handle
+  if (dump) fclose(dump);
+
+  // cleanup fftw
+  fftwf_destroy_plan(plan);
+  unsigned int ch;
+  for (ch = 0; ch < args.audio_analysed; ch++) {
+    fftwf_free(spec[ch].in);
+    fftwf_free(spec[ch].out);
+    free(spec[ch].hist);
+    free(spec[ch].off);
+    free(spec[ch].power);
+    onset_free(&spec[ch].beat);
+  } // for ch
+  free(spec);
+  free(onsetCount);
+  fftwf_free(han);
+  free(bandLo);
+  free(bandHi);
+  free(workers);
+  free(workStart);
+  free(addrs);
+
+  return 0;
 } // main
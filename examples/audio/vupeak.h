@@ -1,12 +1,26 @@
 typedef struct audiopwms {
   unsigned int mode;
   char *audio_device;
+  char *input_file;
+  unsigned int input_fast;
+  char *frame_dump;
   unsigned int audio_period;
   unsigned int audio_rate;
   unsigned int audio_channels;
+  unsigned int audio_mmap;
+  unsigned int audio_analysed;
+  unsigned int dsp_threads;
   unsigned int pwm_bus;
   unsigned int pwm_addr;
+  unsigned int pwm_chips;
   unsigned int pwm_freq;
   unsigned int pwm_debug;
   unsigned int pwm_smoothing;
+  unsigned int stats_interval;
+  unsigned int band_low;
+  unsigned int band_high;
+  unsigned int onset_fade;
+  float onset_k;
+  unsigned int fft_size;
+  char *fft_wisdom;
 } audiopwm;
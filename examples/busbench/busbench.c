@@ -0,0 +1,203 @@
+// contention benchmark of the async writer, 1 - 16 threads update their
+// own channel on the same chips, through the lock-free submission queue
+// and, for comparison, through a mutex around a direct write per update
+// both run against the library's test mode, so the bus itself is free
+// then times blackouts raised from a signal handler under the heaviest load
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include <PCA9685.h>
+
+// chips the threads share
+#define CHIPS 4
+// requests in flight per thread
+#define POOL 32
+// most producer threads
+#define MAXTHREADS 16
+// timer ticks alternate between blackout and resume
+#define BLACKOUT_US 2000
+
+typedef struct producers {
+  pthread_t thread;
+  unsigned int id;
+  unsigned int updates;
+  int inUse[POOL];
+  PCA9685_req reqs[POOL];
+  unsigned char bufs[POOL][5];
+} producer;
+
+PCA9685_bus *bus;
+pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+volatile int go;
+volatile sig_atomic_t ticks;
+
+
+double nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void reqDone(PCA9685_req *req) {
+  __atomic_store_n((int *) req->user, 0, __ATOMIC_RELEASE);
+}
+
+
+// every other tick turns the lights off, the next lets frames through
+void alarmHandler(int sig) {
+  (void) sig;
+  if (ticks++ & 1) PCA9685_resume(bus);
+  else PCA9685_blackout(bus);
+}
+
+
+// pack ON 0 and OFF val for the producer's channel on chip i
+void fill(producer *p, unsigned char *buf, unsigned int i) {
+  unsigned int val = (i * 7 + p->id * 256) & _PCA9685_MAXVAL;
+  buf[0] = _PCA9685_BASEPWMREG + (p->id % _PCA9685_CHANS) * 4;
+  buf[1] = 0;
+  buf[2] = 0;
+  buf[3] = val & 0xFF;
+  buf[4] = val >> 8;
+}
+
+
+// submit updates round robin over the chips, reusing a request once the
+// worker has handed it back
+void *queueThread(void *arg) {
+  producer *p = arg;
+  while (!go) sched_yield();
+  unsigned int i;
+  for (i = 0; i < p->updates; i++) {
+    unsigned int slot = i % POOL;
+    while (__atomic_load_n(&p->inUse[slot], __ATOMIC_ACQUIRE)) sched_yield();
+    p->inUse[slot] = 1;
+    fill(p, p->bufs[slot], i);
+    p->reqs[slot].addr = 0x40 + i % CHIPS;
+    if (PCA9685_submit(bus, &p->reqs[slot]) != 0) exit(1);
+  } // for updates
+  for (i = 0; i < POOL; i++) {
+    while (__atomic_load_n(&p->inUse[i], __ATOMIC_ACQUIRE)) sched_yield();
+  } // for pool
+  return NULL;
+}
+
+
+// one ioctl per update under a mutex, how threads share a bus without
+// the async writer
+void *mutexThread(void *arg) {
+  producer *p = arg;
+  while (!go) sched_yield();
+  unsigned int i;
+  for (i = 0; i < p->updates; i++) {
+    struct i2c_msg msg = { 0x40 + i % CHIPS, 0, 5, p->bufs[0] };
+    struct i2c_rdwr_ioctl_data data = { &msg, 1 };
+    fill(p, p->bufs[0], i);
+    pthread_mutex_lock(&busLock);
+    _PCA9685_ioctl(0, I2C_RDWR, (char *) &data);
+    pthread_mutex_unlock(&busLock);
+  } // for updates
+  return NULL;
+}
+
+
+double run(producer *ps, unsigned int threads, void *(*fn)(void *)) {
+  go = 0;
+  unsigned int t;
+  for (t = 0; t < threads; t++) pthread_create(&ps[t].thread, NULL, fn, &ps[t]);
+  double start = nowSec();
+  go = 1;
+  for (t = 0; t < threads; t++) pthread_join(ps[t].thread, NULL);
+  return nowSec() - start;
+}
+
+
+void setup(producer *ps, unsigned int threads, unsigned int updates) {
+  unsigned int t, i;
+  for (t = 0; t < threads; t++) {
+    memset(&ps[t], 0, sizeof(producer));
+    ps[t].id = t;
+    ps[t].updates = updates;
+    for (i = 0; i < POOL; i++) {
+      ps[t].reqs[i].buf = ps[t].bufs[i];
+      ps[t].reqs[i].len = 5;
+      ps[t].reqs[i].done = reqDone;
+      ps[t].reqs[i].user = &ps[t].inUse[i];
+    } // for pool
+  } // for threads
+}
+
+
+int main(int argc, char **argv) {
+  unsigned int updates = 200000;
+  unsigned int watchdogMs = 0;
+  int c;
+  while ((c = getopt(argc, argv, "u:w:")) != -1) {
+    switch (c) {
+      case 'u':
+        updates = atoi(optarg);
+        break;
+      case 'w': // watch the bus, to time the submit with a watchdog
+        watchdogMs = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-u updates per thread] [-w watchdog ms]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+
+  _PCA9685_TEST = true;
+  _PCA9685_QUIET = true;
+
+  static producer ps[MAXTHREADS];
+  printf("threads  queue Mupd/s  msgs/upd  bytes/upd  merged  upd/ioctl   mutex Mupd/s  bytes/upd\n");
+  unsigned int threads;
+  for (threads = 1; threads <= MAXTHREADS; threads *= 2) {
+    setup(ps, threads, updates);
+    bus = PCA9685_openBus(0);
+    if (watchdogMs) PCA9685_setBusWatchdog(bus, watchdogMs, 0, NULL, false);
+    double queueTime = run(ps, threads, queueThread);
+    PCA9685_busStats stats;
+    PCA9685_getBusStats(bus, &stats);
+    PCA9685_closeBus(bus);
+    double mutexTime = run(ps, threads, mutexThread);
+
+    double total = (double) updates * threads;
+    printf("%7u  %12.2f  %8.2f  %9.2f  %5.1f%%  %9.1f   %12.2f  %9.2f\n",
+           threads, total / queueTime / 1e6, stats.msgs / total, stats.bytes / total,
+           100.0 * stats.merged / total, total / stats.ioctls,
+           total / mutexTime / 1e6, 5.0);
+  } // for threads
+
+  // SIGALRM may land on any producer, the blackout jumps their queue
+  setup(ps, MAXTHREADS, updates);
+  bus = PCA9685_openBus(0);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = alarmHandler;
+  sigaction(SIGALRM, &sa, NULL);
+  struct itimerval timer = { { 0, BLACKOUT_US }, { 0, BLACKOUT_US } };
+  setitimer(ITIMER_REAL, &timer, NULL);
+  run(ps, MAXTHREADS, queueThread);
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_REAL, &timer, NULL);
+  PCA9685_busStats stats;
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  printf("%d threads, %llu blackouts: %.1f us mean, %.1f us max to ALL_LED written, "
+         "%llu of %llu updates cancelled\n",
+         MAXTHREADS, stats.blackouts, stats.blackouts ? stats.blackoutNs / 1e3 / stats.blackouts : 0.0,
+         stats.maxBlackoutNs / 1e3, stats.cancelled, stats.reqs);
+  return 0;
+}
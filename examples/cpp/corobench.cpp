@@ -0,0 +1,115 @@
+// benchmark of the async writer, many coroutines co_await frame commits
+// on one bus against the library's test mode, so every request queued
+// while a transaction is in flight shares the next one
+
+#include <atomic>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <unistd.h>
+
+#include <PCA9685.hpp>
+
+// devices the producers are spread over
+#define DEVICES 32
+
+
+double nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// fire and forget coroutine, runs until its first co_await on creation
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+
+struct Counters {
+  std::atomic<unsigned int> running;
+  std::atomic<unsigned long long> written;
+  std::atomic<unsigned long long> failed;
+};
+
+
+// one producer, commits a changing frame to one device frames times
+Task produce(PCA9685::Bus &bus, unsigned char addr, unsigned int id,
+             unsigned int frames, Counters &counters) {
+  PCA9685::Frame frame;
+  uint16_t off[_PCA9685_CHANS];
+  for (unsigned int i = 0; i < frames; i++) {
+    for (unsigned int chan = 0; chan < _PCA9685_CHANS; chan++) {
+      off[chan] = (id + i + chan * 256) & _PCA9685_MAXVAL;
+    } // for chan
+    frame.set(off);
+    if (co_await bus.commit(addr, frame) == 0) counters.written++;
+    else counters.failed++;
+  } // for i
+  if (--counters.running == 0) counters.running.notify_all();
+}
+
+
+int main(int argc, char **argv) {
+  unsigned int producers = 1000;
+  unsigned int frames = 1000;
+  unsigned int traceEvery = 0;
+  int c;
+  while ((c = getopt(argc, argv, "p:f:t:")) != -1) {
+    switch (c) {
+      case 'p':
+        producers = atoi(optarg);
+        break;
+      case 'f':
+        frames = atoi(optarg);
+        break;
+      case 't': // trace every Nth commit through the bus
+        traceEvery = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-p producers] [-f frames per producer] [-t trace every]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+
+  _PCA9685_TEST = true;
+  _PCA9685_QUIET = true;
+
+  // test mode fakes the fd, nothing is opened
+  PCA9685::Bus bus(0);
+  bus.trace(traceEvery);
+  Counters counters;
+  counters.running = producers;
+  counters.written = counters.failed = 0;
+
+  double start = nowSec();
+  for (unsigned int id = 0; id < producers; id++) {
+    produce(bus, 0x40 + id % DEVICES, id, frames, counters);
+  } // for producers
+  for (unsigned int n; (n = counters.running) != 0; ) counters.running.wait(n);
+  double time = nowSec() - start;
+
+  PCA9685_busStats stats = bus.stats();
+  printf("%u producers x %u frames on %d devices\n", producers, frames, DEVICES);
+  printf("%llu written %llu failed in %.3f s, %.0f frames/s\n",
+         counters.written.load(), counters.failed.load(), time,
+         counters.written / time);
+  printf("%llu ioctls, %.1f frames per ioctl, %u requests at most per batch\n",
+         stats.ioctls, (double) stats.sent / stats.ioctls, stats.maxBatch);
+  printf("%llu messages, %llu frames merged, %.1f bytes per frame\n",
+         stats.msgs, stats.merged, (double) stats.bytes / stats.sent);
+  if (traceEvery) {
+    PCA9685_busTrace trace = bus.traceHists();
+    PCA9685_dumpBusTrace(stdout, &trace);
+  } // if trace
+  return counters.failed != 0;
+}
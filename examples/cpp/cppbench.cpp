@@ -0,0 +1,151 @@
+// benchmark of the PCA9685.hpp wrappers against calling the C library
+// directly, both against the library's test mode so only the call path
+// and packing are timed
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+#include <PCA9685.hpp>
+
+#define I2C_ADPT 1
+#define I2C_ADDR 0x40
+#define PWM_FREQ 200
+// devices in the chain benchmark
+#define CHAIN 8
+
+
+double nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// OFF values that change every iteration
+void fill(uint16_t *off, unsigned int i) {
+  for (unsigned int chan = 0; chan < _PCA9685_CHANS; chan++) {
+    off[chan] = (i + chan * 256) & _PCA9685_MAXVAL;
+  } // for chan
+}
+
+
+// the C fast path, pack into a frame saturating as Frame::set() does and
+// write it
+int writeC(int fd, unsigned char *frame, const uint16_t *off) {
+  for (unsigned int chan = 0; chan < _PCA9685_CHANS; chan++) {
+    uint16_t val = off[chan] > _PCA9685_MAXVAL ? _PCA9685_MAXVAL : off[chan];
+    frame[1 + chan * 4 + 2] = val & 0xFF;
+    frame[1 + chan * 4 + 3] = val >> 8;
+  } // for chan
+  return PCA9685_setPWMFrame(fd, I2C_ADDR, frame);
+}
+
+
+int main(int argc, char **argv) {
+  unsigned int iters = 1000000;
+  int c;
+  while ((c = getopt(argc, argv, "i:")) != -1) {
+    switch (c) {
+      case 'i':
+        iters = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+
+  _PCA9685_TEST = true;
+  _PCA9685_QUIET = true;
+
+  int fd = PCA9685_openI2C(I2C_ADPT, I2C_ADDR);
+  PCA9685_initPWM(fd, I2C_ADDR, PWM_FREQ);
+  PCA9685::Device dev(I2C_ADPT, I2C_ADDR, PWM_FREQ);
+
+  // both paths must pack the same bytes
+  unsigned char cFrame[_PCA9685_FRAMELEN] = { 0 };
+  PCA9685::Frame frame;
+  uint16_t off[_PCA9685_CHANS];
+  fill(off, 1234);
+  if (writeC(fd, cFrame, off) != 0 || (frame.set(off), dev.set(frame)) != 0 ||
+      memcmp(cFrame, frame.data(), _PCA9685_FRAMELEN) != 0) {
+    fprintf(stderr, "C and C++ frames differ\n");
+    exit(1);
+  } // if differ
+
+  // alternate the order so neither path always runs on a warm cache
+  double cTime = 0, cppTime = 0;
+  int sink = 0;
+  for (unsigned int round = 0; round < 4; round++) {
+    double start = nowSec();
+    for (unsigned int i = 0; i < iters / 4; i++) {
+      fill(off, i);
+      sink += writeC(fd, cFrame, off);
+    } // for C
+    cTime += nowSec() - start;
+
+    start = nowSec();
+    for (unsigned int i = 0; i < iters / 4; i++) {
+      fill(off, i);
+      frame.set(off);
+      sink += dev.set(frame);
+    } // for C++
+    cppTime += nowSec() - start;
+  } // for round
+
+  printf("%u frames\n", iters);
+  printf("C   PCA9685_setPWMFrame()  %7.1f ns/frame\n", cTime / iters * 1e9);
+  printf("C++ PCA9685::Device::set() %7.1f ns/frame\n", cppTime / iters * 1e9);
+  printf("overhead %+.1f%%\n", 100.0 * (cppTime - cTime) / cTime);
+
+  // CHAIN devices in one transaction, run time topology against Chain<>
+  PCA9685::Chain<0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47> chain(I2C_ADPT, PWM_FREQ);
+  unsigned char addrs[CHAIN];
+  unsigned char cFrames[CHAIN][_PCA9685_FRAMELEN] = { { 0 } };
+  unsigned char *cPtrs[CHAIN];
+  for (unsigned int dev = 0; dev < CHAIN; dev++) {
+    addrs[dev] = chain.addrs[dev];
+    cPtrs[dev] = cFrames[dev];
+  } // for dev
+  uint16_t offs[CHAIN * _PCA9685_CHANS];
+  cTime = cppTime = 0;
+  for (unsigned int round = 0; round < 4; round++) {
+    double start = nowSec();
+    for (unsigned int i = 0; i < iters / 4; i++) {
+      for (unsigned int dev = 0; dev < CHAIN; dev++) {
+        fill(offs + dev * _PCA9685_CHANS, i + dev);
+        for (unsigned int chan = 0; chan < _PCA9685_CHANS; chan++) {
+          uint16_t val = offs[dev * _PCA9685_CHANS + chan];
+          if (val > _PCA9685_MAXVAL) val = _PCA9685_MAXVAL;
+          cFrames[dev][1 + chan * 4 + 2] = val & 0xFF;
+          cFrames[dev][1 + chan * 4 + 3] = val >> 8;
+        } // for chan
+      } // for dev
+      sink += PCA9685_setPWMFrames(fd, CHAIN, addrs, cPtrs);
+    } // for C
+    cTime += nowSec() - start;
+
+    start = nowSec();
+    for (unsigned int i = 0; i < iters / 4; i++) {
+      for (unsigned int dev = 0; dev < CHAIN; dev++) fill(offs + dev * _PCA9685_CHANS, i + dev);
+      chain.set(offs);
+      sink += chain.commit();
+    } // for C++
+    cppTime += nowSec() - start;
+  } // for round
+  for (unsigned int dev = 0; dev < CHAIN; dev++) {
+    if (memcmp(cFrames[dev], chain.frame(dev).data(), _PCA9685_FRAMELEN) != 0) {
+      fprintf(stderr, "C and Chain<> frames differ on device %u\n", dev);
+      exit(1);
+    } // if differ
+  } // for dev
+
+  printf("%u devices per transaction\n", CHAIN);
+  printf("C   PCA9685_setPWMFrames() %7.1f ns/commit\n", cTime / iters * 1e9);
+  printf("C++ PCA9685::Chain<>       %7.1f ns/commit\n", cppTime / iters * 1e9);
+  printf("difference %+.1f%%\n", 100.0 * (cppTime - cTime) / cTime);
+  return sink != 0;
+}
@@ -0,0 +1,94 @@
+// frame server client, ramps the channels of one chip through the shared
+// memory of a running frameserver and times the writes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <PCA9685.h>
+#include "frameshm.h"
+
+
+unsigned long long nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+int main(int argc, char **argv) {
+  unsigned int adpt = 1;
+  unsigned int addr = 0x40;
+  unsigned int first = 0;
+  unsigned int chans = _PCA9685_CHANS;
+  unsigned int iters = 10000000;
+  unsigned int seconds = 0;
+  int c;
+  while ((c = getopt(argc, argv, "b:a:c:n:i:s:")) != -1) {
+    switch (c) {
+      case 'b': // i2c adapter of the server
+        adpt = atoi(optarg);
+        break;
+      case 'a': // chip to write
+        addr = strtol(optarg, NULL, 0);
+        break;
+      case 'c': // first channel to write, other channels are left alone
+        first = atoi(optarg);
+        break;
+      case 'n': // channels to write
+        chans = atoi(optarg);
+        break;
+      case 'i': // writes timed back to back
+        iters = atoi(optarg);
+        break;
+      case 's': // then ramp at the server's tick rate for N seconds
+        seconds = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b bus] [-a addr] [-c first chan] [-n chans] [-i iterations] [-s seconds]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+  if (first >= _PCA9685_CHANS || chans < 1 || first + chans > _PCA9685_CHANS) {
+    fprintf(stderr, "Illegal channels %u - %u\n", first, first + chans - 1);
+    exit(-1);
+  } // if chans
+
+  frameshm *shm = frameshm_open(adpt);
+  if (shm == NULL) exit(1);
+  if (frameshm_lock(shm, addr) == NULL) {
+    fprintf(stderr, "frame server on bus %u does not drive 0x%02x\n", adpt, addr);
+    exit(1);
+  } // if addr
+  frameshm_unlock(shm, addr);
+
+  // a write is the seqlock and the stores, no syscall
+  uint16_t off[_PCA9685_CHANS];
+  unsigned long long ticks = atomic_load(&shm->ticks);
+  unsigned long long start = nowNs();
+  unsigned int i, chan;
+  for (i = 0; i < iters; i++) {
+    for (chan = 0; chan < chans; chan++) off[chan] = (i + chan * 256) & _PCA9685_MAXVAL;
+    if (frameshm_set(shm, addr, first, chans, off) != 0) {
+      fprintf(stderr, "slot of 0x%02x is held by another client\n", addr);
+      exit(1);
+    } // if err
+  } // for iters
+  unsigned long long ns = nowNs() - start;
+  fprintf(stdout, "%u writes of %u channels, %.1f ns/write, %llu server ticks meanwhile\n",
+          iters, chans, iters ? (double) ns / iters : 0.0, atomic_load(&shm->ticks) - ticks);
+
+  // one step per tick, the server commits every step
+  struct timespec tick = { 0, 1000000000L / shm->tickHz };
+  unsigned long long steps = (unsigned long long) seconds * shm->tickHz;
+  unsigned long long step;
+  for (step = 0; step < steps; step++) {
+    for (chan = 0; chan < chans; chan++) off[chan] = (step * 64 + chan * 256) & _PCA9685_MAXVAL;
+    frameshm_set(shm, addr, first, chans, off);
+    nanosleep(&tick, NULL);
+  } // for steps
+
+  frameshm_close(shm);
+  return 0;
+}
@@ -0,0 +1,281 @@
+// frame server, owns one I2C bus and commits the frames clients write to
+// shared memory in one batched transaction per tick
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <PCA9685.h>
+#include "frameshm.h"
+#include "config.h"
+
+// seconds a slot may stay locked before its client is presumed dead
+#define STUCK_SECONDS 1
+// copies of a slot tried per tick while a client keeps rewriting it
+#define COPY_TRIES 4
+
+// command line options
+unsigned int adpt = 1;
+unsigned int firstAddr = 0x40;
+unsigned int chips = 1;
+unsigned int freq = 200;
+unsigned int tickHz = 100;
+unsigned long busHz = 100000;
+bool busHzSet = false;
+unsigned int statsInterval = 0;
+bool testMode = false;
+
+volatile sig_atomic_t running = 1;
+
+// stage counters, reset by every stats report
+unsigned long long statTicks;
+unsigned long long statCommits;
+unsigned long long statFrames;
+unsigned long long statBusy;
+unsigned long long statOverruns;
+unsigned long long statMaxNs;
+
+
+void stop(int sig) {
+  (void) sig;
+  running = 0;
+}
+
+
+unsigned long long tsNs(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+// copy a slot if a client changed it since the last copy, returns 1 when
+// copied, 0 when unchanged and -1 when a client holds it
+int copySlot(frameslot *slot, unsigned int *lastSeq, unsigned char *frame) {
+  unsigned int tries;
+  for (tries = 0; tries < COPY_TRIES; tries++) {
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == *lastSeq) return 0;
+    if (seq & 1) return -1;
+    memcpy(frame, slot->frame, _PCA9685_FRAMELEN);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+      *lastSeq = seq;
+      return 1;
+    } // if consistent
+  } // for tries
+  return -1;
+}
+
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  fprintf(stdout, "frameserver %d.%d\n", libPCA9685_VERSION_MAJOR, libPCA9685_VERSION_MINOR);
+
+  int c;
+  while ((c = getopt(argc, argv, "b:a:n:f:r:c:S:tD")) != -1) {
+    switch (c) {
+      case 'b': // i2c adapter
+        adpt = atoi(optarg);
+        break;
+      case 'a': // address of the first chip
+        firstAddr = strtol(optarg, NULL, 0);
+        break;
+      case 'n': // chips at consecutive addresses
+        chips = atoi(optarg);
+        break;
+      case 'f': // PWM frequency
+        freq = atoi(optarg);
+        break;
+      case 'r': // commits per second
+        tickHz = atoi(optarg);
+        break;
+      case 'c': // i2c bus clock, to check the tick rate fits
+        busHz = strtoul(optarg, NULL, 0);
+        busHzSet = true;
+        break;
+      case 'S': // report stats every N seconds
+        statsInterval = atoi(optarg);
+        break;
+      case 't': // fake the bus, for running without hardware
+        testMode = true;
+        break;
+      case 'D': // log the library calls
+        _PCA9685_DEBUG = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b bus] [-a addr] [-n chips] [-f freq] [-r hz] [-c bus hz] [-S seconds] [-t] [-D]\n", argv[0]);
+        exit(-1);
+    } // switch
+  } // while
+  if (chips < 1 || chips > _PCA9685_MAXMSGS || firstAddr + chips > 0x80) {
+    fprintf(stderr, "Illegal chip count %u at address 0x%02x\n", chips, firstAddr);
+    exit(-1);
+  } // if chips
+  if (tickHz < 1 || tickHz > 10000) {
+    fprintf(stderr, "Illegal tick rate %u Hz\n", tickHz);
+    exit(-1);
+  } // if tickHz
+  // every chip may change every tick, a rate the bus cannot carry would
+  // only overrun, so it is lowered to what fits
+  PCA9685_plan plan = { .devices = chips, .hz = busHz, .chans = 0xFFFF,
+                        .msgUs = _PCA9685_MSGUS, .xferUs = _PCA9685_XFERUS, .rate = tickHz };
+  int fits = PCA9685_planBus(&plan);
+  if (fits < 0) exit(-1);
+  unsigned int askedHz = tickHz;
+  if (fits > 0) {
+    unsigned int maxHz = plan.maxRate;
+    tickHz = maxHz ? maxHz : 1;
+    fprintf(stderr, "%u chips at %lu Hz%s take %.0f us a tick, %u Hz does not fit, ticking at %u Hz\n",
+            chips, busHz, busHzSet ? "" : " (default, set the bus clock with -c)",
+            plan.frameUs, askedHz, tickHz);
+  } // if !fits
+  if (testMode) {
+    _PCA9685_TEST = true;
+    _PCA9685_QUIET = !_PCA9685_DEBUG;
+  } // if testMode
+
+  // the server is the only process on the bus
+  unsigned char addrs[_PCA9685_MAXMSGS];
+  unsigned char batch[_PCA9685_MAXMSGS];
+  unsigned char frames[_PCA9685_MAXMSGS][_PCA9685_FRAMELEN];
+  unsigned char *framePtrs[_PCA9685_MAXMSGS];
+  unsigned int i;
+  for (i = 0; i < chips; i++) addrs[i] = firstAddr + i;
+  int fd = PCA9685_openI2C(adpt, addrs[0]);
+  if (fd < 0) {
+    fprintf(stderr, "PCA9685_openI2C() failed on bus %u\n", adpt);
+    exit(1);
+  } // if fd
+  if (PCA9685_initPWMs(fd, chips, addrs, freq) != 0) {
+    fprintf(stderr, "PCA9685_initPWMs() failed on bus %u\n", adpt);
+    exit(1);
+  } // if init
+
+  // a server that died leaves its shared memory behind, start afresh
+  char name[32];
+  snprintf(name, sizeof(name), FRAMESHM_NAME, adpt);
+  shm_unlink(name);
+  int shmFd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+  if (shmFd < 0 || ftruncate(shmFd, sizeof(frameshm)) != 0) {
+    perror("unable to create the shared memory");
+    exit(1);
+  } // if shmFd
+  frameshm *shm = (frameshm *) mmap(NULL, sizeof(frameshm), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, shmFd, 0);
+  close(shmFd);
+  if (shm == MAP_FAILED) {
+    perror("unable to map the shared memory");
+    shm_unlink(name);
+    exit(1);
+  } // if mmap
+  shm->version = FRAMESHM_VERSION;
+  shm->tickHz = tickHz;
+  unsigned int lastSeq[_PCA9685_MAXMSGS];
+  unsigned int stuck[_PCA9685_MAXMSGS];
+  unsigned int stuckSeq[_PCA9685_MAXMSGS];
+  for (i = 0; i < chips; i++) {
+    shm->active[addrs[i]] = 1;
+    shm->slot[addrs[i]].frame[0] = _PCA9685_BASEPWMREG;
+    lastSeq[i] = 0;
+    stuck[i] = 0;
+    stuckSeq[i] = 0;
+  } // for chips
+  atomic_store_explicit(&shm->magic, FRAMESHM_MAGIC, memory_order_release);
+  fprintf(stdout, "serving %u chips from 0x%02x on bus %u at %u Hz in /dev/shm%s\n",
+          chips, addrs[0], adpt, tickHz, name);
+  if (tickHz != askedHz) {
+    fprintf(stdout, "tick rate lowered from %u Hz to fit a %lu Hz bus clock\n", askedHz, busHz);
+  } // if lowered
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // commit on an absolute schedule, a late tick is counted and skipped
+  unsigned long long periodNs = 1000000000ULL / tickHz;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  unsigned long long nextNs = tsNs(&next);
+  unsigned long long lastStats = nextNs;
+  while (running) {
+    nextNs += periodNs;
+    next.tv_sec = nextNs / 1000000000ULL;
+    next.tv_nsec = nextNs % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long start = tsNs(&now);
+    if (start > nextNs + periodNs) {
+      statOverruns += (start - nextNs) / periodNs;
+      nextNs += (start - nextNs) / periodNs * periodNs;
+    } // if late
+
+    // every changed slot goes out in one combined transaction
+    unsigned int n = 0;
+    for (i = 0; i < chips; i++) {
+      frameslot *slot = &shm->slot[addrs[i]];
+      int ret = copySlot(slot, &lastSeq[i], frames[n]);
+      if (ret < 0) {
+        statBusy++;
+        // a client that died holding the slot would block it for good, a
+        // live client moves seq on, so only the same odd seq counts
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        if (!(seq & 1) || seq != stuckSeq[i]) {
+          stuckSeq[i] = seq;
+          stuck[i] = 0;
+        } // if moved
+        if ((seq & 1) && ++stuck[i] > tickHz * STUCK_SECONDS) {
+          if (atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+            fprintf(stderr, "released the slot of 0x%02x held for %u ticks\n", addrs[i], stuck[i]);
+          } // if released
+          stuck[i] = 0;
+        } // if stuck
+        continue;
+      } // if busy
+      stuck[i] = 0;
+      if (ret == 0) continue;
+      frames[n][0] = _PCA9685_BASEPWMREG;
+      framePtrs[n] = frames[n];
+      batch[n] = addrs[i];
+      n++;
+    } // for chips
+    if (n) {
+      if (PCA9685_setPWMFrames(fd, n, batch, framePtrs) != 0) {
+        fprintf(stderr, "PCA9685_setPWMFrames() failed for %u chips\n", n);
+      } // if err
+      statCommits++;
+      statFrames += n;
+    } // if n
+    statTicks++;
+    atomic_fetch_add_explicit(&shm->ticks, 1, memory_order_release);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long ns = tsNs(&now) - start;
+    if (ns > statMaxNs) statMaxNs = ns;
+    if (statsInterval && tsNs(&now) - lastStats >= statsInterval * 1000000000ULL) {
+      lastStats = tsNs(&now);
+      fprintf(stdout, "ticks %llu commits %llu frames %llu busy %llu overruns %llu max tick %.3f ms\n",
+              statTicks, statCommits, statFrames, statBusy, statOverruns, statMaxNs / 1e6);
+      statTicks = statCommits = statFrames = statBusy = statOverruns = statMaxNs = 0;
+    } // if stats
+  } // while running
+
+  // clients can no longer attach, then the chips go dark
+  atomic_store_explicit(&shm->magic, 0, memory_order_release);
+  shm_unlink(name);
+  for (i = 0; i < chips; i++) {
+    memset(frames[i], 0, _PCA9685_FRAMELEN);
+    framePtrs[i] = frames[i];
+  } // for chips
+  PCA9685_setPWMFrames(fd, chips, addrs, framePtrs);
+  munmap(shm, sizeof(frameshm));
+  if (!testMode) close(fd);
+  fprintf(stdout, "frameserver stopped\n");
+  return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef _FRAMESHM_H
+#define _FRAMESHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <PCA9685.h>
+
+// shared memory of the frame server of one bus, /dev/shm/pca9685-<adpt>
+#define FRAMESHM_NAME "/pca9685-%u"
+#define FRAMESHM_MAGIC 0x50434136
+#define FRAMESHM_VERSION 1
+// one slot per 7-bit address
+#define FRAMESHM_ADDRS 128
+// spins before a client gives up on a slot another client holds
+#define FRAMESHM_SPINS 100000
+
+// one device's packed frame as taken by PCA9685_setPWMFrame()
+// seq is odd while a client writes the frame, the server copies it only
+// when seq is even and unchanged across the copy
+typedef struct frameslot {
+  _Alignas(64) atomic_uint seq;
+  unsigned char frame[_PCA9685_FRAMELEN];
+} frameslot;
+
+typedef struct frameshm {
+  atomic_uint magic;                      // set last by the server
+  uint32_t version;
+  uint32_t tickHz;                        // commits per second
+  unsigned char active[FRAMESHM_ADDRS];   // addresses the server writes
+  _Alignas(64) atomic_ullong ticks;       // commits done
+  frameslot slot[FRAMESHM_ADDRS];
+} frameshm;
+
+
+// map the frame server's shared memory, NULL if no server runs
+static inline frameshm *frameshm_open(unsigned int adpt) {
+  char name[32];
+  snprintf(name, sizeof(name), FRAMESHM_NAME, adpt);
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    fprintf(stderr, "frameshm_open(): no frame server on bus %u\n", adpt);
+    return NULL;
+  } // if fd
+  frameshm *shm = (frameshm *) mmap(NULL, sizeof(frameshm), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror("frameshm_open(): mmap() failed");
+    return NULL;
+  } // if mmap
+  if (atomic_load_explicit(&shm->magic, memory_order_acquire) != FRAMESHM_MAGIC ||
+      shm->version != FRAMESHM_VERSION) {
+    fprintf(stderr, "frameshm_open(): frame server on bus %u is not ready or too old\n", adpt);
+    munmap(shm, sizeof(frameshm));
+    return NULL;
+  } // if magic
+  return shm;
+}
+
+
+static inline void frameshm_close(frameshm *shm) {
+  munmap(shm, sizeof(frameshm));
+}
+
+
+// take the slot of addr and return its frame to write in place, NULL if
+// the server does not drive addr or another client holds it too long
+static inline unsigned char *frameshm_lock(frameshm *shm, unsigned char addr) {
+  if (addr >= FRAMESHM_ADDRS || !shm->active[addr]) return NULL;
+  frameslot *slot = &shm->slot[addr];
+  unsigned int spins;
+  for (spins = 0; spins < FRAMESHM_SPINS; spins++) {
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (!(seq & 1) &&
+        atomic_compare_exchange_weak_explicit(&slot->seq, &seq, seq + 1,
+                                              memory_order_acquire, memory_order_relaxed)) {
+      return slot->frame;
+    } // if taken
+  } // for spins
+  return NULL;
+}
+
+
+// publish the frame written since frameshm_lock()
+static inline void frameshm_unlock(frameshm *shm, unsigned char addr) {
+  atomic_fetch_add_explicit(&shm->slot[addr].seq, 1, memory_order_release);
+}
+
+
+// set the OFF values of n channels from first, ON stays as it is
+static inline int frameshm_set(frameshm *shm, unsigned char addr, unsigned int first,
+                               unsigned int n, const uint16_t *off) {
+  unsigned char *frame = frameshm_lock(shm, addr);
+  if (frame == NULL) return -1;
+  unsigned int i;
+  for (i = 0; i < n && first + i < _PCA9685_CHANS; i++) {
+    // saturate, bit 4 of OFF_H would turn the channel full off
+    uint16_t val = off[i] > _PCA9685_MAXVAL ? _PCA9685_MAXVAL : off[i];
+    frame[1 + (first + i) * 4 + 2] = val & 0xFF;
+    frame[1 + (first + i) * 4 + 3] = val >> 8;
+  } // for i
+  frameshm_unlock(shm, addr);
+  return 0;
+}
+
+#endif
@@ -1,21 +1,472 @@
 #include <ola/DmxBuffer.h>    // sudo apt-get install libola-dev
 #include <ola/Logging.h>
 #include <ola/OlaClientWrapper.h>
+#include <ola/Callback.h>
+#include <ola/io/Descriptor.h>
+#include <ola/io/SelectServer.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <bitset>
 #include <ctime>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <unistd.h>
+#include <getopt.h>
 using namespace std;
 
 #include <PCA9685.h>
 #include "config.h"
 
 #define PWM_FREQ 200
+// default patch when no patch file is given
 #define DMX_UNIVERSE 1
 #define I2C_ADPT 1
 #define I2C_ADDR 0x40
+// slots in a DMX universe
+#define DMX_SLOTS 512
+// exponent of the gamma curve
+#define GAMMA 2.2
+// number of pending channel changes for the logger, power of two
+#define LOG_RING 1024
+// completed writes taken per PCA9685_reap() call
+#define REAP_BATCH 64
+// fade time of the -w watchdog
+#define WATCHDOG_FADE_MS 2000
+// most frames per second of a DMX universe
+#define DMX_MAX_HZ 44
 
-// global var for i2c file descriptor
-int i2c_fd;
+// response curves that can be applied to patched values
+enum Curve { CURVE_LINEAR, CURVE_SQUARE, CURVE_GAMMA, CURVES };
+const char *curveNames[CURVES] = { "linear", "square", "gamma" };
+
+// 12-bit PWM value for every 8-bit and every 12-bit input, per curve
+unsigned short curve8[CURVES][256];
+unsigned short curve12[CURVES][4096];
+
+// one i2c adapter and the addresses of the devices on it
+struct Bus {
+  unsigned int adpt;
+  int fd;
+  vector<unsigned char> addrs;
+  PCA9685_bus *writer;            // async writer, completions on its eventfd
+  vector<PCA9685_req*> reqs;      // resubmit scratch
+};
+
+// one PCA9685 and its packed PWM registers
+// frame is patched by NewDmx(), sending is the copy the async writer
+// owns while inflight, changes made meanwhile are sent once it is reaped
+// dirty is cleared only once a write of the latest changes succeeded
+struct Device {
+  unsigned int bus;
+  unsigned char addr;
+  bool dirty;
+  bool inflight;
+  unsigned int changes;           // frame changes and keep-alives so far
+  unsigned int sentChanges;       // changes in the frame being sent
+  unsigned long long dmxNs;       // arrival of the frame being sent
+  unsigned long long pendingNs;   // arrival of the oldest change waiting
+  unsigned char frame[_PCA9685_FRAMELEN];
+  unsigned char sending[_PCA9685_FRAMELEN];
+  PCA9685_req req;
+};
+
+// one DMX slot, or msb/lsb slot pair, feeding one PWM channel
+struct Patch {
+  unsigned short slot;
+  unsigned char bits;
+  unsigned char chan;
+  unsigned int device;
+  const unsigned short *curve;
+  unsigned char *offReg;
+};
+
+// the compiled tables for one universe, walked once per DMX frame
+struct Universe {
+  unsigned int id;
+  unsigned int span;
+  vector<Patch> patches;
+  vector<unsigned int> devices;   // sorted by bus for batching
+  vector<uint8_t> lastDmx;
+  unsigned long long lastWriteNs;
+  vector<PCA9685_req*> reqs;      // commit scratch
+};
+
+// one line of the patch file
+struct PatchLine {
+  unsigned int universe;
+  unsigned int slot;
+  unsigned int adpt;
+  unsigned int addr;
+  unsigned int chan;
+  unsigned int bits;
+  unsigned int curve;
+};
+
+vector<Bus> buses;
+vector<Device> devices;
+vector<Universe> universes;
+
+// command line options
+bool logChanges = true;
+unsigned int statsInterval = 0;
+unsigned int keepAliveMs = 1000;
+unsigned int watchdogMs = 0;
+unsigned int traceEvery = 0;
+unsigned long busHz = 0;
+const char *metricsPath = NULL;
+const char *patchFile = NULL;
+
+// frames written to the PCA9685s and unchanged frames skipped
+atomic<unsigned long long> framesSent(0);
+atomic<unsigned long long> framesSuppressed(0);
+
+// one PWM channel change, queued by NewDmx() for logThread()
+struct ChanChange {
+  unsigned int device;
+  unsigned char chan;
+  unsigned short val;
+};
+
+// single producer single consumer ring of channel changes
+ChanChange logRing[LOG_RING];
+atomic<unsigned int> logHead(0);
+atomic<unsigned int> logTail(0);
+atomic<unsigned int> logDropped(0);
+
+// frame-to-write latency, updated by reapBus() and reported by logThread()
+atomic<unsigned long long> latFrames(0);
+atomic<unsigned long long> latTotalNs(0);
+atomic<unsigned long long> latMaxNs(0);
+
+
+unsigned long long nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// queue a channel change without blocking, drop it if the logger is behind
+void logChange(unsigned int device, unsigned char chan, unsigned short val) {
+  unsigned int head = logHead.load(memory_order_relaxed);
+  if (head - logTail.load(memory_order_acquire) >= LOG_RING) {
+    logDropped.fetch_add(1, memory_order_relaxed);
+    return;
+  } // if full
+  logRing[head & (LOG_RING - 1)] = { device, chan, val };
+  logHead.store(head + 1, memory_order_release);
+}
+
+
+// print queued channel changes and latency stats off the DMX thread
+void logThread() {
+  unsigned long long lastStats = nowNs();
+  while (true) {
+    unsigned int tail = logTail.load(memory_order_relaxed);
+    unsigned int head = logHead.load(memory_order_acquire);
+    for (; tail != head; tail++) {
+      ChanChange change = logRing[tail & (LOG_RING - 1)];
+      const Device &dev = devices[change.device];
+      char line[32];
+      snprintf(line, sizeof(line), "%u 0x%02x %02u: 0x%03x",
+               buses[dev.bus].adpt, dev.addr, change.chan, change.val);
+      cout << line << endl;
+    } // for changes
+    logTail.store(tail, memory_order_release);
+
+    unsigned int dropped = logDropped.exchange(0, memory_order_relaxed);
+    if (dropped) {
+      cout << dec << "logThread(): dropped " << dropped << " changes" << endl;
+    } // if dropped
+
+    if (statsInterval && nowNs() - lastStats >= statsInterval * 1000000000ULL) {
+      lastStats = nowNs();
+      unsigned long long frames = latFrames.exchange(0, memory_order_relaxed);
+      unsigned long long totalNs = latTotalNs.exchange(0, memory_order_relaxed);
+      unsigned long long maxNs = latMaxNs.exchange(0, memory_order_relaxed);
+      cout << dec << "frames sent " << framesSent.load(memory_order_relaxed);
+      cout << " suppressed " << framesSuppressed.load(memory_order_relaxed);
+      if (frames) {
+        cout << " latency avg " << totalNs / frames / 1000 << " us";
+        cout << " max " << maxNs / 1000 << " us";
+      } // if frames
+      cout << endl;
+      // per-stage latency from DMX receipt to the ioctl, since startup
+      for (const Bus &bus : buses) {
+        if (!traceEvery) break;
+        PCA9685_busTrace trace;
+        PCA9685_getBusTrace(bus.writer, &trace);
+        cout << "bus " << bus.adpt << " trace" << endl << flush;
+        PCA9685_dumpBusTrace(stdout, &trace);
+        fflush(stdout);
+      } // for buses
+    } // if stats
+
+    usleep(10000);
+  } // while
+}
+
+
+// fill the curve tables once at startup
+void buildCurves() {
+  for (unsigned int i = 0; i < 4096; i++) {
+    double x = i / 4095.0;
+    curve12[CURVE_LINEAR][i] = i;
+    curve12[CURVE_SQUARE][i] = x * x * 4095 + 0.5;
+    curve12[CURVE_GAMMA][i] = pow(x, GAMMA) * 4095 + 0.5;
+  } // for 12-bit
+  for (unsigned int c = 0; c < CURVES; c++) {
+    for (unsigned int v = 0; v < 256; v++) {
+      curve8[c][v] = curve12[c][v * 4095 / 255];
+    } // for 8-bit
+  } // for curves
+}
+
+
+// read the patch file, one PatchLine per non-comment line
+int readPatch(const char *fileName, vector<PatchLine> &lines) {
+  FILE *fp = fopen(fileName, "r");
+  if (fp == NULL) {
+    cerr << "readPatch(): unable to open " << fileName << endl;
+    return -1;
+  } // if fp
+
+  char buf[256];
+  unsigned int lineNum = 0;
+  while (fgets(buf, sizeof(buf), fp)) {
+    lineNum++;
+    char *comment = strchr(buf, '#');
+    if (comment) *comment = '\0';
+
+    PatchLine line;
+    char curve[16] = "linear";
+    int fields = sscanf(buf, "%u %u %u %i %u %u %15s", &line.universe,
+                        &line.slot, &line.adpt, (int *) &line.addr,
+                        &line.chan, &line.bits, curve);
+    if (fields <= 0) continue;
+
+    const char *err = NULL;
+    line.curve = CURVES;
+    for (unsigned int c = 0; c < CURVES; c++) {
+      if (strcmp(curve, curveNames[c]) == 0) line.curve = c;
+    } // for curves
+    if (fields < 6) err = "expected: universe slot bus addr chan bits [curve]";
+    else if (line.bits != 8 && line.bits != 16) err = "bits must be 8 or 16";
+    else if (line.slot < 1 || line.slot + line.bits / 8 - 1 > DMX_SLOTS) err = "slot out of range";
+    else if (line.addr < 0x01 || line.addr > 0x7F) err = "addr out of range";
+    else if (line.adpt > 255) err = "bus out of range";
+    else if (line.chan >= _PCA9685_CHANS) err = "chan out of range";
+    else if (line.curve == CURVES) err = "unknown curve";
+    if (err) {
+      cerr << fileName << ":" << lineNum << ": " << err << endl;
+      fclose(fp);
+      return -1;
+    } // if err
+
+    lines.push_back(line);
+  } // while lines
+
+  fclose(fp);
+  return 0;
+}
+
+
+// turn the patch lines into the flat bus, device and universe tables
+int compilePatch(const vector<PatchLine> &lines) {
+  vector<unsigned int> lineDevice;
+  for (const PatchLine &line : lines) {
+    unsigned int b = 0;
+    while (b < buses.size() && buses[b].adpt != line.adpt) b++;
+    if (b == buses.size()) buses.push_back({ line.adpt, -1, {}, NULL, {} });
+
+    unsigned int d = 0;
+    while (d < devices.size() &&
+           (devices[d].bus != b || devices[d].addr != line.addr)) d++;
+    if (d == devices.size()) {
+      devices.push_back(Device());
+      devices[d].bus = b;
+      devices[d].addr = line.addr;
+      buses[b].addrs.push_back(line.addr);
+    } // if new device
+    lineDevice.push_back(d);
+  } // for lines
+
+  // the device table is final, so frame pointers are now stable
+  vector<bitset<_PCA9685_CHANS> > used(devices.size());
+  for (unsigned int i = 0; i < lines.size(); i++) {
+    const PatchLine &line = lines[i];
+    unsigned int d = lineDevice[i];
+    if (used[d].test(line.chan)) {
+      cerr << "compilePatch(): bus " << line.adpt << " addr " << line.addr;
+      cerr << " chan " << line.chan << " is patched twice" << endl;
+      return -1;
+    } // if used
+    used[d].set(line.chan);
+
+    unsigned int u = 0;
+    while (u < universes.size() && universes[u].id != line.universe) u++;
+    if (u == universes.size()) {
+      universes.push_back(Universe());
+      universes[u].id = line.universe;
+      universes[u].span = 0;
+      universes[u].lastWriteNs = 0;
+    } // if new universe
+    Universe &uni = universes[u];
+
+    Patch patch;
+    patch.slot = line.slot - 1;
+    patch.bits = line.bits;
+    patch.chan = line.chan;
+    patch.device = d;
+    patch.curve = line.bits == 16 ? curve12[line.curve] : curve8[line.curve];
+    patch.offReg = &devices[d].frame[1 + line.chan * 4 + 2];
+    uni.patches.push_back(patch);
+    uni.span = max(uni.span, patch.slot + line.bits / 8u);
+    if (find(uni.devices.begin(), uni.devices.end(), d) == uni.devices.end()) {
+      uni.devices.push_back(d);
+    } // if new device
+  } // for lines
+
+  for (Universe &uni : universes) {
+    // walk the patches in slot order and commit the devices bus by bus
+    sort(uni.patches.begin(), uni.patches.end(),
+         [](const Patch &a, const Patch &b) { return a.slot < b.slot; });
+    sort(uni.devices.begin(), uni.devices.end(),
+         [](unsigned int a, unsigned int b) {
+           return devices[a].bus != devices[b].bus ?
+                  devices[a].bus < devices[b].bus : a < b; });
+    uni.lastDmx.assign(uni.span, 0);
+    uni.reqs.resize(uni.devices.size());
+  } // for universes
+
+  for (unsigned int d = 0; d < devices.size(); d++) {
+    Device &dev = devices[d];
+    dev.req.addr = dev.addr;
+    dev.req.buf = dev.sending;
+    dev.req.len = _PCA9685_FRAMELEN;
+    dev.req.user = &dev;
+    buses[dev.bus].reqs.reserve(buses[dev.bus].addrs.size());
+  } // for devices
+
+  return 0;
+}
+
+
+// hand a device's frame to its bus writer, returns its request
+PCA9685_req *queue(Device &dev, unsigned long long dmxNs) {
+  memcpy(dev.sending, dev.frame, _PCA9685_FRAMELEN);
+  dev.sending[0] = _PCA9685_BASEPWMREG;
+  dev.sentChanges = dev.changes;
+  dev.inflight = true;
+  dev.dmxNs = dmxNs;
+  dev.pendingNs = 0;
+  // the trace times the frame from its DMX, nowNs() is CLOCK_MONOTONIC
+  dev.req.source.tv_sec = dmxNs / 1000000000ULL;
+  dev.req.source.tv_nsec = dmxNs % 1000000000ULL;
+  return &dev.req;
+}
+
+
+// queue the dirty devices of a universe, one batch per bus, devices still
+// being written are queued again when reaped if they changed meanwhile
+// returns the number of devices written or -1 on error
+int commit(Universe &uni, bool all, unsigned long long dmxNs) {
+  int written = 0;
+  int ret = 0;
+  unsigned int n = 0;
+  const unsigned int *d = uni.devices.data();
+  const unsigned int *end = d + uni.devices.size();
+  for (; d != end; d++) {
+    Device &dev = devices[*d];
+    if (dev.inflight) {
+      // a keep-alive counts as a change, so it is sent once reaped
+      if (all) {
+        dev.dirty = true;
+        dev.changes++;
+      } // if all
+      if (dev.changes != dev.sentChanges) {
+        if (!dev.pendingNs) dev.pendingNs = dmxNs;
+        written++;
+      } // if changed
+    } else if (dev.dirty || all) {
+      uni.reqs[n++] = queue(dev, dmxNs);
+      written++;
+    } // if dirty
+
+    // submit the batch at the last device on each bus
+    if (n && (d + 1 == end || devices[d[1]].bus != dev.bus)) {
+      if (PCA9685_submitReqs(buses[dev.bus].writer, n, uni.reqs.data()) != 0) {
+        cout << "commit(): PCA9685_submitReqs() failed on bus ";
+        cout << buses[dev.bus].adpt << endl;
+        // not written, so sent again with the next commit or reap
+        for (unsigned int i = 0; i < n; i++) {
+          Device &failed = *(Device *) uni.reqs[i]->user;
+          failed.inflight = false;
+          if (!failed.pendingNs) failed.pendingNs = dmxNs;
+        } // for reqs
+        ret = -1;
+      } // if err
+      n = 0;
+    } // if submit
+  } // for devices
+  return ret ? ret : written;
+}
+
+
+// take the completed writes of a bus, called by the SelectServer when
+// the bus writer's eventfd is readable
+void reapBus(unsigned int b) {
+  Bus &bus = buses[b];
+  PCA9685_req *reqs[REAP_BATCH];
+  int n;
+  bus.reqs.clear();
+  while ((n = PCA9685_reap(bus.writer, REAP_BATCH, reqs)) > 0) {
+    unsigned long long now = nowNs();
+    for (int i = 0; i < n; i++) {
+      Device &dev = *(Device *) reqs[i]->user;
+      dev.inflight = false;
+      if (reqs[i]->result == _PCA9685_EQUARANTINED) {
+        // the library restores the device's last frame once it answers
+      } else if (reqs[i]->result != 0) {
+        cout << "reapBus(): write to 0x" << hex << (unsigned int) dev.addr << dec;
+        cout << " on bus " << bus.adpt << " returned " << reqs[i]->result << endl;
+        // still dirty, the frame is sent again, a device that stopped
+        // answering is quarantined by then and the library keeps it
+        if (!dev.pendingNs) dev.pendingNs = dev.dmxNs;
+      } else {
+        unsigned long long latency = now - dev.dmxNs;
+        latFrames.fetch_add(1, memory_order_relaxed);
+        latTotalNs.fetch_add(latency, memory_order_relaxed);
+        unsigned long long maxNs = latMaxNs.load(memory_order_relaxed);
+        while (latency > maxNs &&
+               !latMaxNs.compare_exchange_weak(maxNs, latency, memory_order_relaxed));
+      } // if err
+      if ((reqs[i]->result == 0 || reqs[i]->result == _PCA9685_EQUARANTINED) &&
+          dev.changes == dev.sentChanges) {
+        dev.dirty = false;
+        dev.pendingNs = 0;
+      } // if written
+      if (dev.dirty) bus.reqs.push_back(queue(dev, dev.pendingNs));
+    } // for reqs
+  } // while reaped
+
+  // changes that arrived while their device was being written
+  if (!bus.reqs.empty() &&
+      PCA9685_submitReqs(bus.writer, bus.reqs.size(), bus.reqs.data()) != 0) {
+    cout << "reapBus(): PCA9685_submitReqs() failed on bus " << bus.adpt << endl;
+    for (PCA9685_req *req : bus.reqs) {
+      Device &dev = *(Device *) req->user;
+      dev.inflight = false;
+      if (!dev.pendingNs) dev.pendingNs = dev.dmxNs;
+    } // for reqs
+  } // if resubmit
+}
 
 
 // Called when universe registration completes.
@@ -29,74 +480,185 @@ void RegisterComplete(const ola::client::Result& result) {
 // Called when new DMX data arrives.
 void NewDmx(const ola::client::DMXMetadata &metadata,
             const ola::DmxBuffer &data) {
-  static string inData="";
-  inData = data.Get();
-  unsigned int onVals[_PCA9685_CHANS];
-  static unsigned int offVals[_PCA9685_CHANS];
-  for (int i = 0; i < _PCA9685_CHANS; i++) {
-        onVals[i] = 0;
-  } // for
-
-  int dmxVals[_PCA9685_CHANS];
- 
-  // 16-bit ola values so two 8-bit dmx channels per 12-bit pwm value
-  for (unsigned int dmxChan = 0; dmxChan < inData.length(); dmxChan++) {
-
-    // disregard any data after pwm values
-    if (dmxChan >= _PCA9685_CHANS * 2) break;
- 
-    // get both bytes and increment dmxChan
-    int msb = inData.at(dmxChan);
-    dmxChan++;
-    int lsb = inData.at(dmxChan);
-    int pwmChan = dmxChan / 2;
-    dmxVals[pwmChan] = msb * 256 + lsb;
- 
-    // convert 16-bit to 12-bit
-    unsigned int pwmVal = dmxVals[pwmChan] >> 4;
- 
-    if (pwmVal != offVals[pwmChan]) {
-      cout << showbase << std::internal << setfill('0');
-      cout << dec << setw(2) << pwmChan << ": ";
-      cout << hex << setw(5) << pwmVal << endl;
+  unsigned long long start = nowNs();
+
+  Universe *uni = NULL;
+  for (Universe &u : universes) {
+    if (u.id == metadata.universe) uni = &u;
+  } // for universes
+  if (uni == NULL) return;
+
+  // pad short frames with zeros so every patched slot can be read
+  const uint8_t *dmx = data.GetRaw();
+  uint8_t padded[DMX_SLOTS];
+  if (data.Size() < uni->span) {
+    memset(padded, 0, uni->span);
+    memcpy(padded, dmx, data.Size());
+    dmx = padded;
+  } // if short
+
+  // skip the bus write if nothing changed, unless the keep-alive is due
+  bool keepAlive = keepAliveMs == 0 ||
+                   start - uni->lastWriteNs >= keepAliveMs * 1000000ULL;
+  if (!keepAlive && memcmp(dmx, uni->lastDmx.data(), uni->span) == 0) {
+    framesSuppressed.fetch_add(1, memory_order_relaxed);
+    return;
+  } // if unchanged
+
+  const Patch *p = uni->patches.data();
+  const Patch *end = p + uni->patches.size();
+  for (; p != end; p++) {
+    // 16-bit values are truncated to 12 bits before the curve
+    unsigned int pwmVal = p->bits == 16 ?
+        p->curve[(dmx[p->slot] << 4) | (dmx[p->slot + 1] >> 4)] :
+        p->curve[dmx[p->slot]];
+
+    unsigned char *offReg = p->offReg;
+    if (pwmVal != (unsigned int) (offReg[0] | offReg[1] << 8)) {
+      offReg[0] = pwmVal & 0xFF;
+      offReg[1] = pwmVal >> 8;
+      devices[p->device].dirty = true;
+      devices[p->device].changes++;
+      if (logChanges) logChange(p->device, p->chan, pwmVal);
     } // if
+  } // for patches
 
-    // store the 12-bit pwmVal
-    offVals[pwmChan] = pwmVal;
- 
-    // update all PWM values once at end of frame
-    if (dmxChan == _PCA9685_CHANS * 2 - 1) {
-
-      // update all channels from offVals
-      int ret;
-      ret = PCA9685_setPWMVals(i2c_fd, I2C_ADDR, onVals, offVals);
-      if (ret != 0) {
-        cout << "NewDMX(): PCA9685_setPWMVals() returned " << ret << endl;
-        return;
-      } // if err
-    } // if chan
-  } // for chan
+  // queue the changed devices, or all of them on a keep-alive, the
+  // writes complete in reapBus() so the SelectServer never waits on i2c
+  // a frame that failed to queue is not remembered, so the same frame
+  // arriving again is not suppressed and retries it
+  int written = commit(*uni, keepAlive, start);
+  if (written < 0) return;
+  memcpy(uni->lastDmx.data(), dmx, uni->span);
+  if (keepAlive) uni->lastWriteNs = start;
+  if (written == 0) {
+    framesSuppressed.fetch_add(1, memory_order_relaxed);
+    return;
+  } // if nothing written
+  framesSent.fetch_add(1, memory_order_relaxed);
 } // NewDMX
 
 
-int main() {
+int main(int argc, char **argv) {
   cout << "olaclient " << libPCA9685_VERSION_MAJOR << "." << libPCA9685_VERSION_MINOR << endl;
-  // setup I2C device
-  i2c_fd = PCA9685_openI2C(I2C_ADPT, I2C_ADDR);
-  if (i2c_fd < 0) {
-    cout << "main(): PCA9685_openI2C() returned " << i2c_fd;
-    cout << " on I2C_ADPT " << I2C_ADPT << " at I2C_ADDR " << I2C_ADDR << endl;
-    return i2c_fd;
-  } // if err
 
-  // setup PCA9685 device
+  int c;
+  while ((c = getopt(argc, argv, "qs:k:w:t:c:m:p:")) != -1) {
+    switch (c) {
+      case 'q': // quiet, don't log channel changes
+        logChanges = false;
+        break;
+      case 's': // report frame count and latency every N seconds
+        statsInterval = atoi(optarg);
+        break;
+      case 'k': // rewrite unchanged frames every N ms, 0 writes every frame
+        keepAliveMs = atoi(optarg);
+        break;
+      case 'w': // fade out and sleep the chips after N ms without DMX
+        watchdogMs = atoi(optarg);
+        break;
+      case 't': // trace every Nth frame through the bus writers, with -s
+        traceEvery = atoi(optarg);
+        break;
+      case 'c': // i2c bus clock, plan the buses and watch their load
+        busHz = strtoul(optarg, NULL, 0);
+        break;
+      case 'm': // serve Prometheus metrics on a Unix socket
+        metricsPath = optarg;
+        break;
+      case 'p': // patch file
+        patchFile = optarg;
+        break;
+      default:
+        cerr << "Usage: " << argv[0] << " [-q] [-s seconds] [-k ms] [-w ms] [-t N] [-c hz] [-m socket] [-p patchfile]" << endl;
+        return 1;
+    } // switch
+  } // while
+
+  // load the patch, defaulting to 16x 16-bit channels on one device
+  buildCurves();
+  vector<PatchLine> lines;
+  if (patchFile) {
+    if (readPatch(patchFile, lines) != 0) return 1;
+  } else {
+    for (unsigned int chan = 0; chan < _PCA9685_CHANS; chan++) {
+      lines.push_back({ DMX_UNIVERSE, chan * 2 + 1, I2C_ADPT, I2C_ADDR,
+                        chan, 16, CURVE_LINEAR });
+    } // for chans
+  } // if patchFile
+  if (compilePatch(lines) != 0) return 1;
+  cout << "main(): patched " << lines.size() << " channels on ";
+  cout << devices.size() << " devices, " << buses.size() << " buses, ";
+  cout << universes.size() << " universes" << endl;
+
   int ret;
-  ret = PCA9685_initPWM(i2c_fd, I2C_ADDR, PWM_FREQ);
-  if (ret != 0) {
-    cout << "main(): PCA9685_initPWM() returned " << ret;
-    cout << " I2C_ADDR " << I2C_ADDR << " PWM_FREQ " << PWM_FREQ << endl;
-    return ret;
-  } // if err
+  for (Bus &bus : buses) {
+    // setup I2C device
+    bus.fd = PCA9685_openI2C(bus.adpt, bus.addrs[0]);
+    if (bus.fd < 0) {
+      cout << "main(): PCA9685_openI2C() returned " << bus.fd;
+      cout << " on bus " << bus.adpt << endl;
+      return bus.fd;
+    } // if err
+
+    // setup all PCA9685 devices on the bus with one reset
+    ret = PCA9685_initPWMs(bus.fd, bus.addrs.size(), bus.addrs.data(), PWM_FREQ);
+    if (ret != 0) {
+      cout << "main(): PCA9685_initPWMs() returned " << ret;
+      cout << " on bus " << bus.adpt << " PWM_FREQ " << PWM_FREQ << endl;
+      return ret;
+    } // if err
+
+    // writes go through a worker thread per bus
+    bus.writer = PCA9685_openBus(bus.fd);
+    if (bus.writer == NULL) {
+      cout << "main(): PCA9685_openBus() failed on bus " << bus.adpt << endl;
+      return 1;
+    } // if err
+    // a device that drops off the bus is re-initialized when it is back
+    PCA9685_setBusRecovery(bus.writer, PWM_FREQ, 0, 0);
+    if (watchdogMs && PCA9685_setBusWatchdog(bus.writer, watchdogMs, WATCHDOG_FADE_MS, NULL, true) != 0) {
+      cout << "main(): PCA9685_setBusWatchdog() failed on bus " << bus.adpt << endl;
+      return 1;
+    } // if watchdog
+    PCA9685_setBusTrace(bus.writer, traceEvery);
+
+    // frames of devices that do not fit in the bus merge and are skipped
+    if (busHz) {
+      PCA9685_plan plan = {};
+      plan.devices = bus.addrs.size();
+      plan.hz = busHz;
+      plan.chans = 0xFFFF;
+      plan.msgUs = _PCA9685_MSGUS;
+      plan.xferUs = _PCA9685_XFERUS;
+      plan.rate = DMX_MAX_HZ;
+      if (PCA9685_planBus(&plan) > 0) {
+        cout << "main(): " << plan.devices << " devices on bus " << bus.adpt << " at ";
+        cout << busHz << " Hz hold " << (unsigned int) plan.maxRate << " of ";
+        cout << DMX_MAX_HZ << " DMX frames per second" << endl;
+      } // if !fits
+      PCA9685_setBusClock(bus.writer, busHz);
+    } // if busHz
+  } // for buses
+
+  // scrapes are answered from the library's own thread
+  if (metricsPath) {
+    PCA9685_metrics *metrics = PCA9685_openMetrics(metricsPath);
+    if (metrics == NULL) return 1;
+    for (const Bus &bus : buses) {
+      PCA9685_addMetricsBus(metrics, bus.writer, ("i2c-" + to_string(bus.adpt)).c_str());
+    } // for buses
+    PCA9685_addMetricsCounter(metrics, "olaclient_frames_sent_total", "DMX frames written.",
+        [](void *) { return framesSent.load(memory_order_relaxed); }, NULL);
+    PCA9685_addMetricsCounter(metrics, "olaclient_frames_suppressed_total",
+        "DMX frames unchanged and not written.",
+        [](void *) { return framesSuppressed.load(memory_order_relaxed); }, NULL);
+  } // if metrics
+
+  // printing happens on its own thread so NewDmx() never waits on stdout
+  if (logChanges || statsInterval) {
+    thread(logThread).detach();
+  } // if logger
 
   // setup ola logging and wrapper
   ola::InitLogging(ola::OLA_LOG_INFO, ola::OLA_LOG_STDERR);
@@ -107,12 +669,22 @@ int main() {
     return 1;
   } // if err
 
+  // reap completed writes from the same loop that delivers the DMX
+  ola::io::SelectServer *ss = wrapper.GetSelectServer();
+  for (unsigned int b = 0; b < buses.size(); b++) {
+    ola::io::UnmanagedFileDescriptor *desc =
+        new ola::io::UnmanagedFileDescriptor(PCA9685_getBusFd(buses[b].writer));
+    desc->SetOnData(ola::NewCallback(&reapBus, b));
+    ss->AddReadDescriptor(desc);
+  } // for buses
+
   // connect ola to client
   ola::client::OlaClient *client = wrapper.GetClient();
-  // Set the callback and register our interest in this universe
+  // Set the callback and register our interest in each patched universe
   client->SetDMXCallback(ola::NewCallback(&NewDmx));
-  client->RegisterUniverse(
-      DMX_UNIVERSE, ola::client::REGISTER, ola::NewSingleCallback(&RegisterComplete));
-  wrapper.GetSelectServer()->Run();
+  for (const Universe &uni : universes) {
+    client->RegisterUniverse(
+        uni.id, ola::client::REGISTER, ola::NewSingleCallback(&RegisterComplete));
+  } // for universes
+  ss->Run();
 }
-
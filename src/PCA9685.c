@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,10 @@
 bool _PCA9685_DEBUG = 0;
 // test flag
 bool _PCA9685_TEST = 0;
+// quiet flag, test mode without the trace of faked calls
+bool _PCA9685_QUIET = 0;
+// test NACK address, faked transactions with a message to it fail
+unsigned char _PCA9685_TESTNACK = 0;
 // mode1 value hardware defaults (all call and sleep)
 unsigned char _PCA9685_MODE1 = 0x00 | _PCA9685_ALLCALLBIT | _PCA9685_SLEEPBIT;
 // mode2 value hardware defaults (totem pole mode)
@@ -79,57 +84,90 @@ int PCA9685_initPWM(int fd, unsigned char addr, unsigned int freq) {
     printf("PCA9685_initPWM(): reset complete on fd %d\n", fd);
   } // if debug
 
-
   // after the reset, all of the control registers default vals are ok 
-
-  // turn all PWM's off 
-  ret = PCA9685_setAllPWM(fd, addr, 0x00, 0x00);
-  if (ret != 0) {
-    fprintf(stderr, "PCA9685_initPWM(): PCA9685_setAllPWM() returned %d\n", ret);
-    return -1;
-  } // if  
-  if (_PCA9685_DEBUG) {
-    printf("PCA9685_initPWM(): all PWM off on fd %d, addr 0x%02x\n", fd, addr);
-  } // if debug
-
-  // set the oscillator frequency 
-  ret = _PCA9685_setPWMFreq(fd, addr, freq);
+  ret = _PCA9685_configPWM(fd, addr, freq);
   if (ret != 0) {
-    fprintf(stderr, "PCA9685_initPWM(): _PCA9685_setPWMFreq() returned %d\n", ret);
+    fprintf(stderr, "PCA9685_initPWM(): _PCA9685_configPWM() returned %d\n", ret);
     return -1;
   } // if 
+
+  return 0;
+} // PCA9685_initPWM
+
+
+
+/////////////////////////////////////////////////////////////////////
+// initialize several PCA9685 devices on one bus with a single reset
+int PCA9685_initPWMs(int fd, unsigned int n, unsigned char* addrs,
+                     unsigned int freq) {
+  int ret;
   if (_PCA9685_DEBUG) {
-    printf("PCA9685_initPWM(): frequency set to %d on fd %d, addr 0x%02x\n", freq, fd, addr);
+    printf("PCA9685_initPWMs(): starting on fd %d, %d devices, freq %d\n", fd, n, freq);
   } // if debug
 
-  // set MODE1 register using default value with AUTOINC
-  // and without any of SLEEP, EXTCLK, and RESTART
-  unsigned char mode1val = _PCA9685_MODE1 | _PCA9685_AUTOINCBIT;
-  mode1val = mode1val & ~_PCA9685_SLEEPBIT & ~_PCA9685_EXTCLKBIT & ~_PCA9685_RESTARTBIT;
-  ret = _PCA9685_writeI2CReg(fd, addr, _PCA9685_MODE1REG, 1, &mode1val);
+  // the reset reaches every device on the bus so only send it once
+  unsigned char resetval = _PCA9685_RESETVAL;
+  ret = _PCA9685_writeI2CRaw(fd, _PCA9685_GENCALLADDR, 1, &resetval);
   if (ret != 0) {
-    fprintf(stderr, "PCA9685_initPWM(): _PCA9685_writeI2CReg() returned ");
-    fprintf(stderr, "%d on addr %02x\n", ret, addr);
+    fprintf(stderr, "PCA9685_initPWMs(): _PCA9685_writeI2CRaw() returned %d\n", ret);
     return -1;
   } // if 
   if (_PCA9685_DEBUG) {
-    printf("PCA9685_initPWM(): mode1 set to 0x%02x on fd %d, addr 0x%02x\n", mode1val, fd, addr);
+    printf("PCA9685_initPWMs(): reset complete on fd %d\n", fd);
   } // if debug
 
-  // set MODE2 register
-  unsigned char mode2val = _PCA9685_MODE2;
-  ret = _PCA9685_writeI2CReg(fd, addr, _PCA9685_MODE2REG, 1, &mode2val);
-  if (ret != 0) {
-    fprintf(stderr, "PCA9685_initPWM(): _PCA9685_writeI2CReg() returned ");
-    fprintf(stderr, "%d on addr %02x\n", ret, addr);
-    return -1;
-  } // if 
+  unsigned int i;
+  for (i=0; i<n; i++) {
+    ret = _PCA9685_configPWM(fd, addrs[i], freq);
+    if (ret != 0) {
+      fprintf(stderr, "PCA9685_initPWMs(): _PCA9685_configPWM() returned ");
+      fprintf(stderr, "%d on addr %02x\n", ret, addrs[i]);
+      return -1;
+    } // if 
+  } // for devices
+
+  return 0;
+} // PCA9685_initPWMs
+
+
+
+/////////////////////////////////////////////////////////////////////
+// set the PWM frames of several devices on one bus in as few
+// transactions as possible
+int PCA9685_setPWMFrames(int fd, unsigned int n, unsigned char* addrs,
+                         unsigned char** frames) {
+  struct i2c_rdwr_ioctl_data data;
+  struct i2c_msg msgs[_PCA9685_MAXMSGS];
+  unsigned int first;
+  int ret;
+
   if (_PCA9685_DEBUG) {
-    printf("PCA9685_initPWM(): mode2 set to 0x%02x on fd %d, addr 0x%02x\n", mode2val, fd, addr);
+    printf("PCA9685_setPWMFrames(): %d devices on fd %d\n", n, fd);
   } // if debug
 
+  // one message per device, split only where the kernel limit requires
+  for (first = 0; first < n; first += data.nmsgs) {
+    data.nmsgs = n - first > _PCA9685_MAXMSGS ? _PCA9685_MAXMSGS : n - first;
+    unsigned int i;
+    for (i=0; i<data.nmsgs; i++) {
+      frames[first+i][0] = _PCA9685_BASEPWMREG;
+      msgs[i].addr = addrs[first+i];
+      msgs[i].flags = 0x00;
+      msgs[i].len = _PCA9685_FRAMELEN;
+      msgs[i].buf = frames[first+i];
+    } // for msgs
+    data.msgs = msgs;
+
+    ret = _PCA9685_ioctl(fd, I2C_RDWR, (char *) &data);
+    if (ret < 0) {
+      fprintf(stderr, "PCA9685_setPWMFrames(): _PCA9685_ioctl() returned ");
+      fprintf(stderr, "%d on devices %d - %d\n", ret, first, first + data.nmsgs - 1);
+      return -1;
+    } // if 
+  } // for transactions
+
   return 0;
-} // PCA9685_initPWM
+} // PCA9685_setPWMFrames
 
 
 
@@ -176,6 +214,39 @@ int PCA9685_setPWMVals(int fd, unsigned char addr,
 
 
 
+/////////////////////////////////////////////////////////////////////
+// set all PWM channels from a packed frame in one transaction
+// frame[0] is overwritten with the start register, frame[1] onwards
+// holds LEDn_ON_L, LEDn_ON_H, LEDn_OFF_L, LEDn_OFF_H for each channel
+int PCA9685_setPWMFrame(int fd, unsigned char addr, unsigned char* frame) {
+  int ret;
+
+  if (_PCA9685_DEBUG) {
+    // report the write
+    printf("PCA9685_setPWMFrame(): vals[%d]: ", _PCA9685_CHANS);
+    int i;
+    for (i=0; i<_PCA9685_CHANS; i++) {
+      unsigned int offValue = frame[i*4+4] << 8;
+      offValue += frame[i*4+3];
+      printf(" %03x", offValue);
+    } // for
+    printf("\n");
+  } // if debug
+
+  // the frame is already packed so no copy is needed
+  frame[0] = _PCA9685_BASEPWMREG;
+  ret = _PCA9685_writeI2CRaw(fd, addr, _PCA9685_FRAMELEN, frame);
+  if (ret != 0) {
+    fprintf(stderr, "PCA9685_setPWMFrame(): _PCA9685_writeI2CRaw() returned ");
+    fprintf(stderr, "%d, addr %02x, reg %02x, len %d\n",
+            ret, addr, _PCA9685_BASEPWMREG, _PCA9685_FRAMELEN);
+    return -1;
+  } // if
+  return 0;
+} // PCA9685_setPWMFrame
+
+
+
 /////////////////////////////////////////////////////////////////////
 // set a PWM channel (4 bytes) with the low 12 bits from a 16-bit value 
 int PCA9685_setPWMVal(int fd, unsigned char addr, unsigned char reg,
@@ -246,6 +317,58 @@ int PCA9685_setAllPWM(int fd, unsigned char addr,
 
 
 
+/////////////////////////////////////////////////////////////////////
+// ioctl() of PCA9685_blackoutPWMs(), bypasses the stdio of
+// _PCA9685_ioctl() unless in test mode
+static int _PCA9685_blackoutIoctl(int fd, struct i2c_rdwr_ioctl_data* data) {
+  if (_PCA9685_TEST) return _PCA9685_ioctl(fd, I2C_RDWR, (char *) data) < 0 ? -1 : 0;
+  return ioctl(fd, I2C_RDWR, data) < 0 ? -1 : 0;
+} // _PCA9685_blackoutIoctl
+
+
+
+/////////////////////////////////////////////////////////////////////
+// turn off all PWM channels of several devices in one transaction
+// async-signal-safe: no stdio, no allocation, errno is preserved, and
+// the kernel serializes the transaction with any other in flight, so
+// it may be called from a signal handler interrupting another write
+// in test mode the trace still goes through stdio
+int PCA9685_blackoutPWMs(int fd, unsigned int n, unsigned char* addrs) {
+  // ALL_LED_ON 0 and the full OFF bit in ALL_LED_OFF_H
+  unsigned char off[5] = { _PCA9685_ALLLEDREG, 0x00, 0x00, 0x00, _PCA9685_FULLBIT };
+  struct i2c_rdwr_ioctl_data data;
+  struct i2c_msg msgs[_PCA9685_MAXMSGS];
+  unsigned int first;
+  int err = errno;
+  int ret = 0;
+
+  for (first = 0; first < n; first += data.nmsgs) {
+    data.nmsgs = n - first > _PCA9685_MAXMSGS ? _PCA9685_MAXMSGS : n - first;
+    unsigned int i;
+    for (i=0; i<data.nmsgs; i++) {
+      msgs[i].addr = addrs[first+i];
+      msgs[i].flags = 0x00;
+      msgs[i].len = sizeof(off);
+      msgs[i].buf = off;
+    } // for msgs
+    data.msgs = msgs;
+
+    if (_PCA9685_blackoutIoctl(fd, &data) == 0) continue;
+    // the transaction stopped at a device that did not answer, the
+    // devices after it are still worth turning off one by one
+    struct i2c_rdwr_ioctl_data one = { NULL, 1 };
+    for (i=0; i<data.nmsgs; i++) {
+      one.msgs = &msgs[i];
+      if (_PCA9685_blackoutIoctl(fd, &one) != 0) ret = -1;
+    } // for msgs
+  } // for transactions
+
+  errno = err;
+  return ret;
+} // PCA9685_blackoutPWMs
+
+
+
 /////////////////////////////////////////////////////////////////////
 // get both register values in one transaction
 int PCA9685_getRegVals(int fd, unsigned char addr,
@@ -368,6 +491,62 @@ int PCA9685_dumpAllRegs(int fd, unsigned char addr) {
 /////////////////////////////////////////////////////////////////////
 // internal functions, may be used but usually not required:
 
+/////////////////////////////////////////////////////////////////////
+// configure a PCA9685 device after a reset, turn off PWM's, set the freq
+int _PCA9685_configPWM(int fd, unsigned char addr, unsigned int freq) {
+  int ret;
+
+  // turn all PWM's off 
+  ret = PCA9685_setAllPWM(fd, addr, 0x00, 0x00);
+  if (ret != 0) {
+    fprintf(stderr, "_PCA9685_configPWM(): PCA9685_setAllPWM() returned %d\n", ret);
+    return -1;
+  } // if  
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_configPWM(): all PWM off on fd %d, addr 0x%02x\n", fd, addr);
+  } // if debug
+
+  // set the oscillator frequency 
+  ret = _PCA9685_setPWMFreq(fd, addr, freq);
+  if (ret != 0) {
+    fprintf(stderr, "_PCA9685_configPWM(): _PCA9685_setPWMFreq() returned %d\n", ret);
+    return -1;
+  } // if 
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_configPWM(): frequency set to %d on fd %d, addr 0x%02x\n", freq, fd, addr);
+  } // if debug
+
+  // set MODE1 register using default value with AUTOINC
+  // and without any of SLEEP, EXTCLK, and RESTART
+  unsigned char mode1val = _PCA9685_MODE1 | _PCA9685_AUTOINCBIT;
+  mode1val = mode1val & ~_PCA9685_SLEEPBIT & ~_PCA9685_EXTCLKBIT & ~_PCA9685_RESTARTBIT;
+  ret = _PCA9685_writeI2CReg(fd, addr, _PCA9685_MODE1REG, 1, &mode1val);
+  if (ret != 0) {
+    fprintf(stderr, "_PCA9685_configPWM(): _PCA9685_writeI2CReg() returned ");
+    fprintf(stderr, "%d on addr %02x\n", ret, addr);
+    return -1;
+  } // if 
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_configPWM(): mode1 set to 0x%02x on fd %d, addr 0x%02x\n", mode1val, fd, addr);
+  } // if debug
+
+  // set MODE2 register
+  unsigned char mode2val = _PCA9685_MODE2;
+  ret = _PCA9685_writeI2CReg(fd, addr, _PCA9685_MODE2REG, 1, &mode2val);
+  if (ret != 0) {
+    fprintf(stderr, "_PCA9685_configPWM(): _PCA9685_writeI2CReg() returned ");
+    fprintf(stderr, "%d on addr %02x\n", ret, addr);
+    return -1;
+  } // if 
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_configPWM(): mode2 set to 0x%02x on fd %d, addr 0x%02x\n", mode2val, fd, addr);
+  } // if debug
+
+  return 0;
+} // _PCA9685_configPWM
+
+
+
 /////////////////////////////////////////////////////////////////////
 // set the PWM frequency 
 int _PCA9685_setPWMFreq(int fd, unsigned char addr, unsigned int freq) {
@@ -541,9 +720,14 @@ int _PCA9685_writeI2CReg(int fd, unsigned char addr, unsigned char startReg,
     } // context
   }
 
+  // the register file is 256 bytes so the stack buffer always fits
+  if (len < 0 || len > 255) {
+    fprintf(stderr, "_PCA9685_writeI2CReg(): len %d out of range\n", len);
+    return -1;
+  } // if len
+
   // prepend the register address to the buffer 
-  unsigned char* rawBuf;
-  rawBuf = (unsigned char*)malloc(len+1);
+  unsigned char rawBuf[256];
   rawBuf[0] = startReg;
   memcpy(&rawBuf[1], writeBuf, len);
 
@@ -555,8 +739,6 @@ int _PCA9685_writeI2CReg(int fd, unsigned char addr, unsigned char startReg,
     return -1;
   } // if 
 
-  free(rawBuf);
-
   return 0;
 } // _PCA9685_writeI2CReg 
 
@@ -601,7 +783,7 @@ int _PCA9685_writeI2CRaw(int fd, unsigned char addr, int len,
 /////////////////////////////////////////////////////////////////////
 // wrapper for ioctl()
 int _PCA9685_ioctl(int fd, unsigned long int request, char *argp) {
-  if (_PCA9685_DEBUG || _PCA9685_TEST) {
+  if (_PCA9685_DEBUG || (_PCA9685_TEST && !_PCA9685_QUIET)) {
     if (request == I2C_RDWR) {
       struct i2c_rdwr_ioctl_data *datap = (struct i2c_rdwr_ioctl_data *) argp;
       struct i2c_rdwr_ioctl_data data = *datap;
@@ -628,6 +810,17 @@ int _PCA9685_ioctl(int fd, unsigned long int request, char *argp) {
   } // if debug or test
 
   if (_PCA9685_TEST) {
+    // a faked device pulled off the bus
+    if (_PCA9685_TESTNACK && request == I2C_RDWR) {
+      struct i2c_rdwr_ioctl_data *datap = (struct i2c_rdwr_ioctl_data *) argp;
+      unsigned int i;
+      for (i = 0; i < datap->nmsgs; i++) {
+        if (datap->msgs[i].addr == _PCA9685_TESTNACK) {
+          errno = ENXIO;
+          return -1;
+        } // if addr
+      } // for nmsgs
+    } // if nack
     return 0;
   } // if test
 
@@ -644,7 +837,7 @@ int _PCA9685_ioctl(int fd, unsigned long int request, char *argp) {
 /////////////////////////////////////////////////////////////////////
 // wrapper for open()
 int _PCA9685_open(const char *pathname, int flags) {
-  if (_PCA9685_DEBUG || _PCA9685_TEST) {
+  if (_PCA9685_DEBUG || (_PCA9685_TEST && !_PCA9685_QUIET)) {
     printf("_PCA9685_open(): pathname = %s flags = 0x%02x\n", pathname, flags);
   } // if debug or test
 
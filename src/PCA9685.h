@@ -3,10 +3,14 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 
 // debug and test flags
 extern bool _PCA9685_DEBUG;
 extern bool _PCA9685_TEST;
+extern bool _PCA9685_QUIET;
+extern unsigned char _PCA9685_TESTNACK;
 
 // mode registers for direct access
 extern unsigned char _PCA9685_MODE1;
@@ -48,6 +52,9 @@ extern unsigned char _PCA9685_MODE2;
 #define _PCA9685_OCHBIT 	0x08
 #define _PCA9685_INVRTBIT	0x10
 
+// full ON / full OFF bit within the LEDn_ON_H and LEDn_OFF_H registers
+#define _PCA9685_FULLBIT	0x10
+
 // control register value to initiate device reset
 #define _PCA9685_RESETVAL	0x06
 // control register address for i2c all call
@@ -61,6 +68,119 @@ extern unsigned char _PCA9685_MODE2;
 #define _PCA9685_MINVAL		0x000
 #define _PCA9685_MAXVAL		0xFFF
 
+// length of a packed register frame (start register and all PWM registers)
+#define _PCA9685_FRAMELEN	(1 + _PCA9685_CHANS*4)
+
+// most messages the kernel accepts in one combined transaction
+#define _PCA9685_MAXMSGS	42
+
+// results of async requests besides 0 (written) and -1 (failed)
+#define _PCA9685_ECANCELED	-2
+#define _PCA9685_ETIMEDOUT	-3
+// not sent, the device is quarantined, its LED registers are restored
+// once it answers again
+#define _PCA9685_EQUARANTINED	-4
+
+
+// async write of len bytes from buf to addr, buf[0] is the start register
+// the request is owned by the bus from PCA9685_submit() until done() is
+// called on the bus worker thread with result set, or, without done(),
+// until PCA9685_reap() returns it
+typedef struct PCA9685_req {
+  unsigned char addr;
+  unsigned char* buf;
+  unsigned short len;
+  struct timespec deadline;     // CLOCK_MONOTONIC, zero for none
+  struct timespec source;       // CLOCK_MONOTONIC the data arrived, zero for none
+  void (*done)(struct PCA9685_req* req);  // NULL to PCA9685_reap() it
+  void* user;
+  int result;
+  int state;                    // internal
+  unsigned long long submitNs;  // internal, set when sampled for the trace
+  struct PCA9685_req* next;     // internal
+} PCA9685_req;
+
+// async writer of one bus, one worker thread sends queued requests
+typedef struct PCA9685_bus PCA9685_bus;
+
+// counters of an async writer
+typedef struct PCA9685_busStats {
+  unsigned long long reqs;      // requests completed
+  unsigned long long sent;      // requests written
+  unsigned long long failed;    // messages not written
+  unsigned long long cancelled;
+  unsigned long long timedout;
+  unsigned long long merged;    // requests merged into an earlier one's message
+  unsigned long long msgs;      // messages written
+  unsigned long long bytes;     // message bytes written, without addresses
+  unsigned long long ioctls;    // combined transactions
+  unsigned int maxBatch;        // most requests taken at once
+  unsigned long long blackouts;  // blackouts written
+  unsigned long long blackoutNs; // PCA9685_blackout() to written, summed
+  unsigned long long maxBlackoutNs;
+  unsigned long long quarantined; // devices that stopped answering
+  unsigned long long probes;    // probes of quarantined devices
+  unsigned long long recovered; // devices restored after answering a probe
+  unsigned long long fades;     // watchdog fades after producers went quiet
+  unsigned long long retries;   // messages retried alone after a failed transaction
+  unsigned long long busyNs;    // time spent in transactions, for bus utilisation
+  unsigned long long wireNs;    // wire time of the messages written, with a bus clock set
+  unsigned long long saturated; // seconds of wire time over _PCA9685_SATURATED of the second
+} PCA9685_busStats;
+
+// counters of one device an async writer has written
+typedef struct PCA9685_busDev {
+  unsigned char addr;
+  bool quarantined;
+  unsigned long long written;   // requests written
+} PCA9685_busDev;
+
+// latency histogram, bucket b counts times of 2^(b-1) up to 2^b ns, the
+// last bucket everything longer
+#define _PCA9685_HISTBUCKETS	32
+typedef struct PCA9685_busHist {
+  unsigned long long count;
+  unsigned long long sumNs;
+  unsigned long long maxNs;
+  unsigned long long buckets[_PCA9685_HISTBUCKETS];
+} PCA9685_busHist;
+
+// bus load of a frame of every device, see PCA9685_planBus()
+typedef struct PCA9685_plan {
+  unsigned int devices;         // PCA9685s on the bus
+  unsigned long hz;             // bus clock, 100000, 400000 or 1000000
+  unsigned int chans;           // mask of the channels written per device
+  bool allLed;                  // one ALL_LED write per device instead
+  unsigned int msgUs;           // driver overhead per message, 0 for none
+  unsigned int xferUs;          // and per transaction
+  double rate;                  // frames per second wanted, 0 for none
+  // set by PCA9685_planBus()
+  unsigned int msgs;            // messages per frame
+  unsigned int bytes;           // message bytes per frame, without addresses
+  unsigned int ioctls;          // transactions per frame
+  double frameUs;               // bus time of a frame
+  double maxRate;               // most frames per second the bus carries
+  double utilisation;           // share of the bus rate takes
+} PCA9685_plan;
+
+// typical i2c-dev overheads of a message and a transaction in us
+#define _PCA9685_MSGUS		5
+#define _PCA9685_XFERUS		20
+// share of the bus time above which a writer counts itself saturated
+#define _PCA9685_SATURATED	0.9
+
+// Prometheus text metrics of async writers, served on a Unix socket
+typedef struct PCA9685_metrics PCA9685_metrics;
+
+// where the sampled requests of an async writer spent their time
+typedef struct PCA9685_busTrace {
+  PCA9685_busHist source;       // req.source to submitted
+  PCA9685_busHist queue;        // submitted to taken by the worker
+  PCA9685_busHist pack;         // taken to its transaction started
+  PCA9685_busHist ioctl;        // transaction started to written
+  PCA9685_busHist total;        // req.source, or submitted, to written
+} PCA9685_busTrace;
+
 
 // open the I2C bus device and assign the default slave address
 int PCA9685_openI2C(unsigned char adpt, unsigned char addr);
@@ -68,10 +188,21 @@ int PCA9685_openI2C(unsigned char adpt, unsigned char addr);
 // initialize a pca device to defaults, turn off PWM's, and set the freq
 int PCA9685_initPWM(int fd, unsigned char addr, unsigned int freq);
 
+// initialize several pca devices on one bus with a single reset
+int PCA9685_initPWMs(int fd, unsigned int n, unsigned char* addrs,
+                     unsigned int freq);
+
+// set the packed register frames of several devices in one transaction
+int PCA9685_setPWMFrames(int fd, unsigned int n, unsigned char* addrs,
+                         unsigned char** frames);
+
 // set all PWM channels from two arrays of ON and OFF vals in one transaction
 int PCA9685_setPWMVals(int fd, unsigned char addr,
                        unsigned int* onVals, unsigned int* offVals);
 
+// set all PWM channels from a packed register frame in one transaction
+int PCA9685_setPWMFrame(int fd, unsigned char addr, unsigned char* frame);
+
 // set a single PWM channel with a 16-bit ON val and a 16-bit OFF val
 int PCA9685_setPWMVal(int fd, unsigned char addr, unsigned char reg,
                       unsigned int on, unsigned int off);
@@ -80,6 +211,9 @@ int PCA9685_setPWMVal(int fd, unsigned char addr, unsigned char reg,
 int PCA9685_setAllPWM(int fd, unsigned char addr,
                       unsigned int on, unsigned int off);
 
+// turn off all PWM channels of several devices, async-signal-safe
+int PCA9685_blackoutPWMs(int fd, unsigned int n, unsigned char* addrs);
+
 // get both register values in one transaction
 int PCA9685_getRegVals(int fd, unsigned char addr,
                        unsigned char* mode1val, unsigned char* mode2val);
@@ -95,7 +229,93 @@ int PCA9685_getPWMVal(int fd, unsigned char addr, unsigned char reg,
 // print out the values of all registers used in a pca
 int PCA9685_dumpAllRegs(int fd, unsigned char addr);
 
+// start an async writer on an open I2C bus
+PCA9685_bus* PCA9685_openBus(int fd);
+
+// stop an async writer, queued requests complete as cancelled
+void PCA9685_closeBus(PCA9685_bus* bus);
+
+// queue a request from any thread, everything queued while a transaction
+// is in flight goes out in the next one, LED register writes to the same
+// device merged
+int PCA9685_submit(PCA9685_bus* bus, PCA9685_req* req);
+
+// queue n requests at once, they share a transaction
+int PCA9685_submitReqs(PCA9685_bus* bus, unsigned int n, PCA9685_req** reqs);
+
+// cancel a request that has not been sent yet
+int PCA9685_cancel(PCA9685_req* req);
+
+// eventfd that is readable while completed requests wait to be reaped
+int PCA9685_getBusFd(PCA9685_bus* bus);
+
+// take up to max completed requests without done(), never blocks
+int PCA9685_reap(PCA9685_bus* bus, unsigned int max, PCA9685_req** reqs);
+
+// turn off every device the bus has written ahead of anything queued, and
+// cancel requests until PCA9685_resume(), async-signal-safe
+void PCA9685_blackout(PCA9685_bus* bus);
+
+// let requests through again after PCA9685_blackout(), async-signal-safe
+void PCA9685_resume(PCA9685_bus* bus);
+
+// a device that stops answering is quarantined and probed every probeMs,
+// doubling up to maxProbeMs, once it answers it is re-initialized with
+// freq, unless 0, and its LED registers restored in one transaction
+void PCA9685_setBusRecovery(PCA9685_bus* bus, unsigned int freq,
+                            unsigned int probeMs, unsigned int maxProbeMs);
+
+// fade every device written to safe, a packed frame or NULL for all off,
+// over fadeMs once nothing was submitted for timeoutMs, then sleep them if
+// asked, 0 stops watching, a watched submit costs one timestamp store
+int PCA9685_setBusWatchdog(PCA9685_bus* bus, unsigned int timeoutMs,
+                           unsigned int fadeMs, unsigned char* safe, bool sleep);
+
+// copy the counters of an async writer
+void PCA9685_getBusStats(PCA9685_bus* bus, PCA9685_busStats* stats);
+
+// wire time and most frames per second of a bus from the messages the
+// async writer sends, zero when plan->rate fits
+int PCA9685_planBus(PCA9685_plan* plan);
+
+// bus clock of an async writer, it adds up the wire time of what it
+// sends and warns when the bus fills, 0 stops
+void PCA9685_setBusClock(PCA9685_bus* bus, unsigned long hz);
+
+// copy the counters of up to max devices written, returns how many
+unsigned int PCA9685_getBusDevs(PCA9685_bus* bus, unsigned int max, PCA9685_busDev* devs);
+
+// time every Nth request each thread submits through the stages of the
+// writer, 0 stops tracing
+void PCA9685_setBusTrace(PCA9685_bus* bus, unsigned int every);
+
+// copy the stage histograms of an async writer
+void PCA9685_getBusTrace(PCA9685_bus* bus, PCA9685_busTrace* trace);
+
+// print stage histograms, one line per stage
+void PCA9685_dumpBusTrace(FILE* out, const PCA9685_busTrace* trace);
+
+// serve Prometheus text metrics on a Unix socket from a thread of its own,
+// NULL path for none
+PCA9685_metrics* PCA9685_openMetrics(const char* path);
+
+// stop serving, before the buses added are closed
+void PCA9685_closeMetrics(PCA9685_metrics* metrics);
+
+// add the counters, devices and stage histograms of a bus, labelled name
+int PCA9685_addMetricsBus(PCA9685_metrics* metrics, PCA9685_bus* bus, const char* name);
+
+// add a counter of the application's, read() is called at every scrape
+int PCA9685_addMetricsCounter(PCA9685_metrics* metrics, const char* name, const char* help,
+                              unsigned long long (*read)(void* user), void* user);
+
+// write every metric in the Prometheus text format
+void PCA9685_writeMetrics(PCA9685_metrics* metrics, FILE* out);
+
+
 
+// configure a device after a reset, turn off PWM's, and set the freq
+int _PCA9685_configPWM(int fd, unsigned char addr, unsigned int freq);
 
 // set the PWM frequency
 int _PCA9685_setPWMFreq(int fd, unsigned char addr, unsigned int freq);
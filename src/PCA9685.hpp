@@ -0,0 +1,413 @@
+// header-only C++20 wrapper for libPCA9685
+// every call inlines to the C function it wraps, frames are packed in
+// place and written with PCA9685_setPWMFrame() in one I2C_RDWR ioctl
+// Bus wraps the async writer, co_await bus.commit(addr, frame) hands the
+// frame to the bus worker and resumes once it has been written
+
+#ifndef _PCA9685_HPP
+#define _PCA9685_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <unistd.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include <PCA9685.h>
+
+namespace PCA9685 {
+
+// number of channels
+inline constexpr unsigned int chans = _PCA9685_CHANS;
+
+// register addresses of a channel, checked at compile time where the
+// channel is a constant
+consteval unsigned char onReg(unsigned int chan) {
+  if (chan >= chans) throw "channel out of range";
+  return _PCA9685_BASEPWMREG + chan * 4;
+}
+consteval unsigned char offReg(unsigned int chan) {
+  return onReg(chan) + 2;
+}
+
+// position of a channel's ON_L byte in a packed frame
+constexpr unsigned int frameIndex(unsigned int chan) {
+  return 1 + chan * 4;
+}
+
+
+// packed register frame, frame[0] is the start register and each channel
+// follows as ON_L, ON_H, OFF_L, OFF_H
+class Frame {
+ public:
+  // OFF values for every channel, ON values stay zero
+  void set(std::span<const uint16_t, _PCA9685_CHANS> off) {
+    for (unsigned int chan = 0; chan < chans; chan++) pack(frameIndex(chan) + 2, off[chan]);
+  }
+
+  // OFF values of off.size() channels from first
+  void set(std::span<const uint16_t> off, unsigned int first) {
+    for (unsigned int i = 0; i < off.size() && first + i < chans; i++) {
+      pack(frameIndex(first + i) + 2, off[i]);
+    } // for i
+  }
+
+  // ON and OFF of one channel, the channel is checked at compile time
+  template <unsigned int Chan>
+  void set(uint16_t on, uint16_t off) {
+    static_assert(Chan < chans, "channel out of range");
+    buf[frameIndex(Chan) + 0] = on & 0xFF;
+    buf[frameIndex(Chan) + 1] = on >> 8;
+    buf[frameIndex(Chan) + 2] = off & 0xFF;
+    buf[frameIndex(Chan) + 3] = off >> 8;
+  }
+
+  uint16_t off(unsigned int chan) const {
+    return buf[frameIndex(chan) + 2] | buf[frameIndex(chan) + 3] << 8;
+  }
+
+  unsigned char *data() { return buf; }
+
+ private:
+  // an OFF value above the range saturates, bit 4 of OFF_H would turn
+  // the channel full off
+  void pack(unsigned int i, uint16_t off) {
+    off = std::min<uint16_t>(off, _PCA9685_MAXVAL);
+    if constexpr (std::endian::native == std::endian::little) {
+      // OFF_L, OFF_H is the value as stored, one 16-bit store
+      std::memcpy(buf + i, &off, sizeof(off));
+    } else {
+      buf[i] = off & 0xFF;
+      buf[i + 1] = off >> 8;
+    } // if little
+  }
+
+  alignas(64) unsigned char buf[_PCA9685_FRAMELEN] = {};
+};
+
+
+// awaitable write of one frame through a Bus, co_await yields the result
+// of the request, 0, -1, _PCA9685_ECANCELED or _PCA9685_ETIMEDOUT
+// the coroutine resumes on the bus worker thread, the frame must stay
+// untouched until then
+class Commit {
+ public:
+  Commit(PCA9685_bus *bus, unsigned char addr, Frame &frame,
+         std::chrono::nanoseconds timeout, std::stop_token stop,
+         std::chrono::steady_clock::time_point source = {})
+      : bus(bus), timeout(timeout), stop(std::move(stop)) {
+    frame.data()[0] = _PCA9685_BASEPWMREG;
+    // steady_clock is CLOCK_MONOTONIC
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(source.time_since_epoch()).count();
+    req.source.tv_sec = ns / 1000000000;
+    req.source.tv_nsec = ns % 1000000000;
+    req.addr = addr;
+    req.buf = frame.data();
+    req.len = _PCA9685_FRAMELEN;
+    req.done = done;
+    req.user = this;
+  }
+
+  // the request points back here, so the awaitable stays where it is
+  Commit(const Commit &) = delete;
+  Commit &operator=(const Commit &) = delete;
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    if (timeout.count() > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &req.deadline);
+      auto ns = req.deadline.tv_nsec + timeout.count();
+      req.deadline.tv_sec += ns / 1000000000;
+      req.deadline.tv_nsec = ns % 1000000000;
+    } // if timeout
+    // a stop requested already cancels the request here, it still goes
+    // through the worker and completes as cancelled
+    if (stop.stop_possible()) cancel.emplace(stop, Cancel{ &req });
+    req.result = -1;
+    // nothing here may be touched once it is submitted, the worker may
+    // already have resumed the coroutine
+    return PCA9685_submit(bus, &req) == 0;
+  }
+
+  int await_resume() {
+    cancel.reset();
+    return req.result;
+  }
+
+ private:
+  struct Cancel {
+    PCA9685_req *req;
+    void operator()() const noexcept { PCA9685_cancel(req); }
+  };
+
+  static void done(PCA9685_req *req) {
+    static_cast<Commit *>(req->user)->handle.resume();
+  }
+
+  PCA9685_bus *bus;
+  PCA9685_req req = {};
+  std::chrono::nanoseconds timeout;
+  std::stop_token stop;
+  std::optional<std::stop_callback<Cancel>> cancel;
+  std::coroutine_handle<> handle;
+};
+
+
+// async writer of one bus, one worker thread sends every request queued
+// while the previous transaction was in flight in the next one
+class Bus {
+ public:
+  explicit Bus(int fd) : bus(PCA9685_openBus(fd)) {
+    if (bus == nullptr) {
+      throw std::runtime_error("PCA9685_openBus() failed on fd " + std::to_string(fd));
+    } // if bus
+  }
+
+  Bus(const Bus &) = delete;
+  Bus &operator=(const Bus &) = delete;
+
+  Bus(Bus &&other) noexcept : bus(std::exchange(other.bus, nullptr)) {}
+
+  Bus &operator=(Bus &&other) noexcept {
+    if (this != &other) {
+      close();
+      bus = std::exchange(other.bus, nullptr);
+    } // if other
+    return *this;
+  }
+
+  // requests still queued complete as cancelled
+  ~Bus() { close(); }
+
+  // write a frame to addr, a timeout bounds the time spent queued and a
+  // stop request cancels it if it has not been sent yet, source is when
+  // the frame's data arrived, for the trace
+  [[nodiscard]] Commit commit(unsigned char addr, Frame &frame,
+                              std::chrono::nanoseconds timeout = {},
+                              std::stop_token stop = {},
+                              std::chrono::steady_clock::time_point source = {}) {
+    return Commit(bus, addr, frame, timeout, std::move(stop), source);
+  }
+
+  PCA9685_busStats stats() const {
+    PCA9685_busStats stats;
+    PCA9685_getBusStats(bus, &stats);
+    return stats;
+  }
+
+  // time every Nth commit of a thread through the writer, 0 stops
+  void trace(unsigned int every) { PCA9685_setBusTrace(bus, every); }
+
+  PCA9685_busTrace traceHists() const {
+    PCA9685_busTrace trace;
+    PCA9685_getBusTrace(bus, &trace);
+    return trace;
+  }
+
+  PCA9685_bus *handle() const { return bus; }
+
+ private:
+  void close() {
+    if (bus) PCA9685_closeBus(bus);
+    bus = nullptr;
+  }
+
+  PCA9685_bus *bus;
+};
+
+
+// one PCA9685, owns the i2c-dev fd opened for it and closes it
+class Device {
+ public:
+  Device(unsigned char adpt, unsigned char addr, unsigned int freq)
+      : fd(PCA9685_openI2C(adpt, addr)), addr(addr) {
+    if (fd < 0) {
+      throw std::runtime_error("PCA9685_openI2C() failed on adapter " + std::to_string(adpt));
+    } // if fd
+    if (PCA9685_initPWM(fd, addr, freq) != 0) {
+      close();
+      throw std::runtime_error("PCA9685_initPWM() failed on address " + std::to_string(addr));
+    } // if init
+  }
+
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+
+  Device(Device &&other) noexcept
+      : fd(std::exchange(other.fd, -1)), addr(other.addr) {}
+
+  Device &operator=(Device &&other) noexcept {
+    if (this != &other) {
+      close();
+      fd = std::exchange(other.fd, -1);
+      addr = other.addr;
+    } // if other
+    return *this;
+  }
+
+  ~Device() { close(); }
+
+  // write a packed frame
+  [[nodiscard]] int set(Frame &frame) {
+    return PCA9685_setPWMFrame(fd, addr, frame.data());
+  }
+
+  // write the OFF values of every channel, packed on the stack
+  [[nodiscard]] int set(std::span<const uint16_t, _PCA9685_CHANS> off) {
+    Frame frame;
+    frame.set(off);
+    return set(frame);
+  }
+
+  // write one channel in one auto-increment message, the channel is
+  // checked at compile time
+  template <unsigned int Chan>
+  [[nodiscard]] int set(uint16_t on, uint16_t off) {
+    return write(onReg(Chan), on, off);
+  }
+
+  // write a packed frame through an async writer on this device's bus
+  [[nodiscard]] Commit commit(Bus &bus, Frame &frame,
+                              std::chrono::nanoseconds timeout = {},
+                              std::stop_token stop = {},
+                              std::chrono::steady_clock::time_point source = {}) {
+    return bus.commit(addr, frame, timeout, std::move(stop), source);
+  }
+
+  // write every channel with one ON and one OFF value, through ALL_LED
+  [[nodiscard]] int setAll(uint16_t on, uint16_t off) {
+    return write(_PCA9685_ALLLEDREG, on, off);
+  }
+
+  int handle() const { return fd; }
+  unsigned char address() const { return addr; }
+
+ private:
+  // ON_L, ON_H, OFF_L, OFF_H from reg in one transaction
+  int write(unsigned char reg, uint16_t on, uint16_t off) {
+    unsigned char buf[5] = { reg, (unsigned char) (on & 0xFF), (unsigned char) (on >> 8),
+                             (unsigned char) (off & 0xFF), (unsigned char) (off >> 8) };
+    return _PCA9685_writeI2CRaw(fd, addr, sizeof(buf), buf);
+  }
+
+  void close() {
+    // test mode hands out fd 0 without opening anything
+    if (fd >= 0 && !_PCA9685_TEST) ::close(fd);
+    fd = -1;
+  }
+
+  int fd;
+  unsigned char addr;
+};
+
+// devices at fixed addresses on one bus, known at compile time
+// frames are stored back to back and the i2c_msg array of the combined
+// transaction is built once, so a commit is just the pack and one ioctl
+// the msgs point into the chain's own frames, so it cannot be moved
+template <unsigned char... Addrs>
+class Chain {
+ public:
+  static constexpr unsigned int devices = sizeof...(Addrs);
+  static constexpr std::array<unsigned char, devices> addrs = { Addrs... };
+  static_assert(devices > 0, "a chain needs at least one device");
+  static_assert(devices <= _PCA9685_MAXMSGS, "too many devices for one transaction");
+  static_assert(((Addrs > _PCA9685_GENCALLADDR && Addrs < 0x80) && ...), "address out of range");
+  static_assert([] {
+    for (unsigned int i = 0; i < devices; i++)
+      for (unsigned int j = i + 1; j < devices; j++)
+        if (addrs[i] == addrs[j]) return false;
+    return true;
+  }(), "duplicate address");
+
+  // bytes on the bus per commit, without the address bytes
+  static constexpr unsigned int bytes = devices * _PCA9685_FRAMELEN;
+
+  // position of a device in the chain, Addr must be in the chain
+  template <unsigned char Addr>
+  static constexpr unsigned int index() {
+    constexpr unsigned int i = [] {
+      unsigned int i = 0;
+      while (i < devices && addrs[i] != Addr) i++;
+      return i;
+    }();
+    static_assert(i < devices, "address not in the chain");
+    return i;
+  }
+
+  Chain(unsigned char adpt, unsigned int freq) : fd(PCA9685_openI2C(adpt, addrs[0])) {
+    if (fd < 0) {
+      throw std::runtime_error("PCA9685_openI2C() failed on adapter " + std::to_string(adpt));
+    } // if fd
+    std::array<unsigned char, devices> init = addrs;
+    if (PCA9685_initPWMs(fd, devices, init.data(), freq) != 0) {
+      close();
+      throw std::runtime_error("PCA9685_initPWMs() failed on adapter " + std::to_string(adpt));
+    } // if init
+    for (unsigned int i = 0; i < devices; i++) {
+      frames[i].data()[0] = _PCA9685_BASEPWMREG;
+      msgs[i].addr = addrs[i];
+      msgs[i].flags = 0x00;
+      msgs[i].len = _PCA9685_FRAMELEN;
+      msgs[i].buf = frames[i].data();
+    } // for devices
+    data.msgs = msgs.data();
+    data.nmsgs = devices;
+  }
+
+  Chain(const Chain &) = delete;
+  Chain &operator=(const Chain &) = delete;
+
+  ~Chain() { close(); }
+
+  // frame of the device at Addr
+  template <unsigned char Addr>
+  Frame &frame() { return frames[index<Addr>()]; }
+
+  // frame of the i-th device
+  Frame &frame(unsigned int i) { return frames[i]; }
+
+  // pack the OFF values of every channel of every device, in chain order
+  void set(std::span<const uint16_t, devices * _PCA9685_CHANS> off) {
+    for (unsigned int i = 0; i < devices; i++) {
+      frames[i].set(std::span<const uint16_t, _PCA9685_CHANS>(off.data() + i * _PCA9685_CHANS, _PCA9685_CHANS));
+    } // for devices
+  }
+
+  // write every frame in one combined transaction
+  [[nodiscard]] int commit() {
+    return _PCA9685_ioctl(fd, I2C_RDWR, (char *) &data) < 0 ? -1 : 0;
+  }
+
+  int handle() const { return fd; }
+
+ private:
+  void close() {
+    // test mode hands out fd 0 without opening anything
+    if (fd >= 0 && !_PCA9685_TEST) ::close(fd);
+    fd = -1;
+  }
+
+  int fd;
+  std::array<Frame, devices> frames;
+  std::array<struct i2c_msg, devices> msgs;
+  struct i2c_rdwr_ioctl_data data;
+};
+
+
+} // namespace PCA9685
+
+#endif
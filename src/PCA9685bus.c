@@ -0,0 +1,1368 @@
+// sem_clockwait()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#include "PCA9685.h"
+
+// request states, the bus owns a request from QUEUED until it is handed
+// back as DONE, CANCELLED is cancelled before it was submitted, DROPPED
+// cancelled while queued
+#define _PCA9685_IDLE		0
+#define _PCA9685_QUEUED		1
+#define _PCA9685_CANCELLED	2
+#define _PCA9685_INFLIGHT	3
+#define _PCA9685_DONE		4
+#define _PCA9685_DROPPED	5
+
+// LED registers merged by the worker, LED0_ON_L - LED15_OFF_H, auto
+// increment runs through them without wrapping
+#define _PCA9685_LEDREGS	(_PCA9685_FRAMELEN - 1)
+
+// first and longest wait between probes of a quarantined device
+#define _PCA9685_PROBEMS	10
+#define _PCA9685_MAXPROBEMS	5000
+
+// watchdog fade steps, 50 a second
+#define _PCA9685_FADESTEPMS	20
+
+// clocks of a transaction's stop, and of a message's start and address
+// byte, every byte takes 9 with its ACK
+#define _PCA9685_STOPCLOCKS	1
+#define _PCA9685_MSGCLOCKS	10
+#define _PCA9685_BYTECLOCKS	9
+
+// message of the worker's own, not of a batch item
+#define _PCA9685_NOITEM		((unsigned int) -1)
+
+// what one item of a batch writes, either the LED registers of a device
+// merged from several requests or one request sent as it is
+typedef struct _PCA9685_item {
+  unsigned char addr;
+  PCA9685_req* raw;                         // NULL for merged registers
+  uint64_t dirty;                           // one bit per LED register
+  unsigned char regs[_PCA9685_LEDREGS];
+  int result;
+  unsigned long long startNs;               // its last transaction, when traced
+  unsigned long long writtenNs;
+} _PCA9685_item;
+
+// what the worker knows of one address
+typedef struct _PCA9685_dev {
+  uint64_t known;                           // LED registers held in regs
+  unsigned char regs[_PCA9685_LEDREGS];     // LED registers as last queued
+  bool quarantined;                         // not written until a probe answers
+  unsigned long long written;               // requests written, read by PCA9685_getBusDevs()
+  unsigned int probeMs;                     // wait before the next probe
+  unsigned long long probeAt;               // CLOCK_MONOTONIC ns of the next probe
+} _PCA9685_dev;
+
+// completed requests on their way to PCA9685_reap()
+typedef struct _PCA9685_reqList {
+  PCA9685_req* head;
+  PCA9685_req* tail;
+} _PCA9685_reqList;
+
+// async writer of one bus
+struct PCA9685_bus {
+  int fd;
+  pthread_t worker;
+  bool running;                 // cleared by PCA9685_closeBus()
+  unsigned int submitters;      // threads inside PCA9685_submitReqs()
+  PCA9685_req* queue;           // submitted requests, newest first, lock-free
+  sem_t ready;                  // posted when the queue was empty
+  pthread_mutex_t lock;         // guards the reaped list
+  int efd;                      // eventfd, readable while reqs wait to be reaped
+  PCA9685_req* doneHead;        // completed requests without done(), oldest first
+  PCA9685_req* doneTail;
+  PCA9685_busStats stats;       // written by the worker only
+  unsigned int traceEvery;      // sample every Nth request of a thread, 0 for none
+  PCA9685_busTrace trace;       // written by the worker only
+  unsigned long hz;             // bus clock for the wire time, 0 for none
+  unsigned long long windowNs;  // CLOCK_MONOTONIC start of the load window
+  unsigned long long windowWireNs; // wire time sent in the window
+  bool warned;                  // saturation reported
+  unsigned long long blackoutAt; // CLOCK_MONOTONIC ns of an unserved blackout
+  bool blackedOut;              // set until PCA9685_resume()
+  // recovery of quarantined devices, set before submitting
+  unsigned int freq;            // re-init freq, 0 to only restore the LED registers
+  unsigned int probeMs;
+  unsigned int maxProbeMs;
+  // watchdog, submitting a request is the fast path's only cost
+  unsigned long long lastSubmitNs; // CLOCK_MONOTONIC_COARSE, 0 while no watchdog
+  unsigned int watchdogMs;      // 0 for none
+  unsigned int fadeMs;          // the worker reads these under wdLock too
+  bool fadeSleep;               // sleep the devices once faded
+  unsigned char safe[_PCA9685_LEDREGS]; // look faded to
+  unsigned int fade;            // generation << 16 | step, set by the watchdog
+  pthread_t watchdog;
+  bool watchdogStarted;
+  pthread_mutex_t wdLock;       // guards the watchdog settings
+  pthread_cond_t wdCond;        // signalled when they change
+  // batch scratch, owned by the worker
+  unsigned int cap;
+  PCA9685_req** live;           // requests to send, oldest first
+  unsigned int* liveItem;       // item of each live request
+  _PCA9685_item* items;
+  int open[0x80];               // merged item of each address, -1 for none
+  struct i2c_msg msgs[_PCA9685_MAXMSGS];
+  unsigned int msgItem[_PCA9685_MAXMSGS];
+  unsigned char msgBuf[_PCA9685_MAXMSGS][_PCA9685_FRAMELEN];
+  bool dropped;                 // the last flush lost to a blackout
+  // devices written so far, turned off by a blackout, nSeen is published
+  // after the address so other threads may read the list
+  bool seen[0x80];
+  unsigned char seenAddrs[0x80];
+  unsigned int nSeen;
+  // shadow registers and quarantine, owned by the worker
+  _PCA9685_dev devs[0x80];
+  unsigned int nQuarantined;
+  // watchdog fade, owned by the worker
+  unsigned int fadeServed;
+  unsigned int fadeGen;         // generation of the fadeFrom snapshot
+  unsigned int fadeFirst;       // step before the first one served
+  unsigned char fadeFrom[0x80][_PCA9685_LEDREGS];
+  bool asleep;
+};
+
+static void* _PCA9685_busWorker(void* arg);
+static PCA9685_req* _PCA9685_take(PCA9685_bus* bus);
+static void _PCA9685_runBatch(PCA9685_bus* bus, PCA9685_req* batch, bool live);
+static int _PCA9685_grow(PCA9685_bus* bus, unsigned int reqs);
+static unsigned int _PCA9685_flush(PCA9685_bus* bus, unsigned int n);
+static void _PCA9685_serveBlackout(PCA9685_bus* bus);
+static void _PCA9685_shadow(PCA9685_bus* bus, _PCA9685_item* item);
+static void _PCA9685_quarantine(PCA9685_bus* bus, unsigned char addr);
+static unsigned long long _PCA9685_probe(PCA9685_bus* bus);
+static int _PCA9685_replay(PCA9685_bus* bus, unsigned char addr);
+static unsigned long long _PCA9685_nowNs(void);
+static void* _PCA9685_watchdog(void* arg);
+static void _PCA9685_serveFade(PCA9685_bus* bus);
+static void _PCA9685_setSleep(PCA9685_bus* bus, bool sleep);
+static unsigned int _PCA9685_duty(const unsigned char* regs);
+static void _PCA9685_traceReq(PCA9685_bus* bus, PCA9685_req* req,
+                              _PCA9685_item* item, unsigned long long takenNs);
+static void _PCA9685_record(PCA9685_busHist* hist, unsigned long long ns);
+static unsigned long long _PCA9685_tsNs(const struct timespec* ts);
+static void _PCA9685_copyHist(PCA9685_busHist* to, PCA9685_busHist* from);
+static void _PCA9685_load(PCA9685_bus* bus, unsigned int n, unsigned long long nowNs);
+
+// submits of this thread, for sampling the trace
+static __thread unsigned int _PCA9685_traceTick;
+static void _PCA9685_complete(PCA9685_bus* bus, PCA9685_req* req, int result,
+                              _PCA9685_reqList* reaped);
+static void _PCA9685_reapable(PCA9685_bus* bus, _PCA9685_reqList* reaped);
+
+
+/////////////////////////////////////////////////////////////////////
+// start an async writer on an open I2C bus
+PCA9685_bus* PCA9685_openBus(int fd) {
+  PCA9685_bus* bus = calloc(1, sizeof(PCA9685_bus));
+  if (bus == NULL) {
+    fprintf(stderr, "PCA9685_openBus(): calloc() failed\n");
+    return NULL;
+  } // if bus
+  bus->fd = fd;
+  bus->running = true;
+  bus->probeMs = _PCA9685_PROBEMS;
+  bus->maxProbeMs = _PCA9685_MAXPROBEMS;
+  memset(bus->open, -1, sizeof(bus->open));
+  bus->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (bus->efd < 0) {
+    perror("PCA9685_openBus(): eventfd() failed");
+    free(bus);
+    return NULL;
+  } // if efd
+  pthread_mutex_init(&bus->lock, NULL);
+  sem_init(&bus->ready, 0, 0);
+  pthread_mutex_init(&bus->wdLock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&bus->wdCond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  int ret = pthread_create(&bus->worker, NULL, _PCA9685_busWorker, bus);
+  if (ret != 0) {
+    fprintf(stderr, "PCA9685_openBus(): pthread_create() returned %d\n", ret);
+    close(bus->efd);
+    sem_destroy(&bus->ready);
+    pthread_mutex_destroy(&bus->lock);
+    pthread_mutex_destroy(&bus->wdLock);
+    pthread_cond_destroy(&bus->wdCond);
+    free(bus);
+    return NULL;
+  } // if ret
+
+  if (_PCA9685_DEBUG) {
+    printf("PCA9685_openBus(): async writer started on fd %d\n", fd);
+  } // if debug
+  return bus;
+} // PCA9685_openBus
+
+
+
+/////////////////////////////////////////////////////////////////////
+// stop an async writer, queued requests complete as cancelled
+void PCA9685_closeBus(PCA9685_bus* bus) {
+  // the watchdog goes first, it wakes the worker
+  pthread_mutex_lock(&bus->wdLock);
+  __atomic_store_n(&bus->running, false, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&bus->wdCond);
+  pthread_mutex_unlock(&bus->wdLock);
+  if (bus->watchdogStarted) pthread_join(bus->watchdog, NULL);
+  // a submit that saw the bus running finishes its push and sem_post()
+  // before the bus goes away
+  while (__atomic_load_n(&bus->submitters, __ATOMIC_SEQ_CST)) sched_yield();
+  sem_post(&bus->ready);
+  pthread_join(bus->worker, NULL);
+  // the worker may have stopped before such a push landed
+  PCA9685_req* batch = _PCA9685_take(bus);
+  if (batch) _PCA9685_runBatch(bus, batch, false);
+
+  if (_PCA9685_DEBUG) {
+    printf("PCA9685_closeBus(): async writer stopped on fd %d\n", bus->fd);
+  } // if debug
+  close(bus->efd);
+  sem_destroy(&bus->ready);
+  pthread_mutex_destroy(&bus->lock);
+  pthread_mutex_destroy(&bus->wdLock);
+  pthread_cond_destroy(&bus->wdCond);
+  free(bus->live);
+  free(bus->liveItem);
+  free(bus->items);
+  free(bus);
+} // PCA9685_closeBus
+
+
+
+/////////////////////////////////////////////////////////////////////
+// queue a request for the next transaction
+int PCA9685_submit(PCA9685_bus* bus, PCA9685_req* req) {
+  return PCA9685_submitReqs(bus, 1, &req);
+} // PCA9685_submit
+
+
+
+/////////////////////////////////////////////////////////////////////
+// queue several requests at once, they go out in the same transaction
+// unless it exceeds _PCA9685_MAXMSGS messages
+// any number of threads may submit, a submit is one compare-and-swap
+int PCA9685_submitReqs(PCA9685_bus* bus, unsigned int n, PCA9685_req** reqs) {
+  unsigned int i;
+  for (i=0; i<n; i++) {
+    if (reqs[i]->len < 1 || reqs[i]->buf == NULL || reqs[i]->addr >= 0x80) {
+      fprintf(stderr, "PCA9685_submitReqs(): bad request for addr %02x\n", reqs[i]->addr);
+      return -1;
+    } // if len
+  } // for reqs
+  if (n == 0) return 0;
+  unsigned int every = __atomic_load_n(&bus->traceEvery, __ATOMIC_RELAXED);
+  unsigned long long submitNs = 0;
+  for (i=0; i<n; i++) {
+    reqs[i]->submitNs = 0;
+    if (every && ++_PCA9685_traceTick >= every) {
+      _PCA9685_traceTick = 0;
+      if (submitNs == 0) submitNs = _PCA9685_nowNs();
+      reqs[i]->submitNs = submitNs;
+    } // if sampled
+  } // for reqs
+  if (__atomic_load_n(&bus->watchdogMs, __ATOMIC_RELAXED)) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    __atomic_store_n(&bus->lastSubmitNs, now.tv_sec * 1000000000ULL + now.tv_nsec,
+                     __ATOMIC_RELAXED);
+  } // if watchdog
+  // counted before running is checked, PCA9685_closeBus() waits for it
+  __atomic_add_fetch(&bus->submitters, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&bus->running, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&bus->submitters, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "PCA9685_submitReqs(): bus on fd %d is closed\n", bus->fd);
+    return -1;
+  } // if !running
+
+  // a request cancelled before it was submitted still completes through
+  // the worker, so it is always handed back exactly once, one the bus
+  // still owns is refused and the requests taken before it handed back
+  for (i=0; i<n; i++) {
+    int state = __atomic_load_n(&reqs[i]->state, __ATOMIC_ACQUIRE);
+    int queued = state == _PCA9685_CANCELLED ? _PCA9685_DROPPED : _PCA9685_QUEUED;
+    if ((state != _PCA9685_IDLE && state != _PCA9685_DONE && state != _PCA9685_CANCELLED) ||
+        !__atomic_compare_exchange_n(&reqs[i]->state, &state, queued, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      while (i--) {
+        // cancelled in between, it stays cancelled
+        state = _PCA9685_QUEUED;
+        if (!__atomic_compare_exchange_n(&reqs[i]->state, &state, _PCA9685_IDLE, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          __atomic_store_n(&reqs[i]->state, _PCA9685_CANCELLED, __ATOMIC_RELEASE);
+        } // if cancelled
+      } // while taken
+      __atomic_sub_fetch(&bus->submitters, 1, __ATOMIC_RELEASE);
+      fprintf(stderr, "PCA9685_submitReqs(): request for addr %02x is already submitted\n",
+              reqs[0]->addr);
+      return -1;
+    } // if owned
+  } // for reqs
+  // the queue is newest first, the worker reverses it
+  for (i=1; i<n; i++) reqs[i]->next = reqs[i-1];
+
+  // push the chain, the thread that finds the queue empty wakes the worker
+  PCA9685_req* head = __atomic_load_n(&bus->queue, __ATOMIC_RELAXED);
+  do {
+    reqs[0]->next = head;
+  } while (!__atomic_compare_exchange_n(&bus->queue, &head, reqs[n-1], true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (head == NULL) sem_post(&bus->ready);
+  __atomic_sub_fetch(&bus->submitters, 1, __ATOMIC_RELEASE);
+  return 0;
+} // PCA9685_submitReqs
+
+
+
+/////////////////////////////////////////////////////////////////////
+// cancel a request that has not been sent yet, it is still handed back
+// with _PCA9685_ECANCELED, returns -1 when it is too late
+int PCA9685_cancel(PCA9685_req* req) {
+  int state = _PCA9685_QUEUED;
+  if (__atomic_compare_exchange_n(&req->state, &state, _PCA9685_DROPPED, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return 0;
+  } // if queued
+  state = _PCA9685_IDLE;
+  if (__atomic_compare_exchange_n(&req->state, &state, _PCA9685_CANCELLED, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return 0;
+  } // if idle
+  return -1;
+} // PCA9685_cancel
+
+
+
+/////////////////////////////////////////////////////////////////////
+// eventfd that is readable while completed requests wait to be reaped
+int PCA9685_getBusFd(PCA9685_bus* bus) {
+  return bus->efd;
+} // PCA9685_getBusFd
+
+
+
+/////////////////////////////////////////////////////////////////////
+// take up to max completed requests without a done() callback, oldest
+// first, never blocks and returns the number taken
+int PCA9685_reap(PCA9685_bus* bus, unsigned int max, PCA9685_req** reqs) {
+  unsigned int n = 0;
+  pthread_mutex_lock(&bus->lock);
+  while (n < max && bus->doneHead) {
+    // owned by the bus until it is off the list
+    reqs[n] = bus->doneHead;
+    bus->doneHead = bus->doneHead->next;
+    __atomic_store_n(&reqs[n++]->state, _PCA9685_DONE, __ATOMIC_RELEASE);
+  } // while reqs
+  if (bus->doneHead == NULL) {
+    // the worker only writes the eventfd when the list was empty, so it
+    // is cleared here, under the same lock, once the list is empty again
+    bus->doneTail = NULL;
+    uint64_t count;
+    if (read(bus->efd, &count, sizeof(count)) < 0 && _PCA9685_DEBUG) {
+      printf("PCA9685_reap(): eventfd already clear on fd %d\n", bus->fd);
+    } // if read
+  } // if empty
+  pthread_mutex_unlock(&bus->lock);
+  return n;
+} // PCA9685_reap
+
+
+
+/////////////////////////////////////////////////////////////////////
+// turn off every device the bus has written, ahead of all queued
+// requests, and cancel requests until PCA9685_resume()
+// async-signal-safe, the worker does the write: it is woken if idle, or
+// checks before its next transaction, so the blackout waits for at most
+// the transaction in flight
+void PCA9685_blackout(PCA9685_bus* bus) {
+  unsigned long long at = _PCA9685_nowNs();
+  unsigned long long none = 0;
+  __atomic_store_n(&bus->blackedOut, true, __ATOMIC_RELEASE);
+  // latency is counted from the first of several unserved blackouts
+  __atomic_compare_exchange_n(&bus->blackoutAt, &none, at ? at : 1, false,
+                              __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+  sem_post(&bus->ready);
+} // PCA9685_blackout
+
+
+
+/////////////////////////////////////////////////////////////////////
+// let requests through again after PCA9685_blackout(), async-signal-safe
+void PCA9685_resume(PCA9685_bus* bus) {
+  __atomic_store_n(&bus->blackedOut, false, __ATOMIC_RELEASE);
+} // PCA9685_resume
+
+
+
+/////////////////////////////////////////////////////////////////////
+// how a device that stopped answering comes back, call before submitting
+void PCA9685_setBusRecovery(PCA9685_bus* bus, unsigned int freq,
+                            unsigned int probeMs, unsigned int maxProbeMs) {
+  bus->freq = freq;
+  bus->probeMs = probeMs ? probeMs : _PCA9685_PROBEMS;
+  bus->maxProbeMs = maxProbeMs ? maxProbeMs : _PCA9685_MAXPROBEMS;
+  if (bus->maxProbeMs < bus->probeMs) bus->maxProbeMs = bus->probeMs;
+} // PCA9685_setBusRecovery
+
+
+
+/////////////////////////////////////////////////////////////////////
+// fade every device the bus has written to safe, a packed frame or NULL
+// for all off, over fadeMs once nothing was submitted for timeoutMs, and
+// then sleep them if asked, the next request wakes them
+// a timeout of 0 stops watching
+int PCA9685_setBusWatchdog(PCA9685_bus* bus, unsigned int timeoutMs,
+                           unsigned int fadeMs, unsigned char* safe, bool sleep) {
+  pthread_mutex_lock(&bus->wdLock);
+  if (safe) memcpy(bus->safe, safe + 1, _PCA9685_LEDREGS);
+  else memset(bus->safe, 0, _PCA9685_LEDREGS);
+  bus->fadeMs = fadeMs;
+  bus->fadeSleep = sleep;
+  // the timeout runs from now, not from the last request
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  __atomic_store_n(&bus->lastSubmitNs, now.tv_sec * 1000000000ULL + now.tv_nsec,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&bus->watchdogMs, timeoutMs, __ATOMIC_RELAXED);
+  int ret = 0;
+  if (timeoutMs && !bus->watchdogStarted) {
+    ret = pthread_create(&bus->watchdog, NULL, _PCA9685_watchdog, bus);
+    if (ret != 0) {
+      fprintf(stderr, "PCA9685_setBusWatchdog(): pthread_create() returned %d\n", ret);
+      __atomic_store_n(&bus->watchdogMs, 0, __ATOMIC_RELAXED);
+    } // if ret
+    bus->watchdogStarted = ret == 0;
+  } // if start
+  pthread_cond_signal(&bus->wdCond);
+  pthread_mutex_unlock(&bus->wdLock);
+  return ret ? -1 : 0;
+} // PCA9685_setBusWatchdog
+
+
+
+/////////////////////////////////////////////////////////////////////
+// time every Nth request each thread submits, 0 stops tracing
+void PCA9685_setBusTrace(PCA9685_bus* bus, unsigned int every) {
+  __atomic_store_n(&bus->traceEvery, every, __ATOMIC_RELAXED);
+} // PCA9685_setBusTrace
+
+
+
+/////////////////////////////////////////////////////////////////////
+// copy the stage histograms of an async writer
+void PCA9685_getBusTrace(PCA9685_bus* bus, PCA9685_busTrace* trace) {
+  _PCA9685_copyHist(&trace->source, &bus->trace.source);
+  _PCA9685_copyHist(&trace->queue, &bus->trace.queue);
+  _PCA9685_copyHist(&trace->pack, &bus->trace.pack);
+  _PCA9685_copyHist(&trace->ioctl, &bus->trace.ioctl);
+  _PCA9685_copyHist(&trace->total, &bus->trace.total);
+} // PCA9685_getBusTrace
+
+
+
+/////////////////////////////////////////////////////////////////////
+// print stage histograms, count, mean, the bucket bounds of the median
+// and 99th percentile and max in us, then the non-empty buckets as
+// upper bound in ns:count
+void PCA9685_dumpBusTrace(FILE* out, const PCA9685_busTrace* trace) {
+  const char* names[5] = { "source", "queue", "pack", "ioctl", "total" };
+  const PCA9685_busHist* hists[5] = { &trace->source, &trace->queue, &trace->pack,
+                                      &trace->ioctl, &trace->total };
+  unsigned int s;
+  for (s=0; s<5; s++) {
+    const PCA9685_busHist* hist = hists[s];
+    double pcts[2] = { 0.0, 0.0 };
+    unsigned int p;
+    for (p=0; p<2; p++) {
+      unsigned long long rank = (hist->count * (p ? 99 : 50) + 99) / 100;
+      unsigned long long seen = 0;
+      unsigned int b;
+      for (b=0; b<_PCA9685_HISTBUCKETS && hist->count; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) break;
+      } // for buckets
+      unsigned long long bound = b < _PCA9685_HISTBUCKETS - 1 ? 1ULL << b : hist->maxNs;
+      pcts[p] = hist->count ? (bound < hist->maxNs ? bound : hist->maxNs) / 1e3 : 0.0;
+    } // for pcts
+    fprintf(out, "%-6s count %llu mean %.1f p50 %.1f p99 %.1f max %.1f us |", names[s],
+            hist->count, hist->count ? hist->sumNs / 1e3 / hist->count : 0.0,
+            pcts[0], pcts[1], hist->maxNs / 1e3);
+    unsigned int b;
+    for (b=0; b<_PCA9685_HISTBUCKETS; b++) {
+      if (hist->buckets[b] == 0) continue;
+      if (b < _PCA9685_HISTBUCKETS - 1) fprintf(out, " %llu:%llu", 1ULL << b, hist->buckets[b]);
+      else fprintf(out, " inf:%llu", hist->buckets[b]);
+    } // for buckets
+    fprintf(out, "\n");
+  } // for stages
+} // PCA9685_dumpBusTrace
+
+
+
+/////////////////////////////////////////////////////////////////////
+// copy the counters of an async writer
+void PCA9685_getBusStats(PCA9685_bus* bus, PCA9685_busStats* stats) {
+  stats->reqs = __atomic_load_n(&bus->stats.reqs, __ATOMIC_RELAXED);
+  stats->sent = __atomic_load_n(&bus->stats.sent, __ATOMIC_RELAXED);
+  stats->failed = __atomic_load_n(&bus->stats.failed, __ATOMIC_RELAXED);
+  stats->cancelled = __atomic_load_n(&bus->stats.cancelled, __ATOMIC_RELAXED);
+  stats->timedout = __atomic_load_n(&bus->stats.timedout, __ATOMIC_RELAXED);
+  stats->merged = __atomic_load_n(&bus->stats.merged, __ATOMIC_RELAXED);
+  stats->msgs = __atomic_load_n(&bus->stats.msgs, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n(&bus->stats.bytes, __ATOMIC_RELAXED);
+  stats->ioctls = __atomic_load_n(&bus->stats.ioctls, __ATOMIC_RELAXED);
+  stats->maxBatch = __atomic_load_n(&bus->stats.maxBatch, __ATOMIC_RELAXED);
+  stats->blackouts = __atomic_load_n(&bus->stats.blackouts, __ATOMIC_RELAXED);
+  stats->blackoutNs = __atomic_load_n(&bus->stats.blackoutNs, __ATOMIC_RELAXED);
+  stats->maxBlackoutNs = __atomic_load_n(&bus->stats.maxBlackoutNs, __ATOMIC_RELAXED);
+  stats->quarantined = __atomic_load_n(&bus->stats.quarantined, __ATOMIC_RELAXED);
+  stats->probes = __atomic_load_n(&bus->stats.probes, __ATOMIC_RELAXED);
+  stats->recovered = __atomic_load_n(&bus->stats.recovered, __ATOMIC_RELAXED);
+  stats->fades = __atomic_load_n(&bus->stats.fades, __ATOMIC_RELAXED);
+  stats->retries = __atomic_load_n(&bus->stats.retries, __ATOMIC_RELAXED);
+  stats->busyNs = __atomic_load_n(&bus->stats.busyNs, __ATOMIC_RELAXED);
+  stats->wireNs = __atomic_load_n(&bus->stats.wireNs, __ATOMIC_RELAXED);
+  stats->saturated = __atomic_load_n(&bus->stats.saturated, __ATOMIC_RELAXED);
+} // PCA9685_getBusStats
+
+
+
+/////////////////////////////////////////////////////////////////////
+// bus time of a frame of every device and the most frames per second,
+// from the messages the async writer sends: one auto-increment message
+// per run of channels written, or per ALL_LED write, at most
+// _PCA9685_MAXMSGS to a transaction, PCA9685_setPWMFrames() always
+// writes whole frames, chans 0xFFFF
+// returns 0 when plan->rate fits, 1 when it does not, -1 on bad input
+int PCA9685_planBus(PCA9685_plan* plan) {
+  plan->msgs = plan->bytes = plan->ioctls = 0;
+  plan->frameUs = plan->maxRate = plan->utilisation = 0.0;
+  if (plan->devices == 0 || plan->devices > 0x80 || plan->hz == 0 ||
+      (!plan->allLed && (plan->chans & 0xFFFF) == 0)) {
+    fprintf(stderr, "PCA9685_planBus(): bad plan of %u devices at %lu Hz\n",
+            plan->devices, plan->hz);
+    return -1;
+  } // if bad
+
+  // the messages of one device, every device the same
+  unsigned int msgs = 0;
+  unsigned int bytes = 0;
+  if (plan->allLed) {
+    msgs = 1;
+    bytes = 5;
+  } else {
+    unsigned int chans = plan->chans & 0xFFFF;
+    while (chans) {
+      unsigned int chan = __builtin_ctz(chans);
+      unsigned int run = __builtin_ctz(~(chans >> chan));
+      msgs++;
+      bytes += 1 + run * 4;
+      chans &= ~(((1U << run) - 1) << chan);
+    } // while chans
+  } // if allLed
+  plan->msgs = msgs * plan->devices;
+  plan->bytes = bytes * plan->devices;
+  plan->ioctls = (plan->msgs + _PCA9685_MAXMSGS - 1) / _PCA9685_MAXMSGS;
+
+  unsigned long long clocks = (unsigned long long) plan->ioctls * _PCA9685_STOPCLOCKS +
+                              (unsigned long long) plan->msgs * _PCA9685_MSGCLOCKS +
+                              (unsigned long long) plan->bytes * _PCA9685_BYTECLOCKS;
+  plan->frameUs = clocks * 1e6 / plan->hz +
+                  (double) plan->msgs * plan->msgUs + (double) plan->ioctls * plan->xferUs;
+  plan->maxRate = 1e6 / plan->frameUs;
+  plan->utilisation = plan->rate / plan->maxRate;
+  return plan->utilisation > 1.0 ? 1 : 0;
+} // PCA9685_planBus
+
+
+
+/////////////////////////////////////////////////////////////////////
+// bus clock of an async writer, for the wire time in its stats and the
+// warning when it fills the bus, 0 stops
+void PCA9685_setBusClock(PCA9685_bus* bus, unsigned long hz) {
+  __atomic_store_n(&bus->hz, hz, __ATOMIC_RELAXED);
+} // PCA9685_setBusClock
+
+
+
+/////////////////////////////////////////////////////////////////////
+// add the wire time of the n messages just sent to the second it ends
+// in, seconds run back to back from the first transaction, the first
+// transaction after a second checks how full the bus was and warns the
+// first time it was nearly full, requests then queue up and merge
+static void _PCA9685_load(PCA9685_bus* bus, unsigned int n, unsigned long long nowNs) {
+  unsigned long hz = __atomic_load_n(&bus->hz, __ATOMIC_RELAXED);
+  if (hz == 0) return;
+  unsigned long long clocks = _PCA9685_STOPCLOCKS;
+  unsigned int i;
+  for (i=0; i<n; i++) clocks += _PCA9685_MSGCLOCKS + bus->msgs[i].len * _PCA9685_BYTECLOCKS;
+  unsigned long long wireNs = clocks * 1000000000ULL / hz;
+  __atomic_add_fetch(&bus->stats.wireNs, wireNs, __ATOMIC_RELAXED);
+
+  if (bus->windowNs == 0) bus->windowNs = nowNs;
+  if (nowNs - bus->windowNs >= 1000000000ULL) {
+    double load = bus->windowWireNs / 1e9;
+    if (load > _PCA9685_SATURATED) {
+      __atomic_add_fetch(&bus->stats.saturated, 1, __ATOMIC_RELAXED);
+      if (!bus->warned) {
+        fprintf(stderr, "_PCA9685_load(): bus on fd %d is %.0f%% full at %lu Hz, ", bus->fd,
+                load * 100, hz);
+        fprintf(stderr, "frames are merged\n");
+        bus->warned = true;
+      } // if !warned
+    } // if saturated
+    // the seconds the bus sat idle since carried nothing
+    bus->windowNs += (nowNs - bus->windowNs) / 1000000000ULL * 1000000000ULL;
+    bus->windowWireNs = 0;
+  } // if second over
+  bus->windowWireNs += wireNs;
+} // _PCA9685_load
+
+
+
+/////////////////////////////////////////////////////////////////////
+// copy the counters of up to max devices the bus has written, in the
+// order they were first written, returns the number copied
+unsigned int PCA9685_getBusDevs(PCA9685_bus* bus, unsigned int max, PCA9685_busDev* devs) {
+  unsigned int n = __atomic_load_n(&bus->nSeen, __ATOMIC_ACQUIRE);
+  if (n > max) n = max;
+  unsigned int i;
+  for (i=0; i<n; i++) {
+    _PCA9685_dev* dev = &bus->devs[bus->seenAddrs[i]];
+    devs[i].addr = bus->seenAddrs[i];
+    devs[i].quarantined = __atomic_load_n(&dev->quarantined, __ATOMIC_RELAXED);
+    devs[i].written = __atomic_load_n(&dev->written, __ATOMIC_RELAXED);
+  } // for devs
+  return n;
+} // PCA9685_getBusDevs
+
+
+
+/////////////////////////////////////////////////////////////////////
+// worker thread, takes everything queued and sends it, so requests
+// queued while a transaction is in flight share the next one, and
+// probes quarantined devices when they are due
+static void* _PCA9685_busWorker(void* arg) {
+  PCA9685_bus* bus = arg;
+  while (1) {
+    _PCA9685_serveBlackout(bus);
+    _PCA9685_serveFade(bus);
+    unsigned long long probeNs = _PCA9685_probe(bus);
+    PCA9685_req* batch = _PCA9685_take(bus);
+    bool live = __atomic_load_n(&bus->running, __ATOMIC_ACQUIRE);
+    if (batch == NULL) {
+      if (!live) break;
+      if (probeNs == 0) {
+        sem_wait(&bus->ready);
+        continue;
+      } // if no probe
+      // on the monotonic clock, so a wall clock step leaves the backoff
+      struct timespec until;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      probeNs += until.tv_nsec;
+      until.tv_sec += probeNs / 1000000000ULL;
+      until.tv_nsec = probeNs % 1000000000ULL;
+      sem_clockwait(&bus->ready, CLOCK_MONOTONIC, &until);
+      continue;
+    } // if empty
+    _PCA9685_runBatch(bus, batch, live);
+  } // while 1
+  return NULL;
+} // _PCA9685_busWorker
+
+
+
+/////////////////////////////////////////////////////////////////////
+// take the submitted requests, oldest first
+static PCA9685_req* _PCA9685_take(PCA9685_bus* bus) {
+  PCA9685_req* queue = __atomic_exchange_n(&bus->queue, NULL, __ATOMIC_ACQUIRE);
+  PCA9685_req* batch = NULL;
+  while (queue) {
+    PCA9685_req* next = queue->next;
+    queue->next = batch;
+    batch = queue;
+    queue = next;
+  } // while queue
+  return batch;
+} // _PCA9685_take
+
+
+
+/////////////////////////////////////////////////////////////////////
+// send a batch of requests, writes to the LED registers of a device are
+// merged in order and go out as one auto-increment message per run of
+// registers, other writes go out as they are, in order per device
+static void _PCA9685_runBatch(PCA9685_bus* bus, PCA9685_req* batch, bool live) {
+  _PCA9685_reqList reaped = { NULL, NULL };
+  unsigned int taken = 0;
+  unsigned int nLive = 0;
+  unsigned int nItems = 0;
+  unsigned int merged = 0;
+  unsigned int sent = 0;
+  bool blackedOut = __atomic_load_n(&bus->blackedOut, __ATOMIC_ACQUIRE);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  // the watchdog put the devices to sleep, requests wake them
+  if (bus->asleep && !blackedOut && live) _PCA9685_setSleep(bus, false);
+
+  PCA9685_req* req = batch;
+  while (req) {
+    // done() may resubmit the request, so step past it first
+    PCA9685_req* next = req->next;
+    taken++;
+
+    int state = _PCA9685_QUEUED;
+    if (!__atomic_compare_exchange_n(&req->state, &state, _PCA9685_INFLIGHT, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || !live || blackedOut) {
+      _PCA9685_complete(bus, req, _PCA9685_ECANCELED, &reaped);
+    } else if ((req->deadline.tv_sec || req->deadline.tv_nsec) &&
+               (now.tv_sec > req->deadline.tv_sec ||
+                (now.tv_sec == req->deadline.tv_sec && now.tv_nsec > req->deadline.tv_nsec))) {
+      _PCA9685_complete(bus, req, _PCA9685_ETIMEDOUT, &reaped);
+    } else if (_PCA9685_grow(bus, nLive + 1) != 0) {
+      _PCA9685_complete(bus, req, -1, &reaped);
+    } else {
+      unsigned int first = req->buf[0];
+      unsigned int regs = req->len - 1;
+      bool led = regs > 0 && first >= _PCA9685_BASEPWMREG &&
+                 first + regs <= _PCA9685_BASEPWMREG + _PCA9685_LEDREGS;
+      int i = led ? bus->open[req->addr] : -1;
+      if (i < 0) {
+        i = nItems++;
+        bus->items[i].addr = req->addr;
+        bus->items[i].raw = led ? NULL : req;
+        bus->items[i].dirty = 0;
+        bus->items[i].result = 0;
+        bus->items[i].startNs = 0;
+        bus->items[i].writtenNs = 0;
+      } else {
+        merged++;
+      } // if new item
+      if (led) {
+        // later requests overwrite earlier ones register by register
+        _PCA9685_item* item = &bus->items[i];
+        unsigned int reg = first - _PCA9685_BASEPWMREG;
+        memcpy(item->regs + reg, req->buf + 1, regs);
+        item->dirty |= (regs == 64 ? ~0ULL : (1ULL << regs) - 1) << reg;
+        bus->open[req->addr] = i;
+      } else {
+        // later LED writes to the device may not overtake this one
+        bus->open[req->addr] = -1;
+      } // if led
+      bus->live[nLive] = req;
+      bus->liveItem[nLive] = i;
+      nLive++;
+    } // if state
+    req = next;
+  } // while req
+
+  // one message per raw request and per run of dirty registers
+  unsigned int n = 0;
+  unsigned int i;
+  for (i=0; i<nItems; i++) {
+    _PCA9685_item* item = &bus->items[i];
+    bus->open[item->addr] = -1;
+    // a quarantined device gets what it missed once it answers again
+    _PCA9685_shadow(bus, item);
+    if (bus->devs[item->addr].quarantined) {
+      item->result = _PCA9685_EQUARANTINED;
+      continue;
+    } // if quarantined
+    if (item->raw) {
+      bus->msgs[n].addr = item->addr;
+      bus->msgs[n].flags = 0x00;
+      bus->msgs[n].len = item->raw->len;
+      bus->msgs[n].buf = item->raw->buf;
+      bus->msgItem[n] = i;
+      if (++n == _PCA9685_MAXMSGS) n = _PCA9685_flush(bus, n);
+      continue;
+    } // if raw
+    uint64_t dirty = item->dirty;
+    while (dirty) {
+      unsigned int reg = __builtin_ctzll(dirty);
+      uint64_t rest = ~(dirty >> reg);
+      unsigned int len = rest ? (unsigned int) __builtin_ctzll(rest) : 64 - reg;
+      bus->msgBuf[n][0] = _PCA9685_BASEPWMREG + reg;
+      memcpy(bus->msgBuf[n] + 1, item->regs + reg, len);
+      bus->msgs[n].addr = item->addr;
+      bus->msgs[n].flags = 0x00;
+      bus->msgs[n].len = len + 1;
+      bus->msgs[n].buf = bus->msgBuf[n];
+      bus->msgItem[n] = i;
+      if (++n == _PCA9685_MAXMSGS) n = _PCA9685_flush(bus, n);
+      dirty &= len == 64 ? 0 : ~(((1ULL << len) - 1) << reg);
+    } // while dirty
+  } // for items
+  if (n) _PCA9685_flush(bus, n);
+
+  // counters first, so they cover a request once it is handed back
+  unsigned long long takenNs = _PCA9685_tsNs(&now);
+  for (i=0; i<nLive; i++) {
+    _PCA9685_item* item = &bus->items[bus->liveItem[i]];
+    if (item->result != 0) continue;
+    sent++;
+    __atomic_add_fetch(&bus->devs[item->addr].written, 1, __ATOMIC_RELAXED);
+    if (bus->live[i]->submitNs) _PCA9685_traceReq(bus, bus->live[i], item, takenNs);
+  } // for live
+  __atomic_add_fetch(&bus->stats.sent, sent, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.merged, merged, __ATOMIC_RELAXED);
+  if (taken > bus->stats.maxBatch) {
+    __atomic_store_n(&bus->stats.maxBatch, taken, __ATOMIC_RELAXED);
+  } // if taken
+
+  // a request merged into a later one is written when that one is
+  for (i=0; i<nLive; i++) {
+    _PCA9685_complete(bus, bus->live[i], bus->items[bus->liveItem[i]].result, &reaped);
+  } // for live
+  _PCA9685_reapable(bus, &reaped);
+} // _PCA9685_runBatch
+
+
+
+/////////////////////////////////////////////////////////////////////
+// make room for reqs live requests and as many items
+static int _PCA9685_grow(PCA9685_bus* bus, unsigned int reqs) {
+  if (reqs <= bus->cap) return 0;
+  unsigned int cap = bus->cap ? bus->cap * 2 : 64;
+  PCA9685_req** live = realloc(bus->live, cap * sizeof(*live));
+  if (live) bus->live = live;
+  unsigned int* liveItem = realloc(bus->liveItem, cap * sizeof(*liveItem));
+  if (liveItem) bus->liveItem = liveItem;
+  _PCA9685_item* items = realloc(bus->items, cap * sizeof(*items));
+  if (items) bus->items = items;
+  if (live == NULL || liveItem == NULL || items == NULL) {
+    fprintf(stderr, "_PCA9685_grow(): realloc() failed for %u requests\n", cap);
+    return -1;
+  } // if realloc
+  bus->cap = cap;
+  return 0;
+} // _PCA9685_grow
+
+
+
+/////////////////////////////////////////////////////////////////////
+// send the n messages collected in one combined transaction, returns 0
+static unsigned int _PCA9685_flush(PCA9685_bus* bus, unsigned int n) {
+  struct i2c_rdwr_ioctl_data data;
+  data.msgs = bus->msgs;
+  data.nmsgs = n;
+  unsigned int i;
+
+  // a blackout overtakes the rest of the batch, which is dropped
+  _PCA9685_serveBlackout(bus);
+  bus->dropped = __atomic_load_n(&bus->blackedOut, __ATOMIC_ACQUIRE);
+  if (bus->dropped) {
+    for (i=0; i<n; i++) {
+      if (bus->msgItem[i] != _PCA9685_NOITEM) bus->items[bus->msgItem[i]].result = _PCA9685_ECANCELED;
+    } // for msgs
+    return 0;
+  } // if blackedOut
+
+  // two clock reads are nothing next to the transfer
+  bool traced = __atomic_load_n(&bus->traceEvery, __ATOMIC_RELAXED) != 0;
+  unsigned long long startNs = _PCA9685_nowNs();
+  int ret = _PCA9685_ioctl(bus->fd, I2C_RDWR, (char *) &data);
+  unsigned long long writtenNs = _PCA9685_nowNs();
+  unsigned long long ioctls = 1;
+  unsigned long long retries = 0;
+  unsigned long long failed = 0;
+  unsigned long long bytes = 0;
+  for (i=0; i<n; i++) {
+    unsigned char addr = bus->msgs[i].addr;
+    if (!bus->seen[addr]) {
+      bus->seen[addr] = true;
+      bus->seenAddrs[bus->nSeen] = addr;
+      __atomic_store_n(&bus->nSeen, bus->nSeen + 1, __ATOMIC_RELEASE);
+    } // if !seen
+    bytes += bus->msgs[i].len;
+    if (traced && bus->msgItem[i] != _PCA9685_NOITEM) {
+      bus->items[bus->msgItem[i]].startNs = startNs;
+      bus->items[bus->msgItem[i]].writtenNs = writtenNs;
+    } // if traced
+  } // for msgs
+
+  // the transaction stops at the first device that does not answer, so
+  // every message is retried alone to find the devices to quarantine
+  for (i=0; ret < 0 && i<n; i++) {
+    unsigned char addr = bus->msgs[i].addr;
+    if (n > 1 && !bus->devs[addr].quarantined) {
+      data.msgs = &bus->msgs[i];
+      data.nmsgs = 1;
+      ioctls++;
+      retries++;
+      if (_PCA9685_ioctl(bus->fd, I2C_RDWR, (char *) &data) >= 0) continue;
+    } // if retry
+    if (bus->msgItem[i] != _PCA9685_NOITEM) bus->items[bus->msgItem[i]].result = -1;
+    failed++;
+    if (!bus->devs[addr].quarantined) _PCA9685_quarantine(bus, addr);
+  } // for msgs
+  if (retries) writtenNs = _PCA9685_nowNs();
+  _PCA9685_load(bus, n, writtenNs);
+  __atomic_add_fetch(&bus->stats.busyNs, writtenNs - startNs, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.retries, retries, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.ioctls, ioctls, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.msgs, n, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.failed, failed, __ATOMIC_RELAXED);
+  return 0;
+} // _PCA9685_flush
+
+
+
+/////////////////////////////////////////////////////////////////////
+// write a blackout requested since the last check
+static void _PCA9685_serveBlackout(PCA9685_bus* bus) {
+  unsigned long long at = __atomic_exchange_n(&bus->blackoutAt, 0, __ATOMIC_ACQUIRE);
+  if (at == 0) return;
+
+  // a quarantined device does not answer and would only add retries
+  unsigned char addrs[0x80];
+  unsigned char* list = bus->seenAddrs;
+  unsigned int n = bus->nSeen;
+  if (bus->nQuarantined) {
+    unsigned int i;
+    list = addrs;
+    n = 0;
+    for (i=0; i<bus->nSeen; i++) {
+      if (!bus->devs[bus->seenAddrs[i]].quarantined) addrs[n++] = bus->seenAddrs[i];
+    } // for seen
+  } // if quarantined
+  int ret = PCA9685_blackoutPWMs(bus->fd, n, list);
+  unsigned long long ns = _PCA9685_nowNs() - at;
+  __atomic_add_fetch(&bus->stats.blackouts, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bus->stats.blackoutNs, ns, __ATOMIC_RELAXED);
+  if (ns > bus->stats.maxBlackoutNs) {
+    __atomic_store_n(&bus->stats.maxBlackoutNs, ns, __ATOMIC_RELAXED);
+  } // if ns
+  if (ret != 0) {
+    fprintf(stderr, "_PCA9685_serveBlackout(): PCA9685_blackoutPWMs() failed ");
+    fprintf(stderr, "for %u devices on fd %d\n", n, bus->fd);
+    __atomic_add_fetch(&bus->stats.failed, 1, __ATOMIC_RELAXED);
+  } // if ret
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_serveBlackout(): %u devices off on fd %d\n", n, bus->fd);
+  } // if debug
+} // _PCA9685_serveBlackout
+
+
+
+/////////////////////////////////////////////////////////////////////
+// keep what an item writes into the LED registers, to restore a device
+// that comes back from quarantine, ALL_LED sets every channel
+static void _PCA9685_shadow(PCA9685_bus* bus, _PCA9685_item* item) {
+  _PCA9685_dev* dev = &bus->devs[item->addr];
+  if (item->raw == NULL) {
+    uint64_t dirty = item->dirty;
+    while (dirty) {
+      unsigned int reg = __builtin_ctzll(dirty);
+      dev->regs[reg] = item->regs[reg];
+      dirty &= dirty - 1;
+    } // while dirty
+    dev->known |= item->dirty;
+  } else if (item->raw->buf[0] == _PCA9685_ALLLEDREG && item->raw->len == 5) {
+    unsigned int chan;
+    for (chan=0; chan<_PCA9685_CHANS; chan++) {
+      memcpy(dev->regs + chan * 4, item->raw->buf + 1, 4);
+    } // for chans
+    dev->known = ~0ULL;
+  } // if ALL_LED
+} // _PCA9685_shadow
+
+
+
+/////////////////////////////////////////////////////////////////////
+// stop writing a device that did not answer, until a probe finds it back
+static void _PCA9685_quarantine(PCA9685_bus* bus, unsigned char addr) {
+  _PCA9685_dev* dev = &bus->devs[addr];
+  __atomic_store_n(&dev->quarantined, true, __ATOMIC_RELAXED);
+  dev->probeMs = bus->probeMs;
+  dev->probeAt = _PCA9685_nowNs() + dev->probeMs * 1000000ULL;
+  bus->nQuarantined++;
+  __atomic_add_fetch(&bus->stats.quarantined, 1, __ATOMIC_RELAXED);
+  fprintf(stderr, "_PCA9685_quarantine(): addr %02x on fd %d did not answer, ", addr, bus->fd);
+  fprintf(stderr, "probing every %u - %u ms\n", bus->probeMs, bus->maxProbeMs);
+} // _PCA9685_quarantine
+
+
+
+/////////////////////////////////////////////////////////////////////
+// probe the quarantined devices that are due, a device that answers is
+// re-initialized and its LED registers restored, returns the ns until
+// the next probe, 0 for none
+static unsigned long long _PCA9685_probe(PCA9685_bus* bus) {
+  if (bus->nQuarantined == 0) return 0;
+  unsigned long long now = _PCA9685_nowNs();
+  unsigned long long next = 0;
+  unsigned int addr;
+  for (addr=0; addr<0x80; addr++) {
+    _PCA9685_dev* dev = &bus->devs[addr];
+    if (!dev->quarantined) continue;
+    if (dev->probeAt <= now) {
+      __atomic_add_fetch(&bus->stats.probes, 1, __ATOMIC_RELAXED);
+      // MODE1 is read back even on a device that has just powered up
+      unsigned char mode1val = 0x00;
+      if (_PCA9685_readI2CReg(bus->fd, addr, _PCA9685_MODE1REG, 1, &mode1val) == 0 &&
+          (bus->freq == 0 || _PCA9685_configPWM(bus->fd, addr, bus->freq) == 0) &&
+          _PCA9685_replay(bus, addr) == 0) {
+        __atomic_store_n(&dev->quarantined, false, __ATOMIC_RELAXED);
+        bus->nQuarantined--;
+        __atomic_add_fetch(&bus->stats.recovered, 1, __ATOMIC_RELAXED);
+        if (_PCA9685_DEBUG) {
+          printf("_PCA9685_probe(): addr %02x on fd %d recovered\n", addr, bus->fd);
+        } // if debug
+        continue;
+      } // if answered
+      dev->probeMs = dev->probeMs * 2 > bus->maxProbeMs ? bus->maxProbeMs : dev->probeMs * 2;
+      dev->probeAt = _PCA9685_nowNs() + dev->probeMs * 1000000ULL;
+    } // if due
+    unsigned long long ns = dev->probeAt > now ? dev->probeAt - now : 1;
+    if (next == 0 || ns < next) next = ns;
+  } // for addrs
+  return next;
+} // _PCA9685_probe
+
+
+
+/////////////////////////////////////////////////////////////////////
+// write the shadowed LED registers of a device back in one transaction,
+// one auto-increment message per run, nothing while blacked out
+static int _PCA9685_replay(PCA9685_bus* bus, unsigned char addr) {
+  _PCA9685_dev* dev = &bus->devs[addr];
+  if (__atomic_load_n(&bus->blackedOut, __ATOMIC_ACQUIRE)) return 0;
+  unsigned int n = 0;
+  uint64_t known = dev->known;
+  while (known) {
+    unsigned int reg = __builtin_ctzll(known);
+    uint64_t rest = ~(known >> reg);
+    unsigned int len = rest ? (unsigned int) __builtin_ctzll(rest) : 64 - reg;
+    bus->msgBuf[n][0] = _PCA9685_BASEPWMREG + reg;
+    memcpy(bus->msgBuf[n] + 1, dev->regs + reg, len);
+    bus->msgs[n].addr = addr;
+    bus->msgs[n].flags = 0x00;
+    bus->msgs[n].len = len + 1;
+    bus->msgs[n].buf = bus->msgBuf[n];
+    n++;
+    known &= len == 64 ? 0 : ~(((1ULL << len) - 1) << reg);
+  } // while known
+  if (n == 0) return 0;
+
+  struct i2c_rdwr_ioctl_data data;
+  data.msgs = bus->msgs;
+  data.nmsgs = n;
+  int ret = _PCA9685_ioctl(bus->fd, I2C_RDWR, (char *) &data);
+  __atomic_add_fetch(&bus->stats.ioctls, 1, __ATOMIC_RELAXED);
+  return ret < 0 ? -1 : 0;
+} // _PCA9685_replay
+
+
+
+/////////////////////////////////////////////////////////////////////
+// watchdog thread, sleeps until the timeout would expire and then steps
+// the worker through the fade, a request submitted meanwhile stops it
+static void* _PCA9685_watchdog(void* arg) {
+  PCA9685_bus* bus = arg;
+  unsigned int gen = 0;
+  unsigned long long firedAt = 0;       // lastSubmitNs of the last fade
+  pthread_mutex_lock(&bus->wdLock);
+  while (__atomic_load_n(&bus->running, __ATOMIC_ACQUIRE)) {
+    unsigned long long timeoutNs = bus->watchdogMs * 1000000ULL;
+    unsigned long long last = __atomic_load_n(&bus->lastSubmitNs, __ATOMIC_RELAXED);
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &until);
+    unsigned long long now = until.tv_sec * 1000000000ULL + until.tv_nsec;
+    if (timeoutNs == 0 || last == firedAt) {
+      // off, or faded already and nothing submitted since
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec += 1;
+      pthread_cond_timedwait(&bus->wdCond, &bus->wdLock, &until);
+      continue;
+    } // if idle
+    if (now < last + timeoutNs) {
+      // the coarse clock lags CLOCK_MONOTONIC by a tick at most
+      unsigned long long wake = last + timeoutNs;
+      until.tv_sec = wake / 1000000000ULL;
+      until.tv_nsec = wake % 1000000000ULL;
+      pthread_cond_timedwait(&bus->wdCond, &bus->wdLock, &until);
+      continue;
+    } // if not yet
+
+    // producers went quiet, fade step by step
+    firedAt = last;
+    gen = (gen + 1) & 0xFFFF;
+    __atomic_add_fetch(&bus->stats.fades, 1, __ATOMIC_RELAXED);
+    unsigned int steps = bus->fadeMs / _PCA9685_FADESTEPMS;
+    if (steps == 0) steps = 1;
+    if (steps > 0xFFFF) steps = 0xFFFF;
+    unsigned int step;
+    for (step = 1; step <= steps; step++) {
+      __atomic_store_n(&bus->fade, gen << 16 | step, __ATOMIC_RELEASE);
+      sem_post(&bus->ready);
+      if (step == steps) break;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_nsec += _PCA9685_FADESTEPMS * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      } // if carry
+      pthread_cond_timedwait(&bus->wdCond, &bus->wdLock, &until);
+      if (!__atomic_load_n(&bus->running, __ATOMIC_ACQUIRE) ||
+          __atomic_load_n(&bus->lastSubmitNs, __ATOMIC_RELAXED) != last) break;
+    } // for steps
+  } // while running
+  pthread_mutex_unlock(&bus->wdLock);
+  return NULL;
+} // _PCA9685_watchdog
+
+
+
+/////////////////////////////////////////////////////////////////////
+// write the fade step the watchdog asked for to every device written so
+// far, one combined transaction, the last step sleeps them if asked
+static void _PCA9685_serveFade(PCA9685_bus* bus) {
+  unsigned int fade = __atomic_load_n(&bus->fade, __ATOMIC_ACQUIRE);
+  if (fade == bus->fadeServed) return;
+  bus->fadeServed = fade;
+  // a request queued since then wins over the fade
+  if (__atomic_load_n(&bus->queue, __ATOMIC_ACQUIRE)) return;
+  pthread_mutex_lock(&bus->wdLock);
+  unsigned int steps = bus->fadeMs / _PCA9685_FADESTEPMS;
+  bool sleep = bus->fadeSleep;
+  unsigned char safe[_PCA9685_LEDREGS];
+  memcpy(safe, bus->safe, _PCA9685_LEDREGS);
+  pthread_mutex_unlock(&bus->wdLock);
+  if (steps == 0) steps = 1;
+  if (steps > 0xFFFF) steps = 0xFFFF;
+  unsigned int step = fade & 0xFFFF;
+  if (step > steps) step = steps;
+  // the first step served of a fade takes the snapshot, earlier steps may
+  // have lost to requests or been overtaken while the worker was busy
+  bool first = (fade >> 16) != bus->fadeGen;
+  bus->fadeGen = fade >> 16;
+  if (first) bus->fadeFirst = step - 1;
+  unsigned int left = steps - bus->fadeFirst;
+  unsigned int done = step - bus->fadeFirst;
+
+  // every channel goes from its duty cycle when the fade started to the
+  // safe one in equal steps, ON at 0
+  unsigned int i, n = 0;
+  for (i=0; i<bus->nSeen; i++) {
+    unsigned char addr = bus->seenAddrs[i];
+    _PCA9685_dev* dev = &bus->devs[addr];
+    if (first) memcpy(bus->fadeFrom[addr], dev->regs, _PCA9685_LEDREGS);
+    unsigned int chan;
+    for (chan=0; chan<_PCA9685_CHANS; chan++) {
+      unsigned char* regs = dev->regs + chan * 4;
+      unsigned int from = _PCA9685_duty(bus->fadeFrom[addr] + chan * 4);
+      unsigned int to = _PCA9685_duty(safe + chan * 4);
+      unsigned int duty = ((unsigned long long) from * (left - done) + (unsigned long long) to * done) / left;
+      regs[0] = 0x00;
+      regs[1] = duty >= 4096 ? _PCA9685_FULLBIT : 0x00;
+      regs[2] = duty < 4096 ? duty & 0xFF : 0x00;
+      regs[3] = duty == 0 ? _PCA9685_FULLBIT : (duty < 4096 ? duty >> 8 : 0x00);
+    } // for chans
+    dev->known = ~0ULL;
+    if (dev->quarantined) continue;
+    bus->msgBuf[n][0] = _PCA9685_BASEPWMREG;
+    memcpy(bus->msgBuf[n] + 1, dev->regs, _PCA9685_LEDREGS);
+    bus->msgs[n].addr = addr;
+    bus->msgs[n].flags = 0x00;
+    bus->msgs[n].len = _PCA9685_FRAMELEN;
+    bus->msgs[n].buf = bus->msgBuf[n];
+    bus->msgItem[n] = _PCA9685_NOITEM;
+    if (++n == _PCA9685_MAXMSGS) n = _PCA9685_flush(bus, n);
+  } // for seen
+  if (n) _PCA9685_flush(bus, n);
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_serveFade(): step %u of %u on fd %d\n", step, steps, bus->fd);
+  } // if debug
+  if (step == steps && sleep) _PCA9685_setSleep(bus, true);
+} // _PCA9685_serveFade
+
+
+
+/////////////////////////////////////////////////////////////////////
+// sleep or wake every device written so far, in one transaction
+static void _PCA9685_setSleep(PCA9685_bus* bus, bool sleep) {
+  // MODE1 as _PCA9685_configPWM() leaves it
+  unsigned char mode1val = _PCA9685_MODE1 | _PCA9685_AUTOINCBIT;
+  mode1val = mode1val & ~_PCA9685_SLEEPBIT & ~_PCA9685_EXTCLKBIT & ~_PCA9685_RESTARTBIT;
+  if (sleep) mode1val |= _PCA9685_SLEEPBIT;
+  if (_PCA9685_DEBUG) {
+    printf("_PCA9685_setSleep(): devices %s on fd %d\n", sleep ? "asleep" : "awake", bus->fd);
+  } // if debug
+  // a blackout may drop the MODE1 writes, the devices count as asleep
+  // once any of them was sent to sleep and as awake once all were woken
+  bool sent = false;
+  bool dropped = false;
+  unsigned int i, n = 0;
+  for (i=0; i<bus->nSeen; i++) {
+    unsigned char addr = bus->seenAddrs[i];
+    if (bus->devs[addr].quarantined) continue;
+    bus->msgBuf[n][0] = _PCA9685_MODE1REG;
+    bus->msgBuf[n][1] = mode1val;
+    bus->msgs[n].addr = addr;
+    bus->msgs[n].flags = 0x00;
+    bus->msgs[n].len = 2;
+    bus->msgs[n].buf = bus->msgBuf[n];
+    bus->msgItem[n] = _PCA9685_NOITEM;
+    if (++n == _PCA9685_MAXMSGS) {
+      n = _PCA9685_flush(bus, n);
+      if (bus->dropped) dropped = true;
+      else sent = true;
+    } // if full
+  } // for seen
+  if (n) {
+    _PCA9685_flush(bus, n);
+    if (bus->dropped) dropped = true;
+    else sent = true;
+  } // if n
+  if (sleep) {
+    if (sent) bus->asleep = true;
+  } else if (!dropped) {
+    // the oscillator needs 500us after waking
+    usleep(500);
+    bus->asleep = false;
+  } // if sleep
+} // _PCA9685_setSleep
+
+
+
+/////////////////////////////////////////////////////////////////////
+// duty cycle of one channel's ON and OFF registers, 0 - 4096
+static unsigned int _PCA9685_duty(const unsigned char* regs) {
+  if (regs[3] & _PCA9685_FULLBIT) return 0;
+  if (regs[1] & _PCA9685_FULLBIT) return 4096;
+  unsigned int on = (regs[1] & 0x0F) << 8 | regs[0];
+  unsigned int off = (regs[3] & 0x0F) << 8 | regs[2];
+  return (off - on) & 0xFFF;
+} // _PCA9685_duty
+
+
+
+/////////////////////////////////////////////////////////////////////
+// add a written request sampled at submit to the stage histograms
+static void _PCA9685_traceReq(PCA9685_bus* bus, PCA9685_req* req,
+                              _PCA9685_item* item, unsigned long long takenNs) {
+  // sampled while the trace was being turned on
+  if (item->writtenNs == 0) return;
+  unsigned long long sourceNs = _PCA9685_tsNs(&req->source);
+  if (sourceNs && sourceNs <= req->submitNs) {
+    _PCA9685_record(&bus->trace.source, req->submitNs - sourceNs);
+  } else {
+    sourceNs = req->submitNs;
+  } // if source
+  _PCA9685_record(&bus->trace.queue, takenNs - req->submitNs);
+  _PCA9685_record(&bus->trace.pack, item->startNs - takenNs);
+  _PCA9685_record(&bus->trace.ioctl, item->writtenNs - item->startNs);
+  _PCA9685_record(&bus->trace.total, item->writtenNs - sourceNs);
+} // _PCA9685_traceReq
+
+
+
+/////////////////////////////////////////////////////////////////////
+// add one time to a histogram, read concurrently by PCA9685_getBusTrace()
+static void _PCA9685_record(PCA9685_busHist* hist, unsigned long long ns) {
+  unsigned int b = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (b >= _PCA9685_HISTBUCKETS) b = _PCA9685_HISTBUCKETS - 1;
+  __atomic_add_fetch(&hist->buckets[b], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->sumNs, ns, __ATOMIC_RELAXED);
+  if (ns > hist->maxNs) __atomic_store_n(&hist->maxNs, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+} // _PCA9685_record
+
+
+
+/////////////////////////////////////////////////////////////////////
+// copy a histogram the worker keeps writing, count is the sum of the
+// buckets copied so a copy never counts fewer times than its buckets
+static void _PCA9685_copyHist(PCA9685_busHist* to, PCA9685_busHist* from) {
+  to->sumNs = __atomic_load_n(&from->sumNs, __ATOMIC_RELAXED);
+  to->maxNs = __atomic_load_n(&from->maxNs, __ATOMIC_RELAXED);
+  to->count = 0;
+  unsigned int b;
+  for (b=0; b<_PCA9685_HISTBUCKETS; b++) {
+    to->buckets[b] = __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+    to->count += to->buckets[b];
+  } // for buckets
+} // _PCA9685_copyHist
+
+
+
+/////////////////////////////////////////////////////////////////////
+// a timespec in ns
+static unsigned long long _PCA9685_tsNs(const struct timespec* ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+} // _PCA9685_tsNs
+
+
+
+/////////////////////////////////////////////////////////////////////
+// CLOCK_MONOTONIC in ns, async-signal-safe
+static unsigned long long _PCA9685_nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+} // _PCA9685_nowNs
+
+
+
+/////////////////////////////////////////////////////////////////////
+// hand a request back to its owner, through done() or by appending it
+// to the reaped list
+static void _PCA9685_complete(PCA9685_bus* bus, PCA9685_req* req, int result,
+                              _PCA9685_reqList* reaped) {
+  if (result == _PCA9685_ECANCELED) {
+    __atomic_add_fetch(&bus->stats.cancelled, 1, __ATOMIC_RELAXED);
+  } else if (result == _PCA9685_ETIMEDOUT) {
+    __atomic_add_fetch(&bus->stats.timedout, 1, __ATOMIC_RELAXED);
+  } // if result
+  __atomic_add_fetch(&bus->stats.reqs, 1, __ATOMIC_RELAXED);
+
+  req->result = result;
+  if (req->done) {
+    __atomic_store_n(&req->state, _PCA9685_DONE, __ATOMIC_RELEASE);
+    req->done(req);
+  } else {
+    req->next = NULL;
+    if (reaped->tail) reaped->tail->next = req;
+    else reaped->head = req;
+    reaped->tail = req;
+  } // if done
+} // _PCA9685_complete
+
+
+
+/////////////////////////////////////////////////////////////////////
+// append completed requests to the list PCA9685_reap() takes from and
+// wake the event loop if the list was empty
+static void _PCA9685_reapable(PCA9685_bus* bus, _PCA9685_reqList* reaped) {
+  if (reaped->head == NULL) return;
+  pthread_mutex_lock(&bus->lock);
+  bool wake = bus->doneHead == NULL;
+  if (bus->doneTail) bus->doneTail->next = reaped->head;
+  else bus->doneHead = reaped->head;
+  bus->doneTail = reaped->tail;
+  if (wake) {
+    uint64_t one = 1;
+    if (write(bus->efd, &one, sizeof(one)) < 0) {
+      perror("_PCA9685_reapable(): write() to eventfd failed");
+    } // if write
+  } // if wake
+  pthread_mutex_unlock(&bus->lock);
+} // _PCA9685_reapable
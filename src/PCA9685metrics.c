@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "PCA9685.h"
+
+// buses and counters one metrics endpoint serves
+#define _PCA9685_METRICSBUSES	16
+#define _PCA9685_METRICSCOUNTERS	32
+// wait for a scraper's request, a client that sends none gets plain text
+#define _PCA9685_METRICSWAITMS	100
+
+// counter of the application's, read through its callback at every scrape
+typedef struct _PCA9685_counter {
+  char name[64];
+  char help[128];
+  unsigned long long (*read)(void* user);
+  void* user;
+} _PCA9685_counter;
+
+// metrics endpoint, one server thread answers every connection
+struct PCA9685_metrics {
+  int sock;                     // listening socket, -1 when not serving
+  int efd;                      // eventfd, stops the server
+  pthread_t server;
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  pthread_mutex_t lock;         // guards the lists, never taken by a worker
+  unsigned int nBuses;
+  PCA9685_bus* buses[_PCA9685_METRICSBUSES];
+  char busNames[_PCA9685_METRICSBUSES][32];
+  unsigned int nCounters;
+  _PCA9685_counter counters[_PCA9685_METRICSCOUNTERS];
+};
+
+static void* _PCA9685_metricsServer(void* arg);
+static void _PCA9685_serveScrape(PCA9685_metrics* metrics, int conn);
+static void _PCA9685_writeHist(FILE* out, const char* bus, const char* stage,
+                               const PCA9685_busHist* hist);
+
+
+/////////////////////////////////////////////////////////////////////
+// serve the metrics of the buses and counters added later on a Unix
+// socket at path, NULL to only write them with PCA9685_writeMetrics()
+PCA9685_metrics* PCA9685_openMetrics(const char* path) {
+  PCA9685_metrics* metrics = calloc(1, sizeof(PCA9685_metrics));
+  if (metrics == NULL) {
+    fprintf(stderr, "PCA9685_openMetrics(): calloc() failed\n");
+    return NULL;
+  } // if metrics
+  metrics->sock = -1;
+  metrics->efd = -1;
+  pthread_mutex_init(&metrics->lock, NULL);
+  if (path == NULL) return metrics;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "PCA9685_openMetrics(): path %s is too long\n", path);
+    PCA9685_closeMetrics(metrics);
+    return NULL;
+  } // if path
+  strcpy(sa.sun_path, path);
+  strcpy(metrics->path, path);
+
+  // a socket left behind by an earlier run is replaced
+  unlink(path);
+  metrics->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  metrics->efd = eventfd(0, EFD_CLOEXEC);
+  if (metrics->sock < 0 || metrics->efd < 0 ||
+      bind(metrics->sock, (struct sockaddr*) &sa, sizeof(sa)) != 0 ||
+      listen(metrics->sock, 4) != 0) {
+    perror("PCA9685_openMetrics(): unable to listen");
+    metrics->path[0] = '\0';
+    PCA9685_closeMetrics(metrics);
+    return NULL;
+  } // if listen
+
+  int ret = pthread_create(&metrics->server, NULL, _PCA9685_metricsServer, metrics);
+  if (ret != 0) {
+    fprintf(stderr, "PCA9685_openMetrics(): pthread_create() returned %d\n", ret);
+    unlink(path);
+    close(metrics->sock);
+    metrics->sock = -1;
+    metrics->path[0] = '\0';
+    PCA9685_closeMetrics(metrics);
+    return NULL;
+  } // if ret
+
+  if (_PCA9685_DEBUG) {
+    printf("PCA9685_openMetrics(): serving on %s\n", path);
+  } // if debug
+  return metrics;
+} // PCA9685_openMetrics
+
+
+
+/////////////////////////////////////////////////////////////////////
+// stop serving and remove the socket, before closing the buses
+void PCA9685_closeMetrics(PCA9685_metrics* metrics) {
+  if (metrics->sock >= 0) {
+    uint64_t one = 1;
+    if (write(metrics->efd, &one, sizeof(one)) != sizeof(one)) {
+      perror("PCA9685_closeMetrics(): eventfd write() failed");
+    } // if write
+    pthread_join(metrics->server, NULL);
+    close(metrics->sock);
+  } // if sock
+  if (metrics->path[0]) unlink(metrics->path);
+  if (metrics->efd >= 0) close(metrics->efd);
+  pthread_mutex_destroy(&metrics->lock);
+  free(metrics);
+} // PCA9685_closeMetrics
+
+
+
+/////////////////////////////////////////////////////////////////////
+// serve the counters of an async writer, labelled bus="name"
+int PCA9685_addMetricsBus(PCA9685_metrics* metrics, PCA9685_bus* bus, const char* name) {
+  pthread_mutex_lock(&metrics->lock);
+  if (metrics->nBuses == _PCA9685_METRICSBUSES) {
+    pthread_mutex_unlock(&metrics->lock);
+    fprintf(stderr, "PCA9685_addMetricsBus(): more than %d buses\n", _PCA9685_METRICSBUSES);
+    return -1;
+  } // if full
+  metrics->buses[metrics->nBuses] = bus;
+  snprintf(metrics->busNames[metrics->nBuses], sizeof(metrics->busNames[0]), "%s", name);
+  metrics->nBuses++;
+  pthread_mutex_unlock(&metrics->lock);
+  return 0;
+} // PCA9685_addMetricsBus
+
+
+
+/////////////////////////////////////////////////////////////////////
+// serve a counter of the application's, read is called on the server
+// thread at every scrape and must not block
+int PCA9685_addMetricsCounter(PCA9685_metrics* metrics, const char* name, const char* help,
+                              unsigned long long (*read)(void* user), void* user) {
+  pthread_mutex_lock(&metrics->lock);
+  if (metrics->nCounters == _PCA9685_METRICSCOUNTERS) {
+    pthread_mutex_unlock(&metrics->lock);
+    fprintf(stderr, "PCA9685_addMetricsCounter(): more than %d counters\n",
+            _PCA9685_METRICSCOUNTERS);
+    return -1;
+  } // if full
+  _PCA9685_counter* counter = &metrics->counters[metrics->nCounters];
+  snprintf(counter->name, sizeof(counter->name), "%s", name);
+  snprintf(counter->help, sizeof(counter->help), "%s", help);
+  counter->read = read;
+  counter->user = user;
+  metrics->nCounters++;
+  pthread_mutex_unlock(&metrics->lock);
+  return 0;
+} // PCA9685_addMetricsCounter
+
+
+
+/////////////////////////////////////////////////////////////////////
+// write every metric in the Prometheus text format, the bus counters are
+// copied with relaxed loads, so a scrape never holds up a worker
+void PCA9685_writeMetrics(PCA9685_metrics* metrics, FILE* out) {
+  // counters of PCA9685_busStats, one family after the other, a series per bus
+  static const struct {
+    const char* name;
+    const char* help;
+    size_t offset;
+  } fields[] = {
+    { "pca9685_requests_total", "Requests completed.",
+      offsetof(PCA9685_busStats, reqs) },
+    { "pca9685_requests_written_total", "Requests written.",
+      offsetof(PCA9685_busStats, sent) },
+    { "pca9685_requests_cancelled_total", "Requests cancelled or dropped by a blackout.",
+      offsetof(PCA9685_busStats, cancelled) },
+    { "pca9685_requests_timedout_total", "Requests past their deadline.",
+      offsetof(PCA9685_busStats, timedout) },
+    { "pca9685_requests_merged_total", "Requests merged into another one's message.",
+      offsetof(PCA9685_busStats, merged) },
+    { "pca9685_messages_total", "Messages written.",
+      offsetof(PCA9685_busStats, msgs) },
+    { "pca9685_messages_failed_total", "Messages not written.",
+      offsetof(PCA9685_busStats, failed) },
+    { "pca9685_message_bytes_total", "Message bytes written, without addresses.",
+      offsetof(PCA9685_busStats, bytes) },
+    { "pca9685_transactions_total", "I2C_RDWR transactions.",
+      offsetof(PCA9685_busStats, ioctls) },
+    { "pca9685_retries_total", "Messages retried alone after a failed transaction.",
+      offsetof(PCA9685_busStats, retries) },
+    { "pca9685_blackouts_total", "Blackouts written.",
+      offsetof(PCA9685_busStats, blackouts) },
+    { "pca9685_quarantines_total", "Devices that stopped answering.",
+      offsetof(PCA9685_busStats, quarantined) },
+    { "pca9685_probes_total", "Probes of quarantined devices.",
+      offsetof(PCA9685_busStats, probes) },
+    { "pca9685_recoveries_total", "Devices restored after answering a probe.",
+      offsetof(PCA9685_busStats, recovered) },
+    { "pca9685_fades_total", "Watchdog fades after producers went quiet.",
+      offsetof(PCA9685_busStats, fades) },
+    { "pca9685_saturated_seconds_total", "Seconds the bus was nearly full.",
+      offsetof(PCA9685_busStats, saturated) },
+  };
+  const unsigned int nFields = sizeof(fields) / sizeof(fields[0]);
+
+  pthread_mutex_lock(&metrics->lock);
+  unsigned int nBuses = metrics->nBuses;
+  PCA9685_busStats stats[_PCA9685_METRICSBUSES];
+  unsigned int b, f;
+  for (b=0; b<nBuses; b++) PCA9685_getBusStats(metrics->buses[b], &stats[b]);
+
+  for (f=0; f<nFields && nBuses; f++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", fields[f].name, fields[f].help,
+            fields[f].name);
+    for (b=0; b<nBuses; b++) {
+      unsigned long long val = *(unsigned long long*) ((char*) &stats[b] + fields[f].offset);
+      fprintf(out, "%s{bus=\"%s\"} %llu\n", fields[f].name, metrics->busNames[b], val);
+    } // for buses
+  } // for fields
+
+  if (nBuses) {
+    // rate() of this is the share of the time the bus was busy
+    fprintf(out, "# HELP pca9685_busy_seconds_total Time spent in transactions.\n");
+    fprintf(out, "# TYPE pca9685_busy_seconds_total counter\n");
+    for (b=0; b<nBuses; b++) {
+      fprintf(out, "pca9685_busy_seconds_total{bus=\"%s\"} %.9f\n",
+              metrics->busNames[b], stats[b].busyNs / 1e9);
+    } // for buses
+    fprintf(out, "# HELP pca9685_wire_seconds_total Wire time of the messages written.\n");
+    fprintf(out, "# TYPE pca9685_wire_seconds_total counter\n");
+    for (b=0; b<nBuses; b++) {
+      fprintf(out, "pca9685_wire_seconds_total{bus=\"%s\"} %.9f\n",
+              metrics->busNames[b], stats[b].wireNs / 1e9);
+    } // for buses
+
+    fprintf(out, "# HELP pca9685_device_writes_total Requests written to a device.\n");
+    fprintf(out, "# TYPE pca9685_device_writes_total counter\n");
+    // each family is written whole, so the device lists are read twice
+    PCA9685_busDev devs[0x80];
+    unsigned int d, nDevs;
+    for (b=0; b<nBuses; b++) {
+      nDevs = PCA9685_getBusDevs(metrics->buses[b], 0x80, devs);
+      for (d=0; d<nDevs; d++) {
+        fprintf(out, "pca9685_device_writes_total{bus=\"%s\",addr=\"0x%02x\"} %llu\n",
+                metrics->busNames[b], devs[d].addr, devs[d].written);
+      } // for devs
+    } // for buses
+    fprintf(out, "# HELP pca9685_device_quarantined Device not answering, 1 while quarantined.\n");
+    fprintf(out, "# TYPE pca9685_device_quarantined gauge\n");
+    for (b=0; b<nBuses; b++) {
+      nDevs = PCA9685_getBusDevs(metrics->buses[b], 0x80, devs);
+      for (d=0; d<nDevs; d++) {
+        fprintf(out, "pca9685_device_quarantined{bus=\"%s\",addr=\"0x%02x\"} %d\n",
+                metrics->busNames[b], devs[d].addr, devs[d].quarantined ? 1 : 0);
+      } // for devs
+    } // for buses
+
+    // the stages of the requests PCA9685_setBusTrace() samples
+    fprintf(out, "# HELP pca9685_stage_seconds Time sampled requests spent per stage.\n");
+    fprintf(out, "# TYPE pca9685_stage_seconds histogram\n");
+    for (b=0; b<nBuses; b++) {
+      PCA9685_busTrace trace;
+      PCA9685_getBusTrace(metrics->buses[b], &trace);
+      _PCA9685_writeHist(out, metrics->busNames[b], "source", &trace.source);
+      _PCA9685_writeHist(out, metrics->busNames[b], "queue", &trace.queue);
+      _PCA9685_writeHist(out, metrics->busNames[b], "pack", &trace.pack);
+      _PCA9685_writeHist(out, metrics->busNames[b], "ioctl", &trace.ioctl);
+      _PCA9685_writeHist(out, metrics->busNames[b], "total", &trace.total);
+    } // for buses
+  } // if nBuses
+
+  unsigned int c;
+  for (c=0; c<metrics->nCounters; c++) {
+    _PCA9685_counter* counter = &metrics->counters[c];
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter->name, counter->help,
+            counter->name, counter->name, counter->read(counter->user));
+  } // for counters
+  pthread_mutex_unlock(&metrics->lock);
+} // PCA9685_writeMetrics
+
+
+
+/////////////////////////////////////////////////////////////////////
+// one histogram series, the log2 ns buckets as cumulative seconds
+static void _PCA9685_writeHist(FILE* out, const char* bus, const char* stage,
+                               const PCA9685_busHist* hist) {
+  unsigned long long seen = 0;
+  unsigned int b;
+  for (b=0; b<_PCA9685_HISTBUCKETS - 1; b++) {
+    seen += hist->buckets[b];
+    fprintf(out, "pca9685_stage_seconds_bucket{bus=\"%s\",stage=\"%s\",le=\"%.9g\"} %llu\n",
+            bus, stage, (1ULL << b) / 1e9, seen);
+  } // for buckets
+  // +Inf and the count come from the same buckets, never below the last le
+  seen += hist->buckets[_PCA9685_HISTBUCKETS - 1];
+  fprintf(out, "pca9685_stage_seconds_bucket{bus=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n",
+          bus, stage, seen);
+  fprintf(out, "pca9685_stage_seconds_sum{bus=\"%s\",stage=\"%s\"} %.9f\n",
+          bus, stage, hist->sumNs / 1e9);
+  fprintf(out, "pca9685_stage_seconds_count{bus=\"%s\",stage=\"%s\"} %llu\n",
+          bus, stage, seen);
+} // _PCA9685_writeHist
+
+
+
+/////////////////////////////////////////////////////////////////////
+// server thread, answers one connection at a time until closed
+static void* _PCA9685_metricsServer(void* arg) {
+  PCA9685_metrics* metrics = arg;
+  struct pollfd pfds[2] = { { metrics->sock, POLLIN, 0 }, { metrics->efd, POLLIN, 0 } };
+  while (1) {
+    if (poll(pfds, 2, -1) < 0) continue;
+    if (pfds[1].revents) break;
+    int conn = accept(metrics->sock, NULL, NULL);
+    if (conn < 0) continue;
+    _PCA9685_serveScrape(metrics, conn);
+    close(conn);
+  } // while 1
+  return NULL;
+} // _PCA9685_metricsServer
+
+
+
+/////////////////////////////////////////////////////////////////////
+// answer one scrape, with an HTTP response when asked with a GET, so
+// curl --unix-socket works as well as socat
+static void _PCA9685_serveScrape(PCA9685_metrics* metrics, int conn) {
+  char req[512];
+  ssize_t got = 0;
+  struct pollfd pfd = { conn, POLLIN, 0 };
+  if (poll(&pfd, 1, _PCA9685_METRICSWAITMS) > 0) got = read(conn, req, sizeof(req) - 1);
+  bool http = got >= 4 && memcmp(req, "GET ", 4) == 0;
+
+  char* text = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&text, &len);
+  if (out == NULL) {
+    perror("_PCA9685_serveScrape(): open_memstream() failed");
+    return;
+  } // if out
+  PCA9685_writeMetrics(metrics, out);
+  fclose(out);
+
+  char head[128];
+  int headLen = 0;
+  if (http) {
+    headLen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n\r\n", len);
+  } // if http
+  size_t off = 0;
+  while (off < (size_t) headLen) {
+    ssize_t n = send(conn, head + off, headLen - off, MSG_NOSIGNAL);
+    if (n <= 0) break;
+    off += n;
+  } // while head
+  off = 0;
+  while (off < len) {
+    ssize_t n = send(conn, text + off, len - off, MSG_NOSIGNAL);
+    if (n <= 0) break;
+    off += n;
+  } // while text
+  free(text);
+} // _PCA9685_serveScrape
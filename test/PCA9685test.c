@@ -1,10 +1,19 @@
 // test suite for libPCA9685
 // copyright 2018 Scott Edlin
 
+// RTLD_DEFAULT, to find the emulator when it is preloaded
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <PCA9685.h>
 #include "config.h"
@@ -78,6 +87,20 @@ int testInitPWM() {
 }
 
 
+int testInitPWMs() {
+  printf("testInitPWMs\n");
+  int freq = 200;
+  unsigned char addrs[2] = { addr, addr + 1 };
+  int rc = PCA9685_initPWMs(fd, 2, addrs, freq);
+  if (rc != 0 && !_PCA9685_TEST) {
+    fprintf(stderr, "ERROR: testInitPWMs: PCA9685_initPWMs(%d, 2, addrs, %d) returned %d\n", fd, freq, rc);
+    return -1;
+  } // if rc
+  printf("passed\n\n");
+  return 0;
+}
+
+
 int testFailWriteAllChannels() {
   printf("testFailWriteAllChannels\n");
   int ffd = -1;
@@ -117,6 +140,48 @@ int testWriteAllChannels() {
 }
 
 
+int testWriteFrame() {
+  printf("testWriteFrame\n");
+  unsigned char frame[_PCA9685_FRAMELEN] = { 0 };
+  int i;
+  for (i=0; i<_PCA9685_CHANS; i++) {
+    // ON stays at 0, OFF ramps up across the channels
+    unsigned int offVal = i * 0x111;
+    frame[1 + i*4 + 2] = offVal & 0xFF;
+    frame[1 + i*4 + 3] = offVal >> 8;
+  } // for
+  int rc = PCA9685_setPWMFrame(fd, addr, frame);
+  if (rc != 0 && !_PCA9685_TEST) {
+    fprintf(stderr, "ERROR: testWriteFrame: PCA9685_setPWMFrame(%d, 0x%02x, frame) returned %d\n", fd, addr, rc);
+    return -1;
+  } // if rc
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testWriteFrames() {
+  printf("testWriteFrames\n");
+  unsigned char frame0[_PCA9685_FRAMELEN] = { 0 };
+  unsigned char frame1[_PCA9685_FRAMELEN] = { 0 };
+  unsigned char* frames[2] = { frame0, frame1 };
+  unsigned char addrs[2] = { addr, addr + 1 };
+  int i;
+  for (i=0; i<_PCA9685_CHANS; i++) {
+    // first device full on, second device full off
+    frame0[1 + i*4 + 2] = _PCA9685_MAXVAL & 0xFF;
+    frame0[1 + i*4 + 3] = _PCA9685_MAXVAL >> 8;
+  } // for
+  int rc = PCA9685_setPWMFrames(fd, 2, addrs, frames);
+  if (rc != 0 && !_PCA9685_TEST) {
+    fprintf(stderr, "ERROR: testWriteFrames: PCA9685_setPWMFrames(%d, 2, addrs, frames) returned %d\n", fd, rc);
+    return -1;
+  } // if rc
+  printf("passed\n\n");
+  return 0;
+}
+
+
 int testTurnOffAllChannels() {
   printf("testTurnOffAllChannels\n");
   unsigned int setOnVals[_PCA9685_CHANS] =
@@ -133,6 +198,568 @@ int testTurnOffAllChannels() {
 }
 
 
+int reapAll(PCA9685_bus* bus, int n, PCA9685_req** done) {
+  struct pollfd pfd = { PCA9685_getBusFd(bus), POLLIN, 0 };
+  int reaped = 0;
+  while (reaped < n) {
+    if (poll(&pfd, 1, 1000) != 1) return -1;
+    reaped += PCA9685_reap(bus, n - reaped, done + reaped);
+  } // while reaped
+  return 0;
+}
+
+
+void testBusDone(PCA9685_req* req) {
+  __atomic_store_n((int*) req->user, 1, __ATOMIC_RELEASE);
+}
+
+
+int testBusWait(PCA9685_bus* bus, PCA9685_req* req, int expect) {
+  int done = 0;
+  req->user = &done;
+  req->done = testBusDone;
+  if (PCA9685_submit(bus, req) != 0) {
+    fprintf(stderr, "ERROR: testBus: PCA9685_submit() failed for addr 0x%02x\n", req->addr);
+    return -1;
+  } // if submit
+  while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) usleep(100);
+  if (req->result != expect && (expect != 0 || !_PCA9685_TEST)) {
+    fprintf(stderr, "ERROR: testBus: request for addr 0x%02x completed with %d\n", req->addr, req->result);
+    return -1;
+  } // if result
+  return 0;
+}
+
+
+int testBus() {
+  printf("testBus\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testBus: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  unsigned char frame[_PCA9685_FRAMELEN] = { _PCA9685_BASEPWMREG };
+  int i;
+  for (i=0; i<_PCA9685_CHANS; i++) {
+    frame[1 + i*4 + 2] = (i * 0x100) & 0xFF;
+    frame[1 + i*4 + 3] = (i * 0x100) >> 8;
+  } // for
+  PCA9685_req req = { 0 };
+  req.addr = addr;
+  req.buf = frame;
+  req.len = _PCA9685_FRAMELEN;
+
+  // cancelled before it is submitted, done() is still called
+  int rc = PCA9685_cancel(&req);
+  if (rc == 0) rc = testBusWait(bus, &req, _PCA9685_ECANCELED);
+  // written
+  if (rc == 0) rc = testBusWait(bus, &req, 0);
+  // deadline already passed
+  if (rc == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &req.deadline);
+    req.deadline.tv_sec -= 1;
+    rc = testBusWait(bus, &req, _PCA9685_ETIMEDOUT);
+  } // if rc
+  // the bus owns it until it is reaped, a second submit is refused
+  PCA9685_req* done[1];
+  memset(&req.deadline, 0, sizeof(req.deadline));
+  req.done = NULL;
+  if (rc == 0) rc = PCA9685_submit(bus, &req);
+  if (rc == 0 && PCA9685_submit(bus, &req) != -1) {
+    fprintf(stderr, "ERROR: testBus: request submitted twice\n");
+    rc = -1;
+  } // if submitted
+  if (rc == 0) rc = reapAll(bus, 1, done);
+
+  PCA9685_busStats stats;
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  if (rc) return rc;
+  printf("reqs = %llu sent = %llu cancelled = %llu timedout = %llu ioctls = %llu\n",
+         stats.reqs, stats.sent, stats.cancelled, stats.timedout, stats.ioctls);
+  if (stats.reqs != 4 || stats.cancelled != 1 || stats.timedout != 1) {
+    fprintf(stderr, "ERROR: testBus: unexpected counters\n");
+    return -1;
+  } // if stats
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testBusReap() {
+  printf("testBusReap\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testBusReap: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  unsigned char frame0[_PCA9685_FRAMELEN] = { _PCA9685_BASEPWMREG };
+  unsigned char frame1[_PCA9685_FRAMELEN] = { _PCA9685_BASEPWMREG };
+  PCA9685_req req0 = { 0 };
+  PCA9685_req req1 = { 0 };
+  req0.addr = addr;
+  req0.buf = frame0;
+  req0.len = _PCA9685_FRAMELEN;
+  req1.addr = addr + 1;
+  req1.buf = frame1;
+  req1.len = _PCA9685_FRAMELEN;
+  PCA9685_req* reqs[2] = { &req0, &req1 };
+
+  // both go out in one transaction and come back through the eventfd
+  int rc = PCA9685_submitReqs(bus, 2, reqs);
+  struct pollfd pfd = { PCA9685_getBusFd(bus), POLLIN, 0 };
+  int reaped = 0;
+  while (rc == 0 && reaped < 2) {
+    if (poll(&pfd, 1, 1000) != 1) {
+      fprintf(stderr, "ERROR: testBusReap: eventfd not readable\n");
+      rc = -1;
+      break;
+    } // if poll
+    PCA9685_req* done[4];
+    int n = PCA9685_reap(bus, 4, done);
+    int i;
+    for (i=0; i<n; i++) {
+      if (done[i] != reqs[reaped + i] || (done[i]->result != 0 && !_PCA9685_TEST)) rc = -1;
+    } // for done
+    reaped += n;
+  } // while reaped
+  if (rc == 0 && poll(&pfd, 1, 0) != 0) {
+    fprintf(stderr, "ERROR: testBusReap: eventfd still readable\n");
+    rc = -1;
+  } // if poll
+  PCA9685_closeBus(bus);
+  if (rc) return rc;
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testBusMerge() {
+  printf("testBusMerge\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testBusMerge: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  // chan 0, chan 1, chan 0 OFF again, chan 5, ALL_LED, then chan 0 again
+  unsigned char bufs[6][5] = {
+    { _PCA9685_BASEPWMREG + 0, 0x01, 0x00, 0x02, 0x00 },
+    { _PCA9685_BASEPWMREG + 4, 0x03, 0x00, 0x04, 0x00 },
+    { _PCA9685_BASEPWMREG + 2, 0x05, 0x00 },
+    { _PCA9685_BASEPWMREG + 20, 0x06, 0x00, 0x07, 0x00 },
+    { _PCA9685_ALLLEDREG, 0x00, 0x00, 0x00, 0x00 },
+    { _PCA9685_BASEPWMREG + 0, 0x08, 0x00, 0x09, 0x00 } };
+  unsigned short lens[6] = { 5, 5, 3, 5, 5, 5 };
+  PCA9685_req reqs[6];
+  PCA9685_req* ptrs[6];
+  int i;
+  for (i=0; i<6; i++) {
+    PCA9685_req req = { 0 };
+    reqs[i] = req;
+    reqs[i].addr = addr;
+    reqs[i].buf = bufs[i];
+    reqs[i].len = lens[i];
+    ptrs[i] = &reqs[i];
+  } // for reqs
+
+  // one transaction of 4 messages, 0x06 - 0x0d, 0x1a - 0x1d, 0xfa, 0x06
+  int rc = PCA9685_submitReqs(bus, 6, ptrs);
+  struct pollfd pfd = { PCA9685_getBusFd(bus), POLLIN, 0 };
+  PCA9685_req* done[6];
+  int reaped = 0;
+  while (rc == 0 && reaped < 6) {
+    if (poll(&pfd, 1, 1000) != 1) {
+      fprintf(stderr, "ERROR: testBusMerge: eventfd not readable\n");
+      rc = -1;
+      break;
+    } // if poll
+    reaped += PCA9685_reap(bus, 6 - reaped, done + reaped);
+  } // while reaped
+  PCA9685_busStats stats;
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  if (rc) return rc;
+  printf("sent = %llu merged = %llu msgs = %llu bytes = %llu ioctls = %llu\n",
+         stats.sent, stats.merged, stats.msgs, stats.bytes, stats.ioctls);
+  if (stats.merged != 3 || stats.msgs != 4 || stats.ioctls != 1) {
+    fprintf(stderr, "ERROR: testBusMerge: unexpected counters\n");
+    return -1;
+  } // if stats
+  printf("passed\n\n");
+  return 0;
+}
+
+
+// wait for n requests without done() to complete
+PCA9685_bus* blackoutBus;
+
+void blackoutHandler(int sig) {
+  (void) sig;
+  PCA9685_blackout(blackoutBus);
+}
+
+
+int testBlackout() {
+  printf("testBlackout\n");
+  unsigned char addrs[2] = { addr, addr + 1 };
+  int rc = PCA9685_blackoutPWMs(fd, 2, addrs);
+  if (rc) {
+    fprintf(stderr, "ERROR: testBlackout: PCA9685_blackoutPWMs() returned %d\n", rc);
+    return rc;
+  } // if rc
+
+  blackoutBus = PCA9685_openBus(fd);
+  if (blackoutBus == NULL) {
+    fprintf(stderr, "ERROR: testBlackout: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  unsigned char buf[5] = { _PCA9685_BASEPWMREG, 0x00, 0x00, 0xFF, 0x0F };
+  PCA9685_req reqs[2] = { { 0 }, { 0 } };
+  PCA9685_req* ptrs[2] = { &reqs[0], &reqs[1] };
+  PCA9685_req* done[2];
+  int i;
+  for (i=0; i<2; i++) {
+    reqs[i].addr = addrs[i];
+    reqs[i].buf = buf;
+    reqs[i].len = sizeof(buf);
+  } // for reqs
+
+  // both devices written, then a blackout from a signal handler turns
+  // them off and cancels what follows until resumed
+  rc = PCA9685_submitReqs(blackoutBus, 2, ptrs);
+  if (rc == 0) rc = reapAll(blackoutBus, 2, done);
+  signal(SIGUSR1, blackoutHandler);
+  raise(SIGUSR1);
+  signal(SIGUSR1, SIG_DFL);
+  if (rc == 0) rc = PCA9685_submit(blackoutBus, &reqs[0]);
+  if (rc == 0) rc = reapAll(blackoutBus, 1, done);
+  printf("blacked out result = %d\n", reqs[0].result);
+  if (rc == 0 && reqs[0].result != _PCA9685_ECANCELED) rc = -1;
+  PCA9685_resume(blackoutBus);
+  if (rc == 0) rc = PCA9685_submit(blackoutBus, &reqs[0]);
+  if (rc == 0) rc = reapAll(blackoutBus, 1, done);
+  printf("resumed result = %d\n", reqs[0].result);
+  if (rc == 0 && reqs[0].result != 0) rc = -1;
+  PCA9685_busStats stats;
+  PCA9685_getBusStats(blackoutBus, &stats);
+  PCA9685_closeBus(blackoutBus);
+  if (rc) {
+    fprintf(stderr, "ERROR: testBlackout: requests not handed back as expected\n");
+    return rc;
+  } // if rc
+  printf("blackouts = %llu cancelled = %llu sent = %llu\n",
+         stats.blackouts, stats.cancelled, stats.sent);
+  if (stats.blackouts != 1 || stats.cancelled != 1 || stats.sent != 3) {
+    fprintf(stderr, "ERROR: testBlackout: unexpected counters\n");
+    return -1;
+  } // if stats
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testQuarantine() {
+  printf("testQuarantine\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testQuarantine: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  PCA9685_setBusRecovery(bus, 200, 100, 1000);
+  unsigned char bufs[2][5] = {
+    { _PCA9685_BASEPWMREG, 0x00, 0x00, 0x00, 0x01 },
+    { _PCA9685_BASEPWMREG, 0x00, 0x00, 0x00, 0x02 } };
+  PCA9685_req reqs[2] = { { 0 }, { 0 } };
+  PCA9685_req* ptrs[2] = { &reqs[0], &reqs[1] };
+  PCA9685_req* done[2];
+  int i;
+  for (i=0; i<2; i++) {
+    reqs[i].addr = addr + i;
+    reqs[i].buf = bufs[i];
+    reqs[i].len = sizeof(bufs[i]);
+  } // for reqs
+
+  // the second device stops answering, its write fails and it is
+  // quarantined while the first is still written, on the emulator it
+  // misses the transaction and the retry alone, then answers again
+  void (*emuNack)(unsigned char addr, unsigned int xfers);
+  int (*emuAwait)(unsigned char addr, unsigned int xfers, unsigned int ms);
+  *(void**) &emuNack = dlsym(RTLD_DEFAULT, "i2cemu_nack");
+  *(void**) &emuAwait = dlsym(RTLD_DEFAULT, "i2cemu_await");
+  if (emuNack) emuNack(addr + 1, 2);
+  _PCA9685_TESTNACK = addr + 1;
+  int rc = PCA9685_submitReqs(bus, 2, ptrs);
+  if (rc == 0) rc = reapAll(bus, 2, done);
+  printf("failing results = %d %d\n", reqs[0].result, reqs[1].result);
+  if (rc == 0 && (reqs[0].result != 0 || reqs[1].result != -1)) rc = -1;
+
+  // held back in quarantine, but remembered
+  bufs[1][4] = 0x03;
+  if (rc == 0) rc = PCA9685_submitReqs(bus, 2, ptrs);
+  if (rc == 0) rc = reapAll(bus, 2, done);
+  printf("quarantined results = %d %d\n", reqs[0].result, reqs[1].result);
+  if (rc == 0 && (reqs[0].result != 0 || reqs[1].result != _PCA9685_EQUARANTINED)) rc = -1;
+
+  // back on the bus, the first probe re-initializes it and restores 0x03,
+  // on the emulator its MODE1 read is the first transaction the device
+  // answers, faked transactions have no bus to wait on
+  _PCA9685_TESTNACK = 0;
+  PCA9685_busStats stats;
+  if (emuAwait) {
+    if (rc == 0 && emuAwait(addr + 1, 1, 3000) < 0) rc = -1;
+  } else {
+    for (i=0; i<300; i++) {
+      PCA9685_getBusStats(bus, &stats);
+      if (stats.recovered) break;
+      usleep(10000);
+    } // for tries
+  } // if emulator
+
+  // the worker finishes the probe before it takes the next requests
+  bufs[1][4] = 0x04;
+  if (rc == 0) rc = PCA9685_submitReqs(bus, 2, ptrs);
+  if (rc == 0) rc = reapAll(bus, 2, done);
+  printf("recovered results = %d %d\n", reqs[0].result, reqs[1].result);
+  if (rc == 0 && (reqs[0].result != 0 || reqs[1].result != 0)) rc = -1;
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  if (rc) {
+    fprintf(stderr, "ERROR: testQuarantine: requests not handed back as expected\n");
+    return rc;
+  } // if rc
+  printf("quarantined = %llu probes = %llu recovered = %llu failed = %llu\n",
+         stats.quarantined, stats.probes, stats.recovered, stats.failed);
+  if (stats.quarantined != 1 || stats.probes != 1 || stats.recovered != 1 || stats.failed != 1) {
+    fprintf(stderr, "ERROR: testQuarantine: unexpected counters\n");
+    return -1;
+  } // if stats
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testWatchdog() {
+  printf("testWatchdog\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testWatchdog: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  // chan 0 full on, chan 1 at 0x800
+  unsigned char buf[9] = { _PCA9685_BASEPWMREG, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08 };
+  PCA9685_req req = { 0 };
+  PCA9685_req* done[1];
+  req.addr = addr;
+  req.buf = buf;
+  req.len = sizeof(buf);
+
+  // quiet for 50 ms, then two steps down to all off, then asleep
+  int rc = PCA9685_setBusWatchdog(bus, 50, 2 * 20, NULL, true);
+  if (rc == 0) rc = PCA9685_submit(bus, &req);
+  if (rc == 0) rc = reapAll(bus, 1, done);
+  PCA9685_busStats stats;
+  int i;
+  for (i=0; rc == 0 && i<300; i++) {
+    usleep(10000);
+    PCA9685_getBusStats(bus, &stats);
+    if (stats.fades && stats.ioctls == 4) break;
+  } // for tries
+  printf("fades = %llu ioctls = %llu\n", stats.fades, stats.ioctls);
+  if (rc == 0 && (stats.fades != 1 || stats.ioctls != 4)) rc = -1;
+
+  // the next request wakes the device first
+  if (rc == 0) rc = PCA9685_setBusWatchdog(bus, 0, 0, NULL, false);
+  if (rc == 0) rc = PCA9685_submit(bus, &req);
+  if (rc == 0) rc = reapAll(bus, 1, done);
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  if (rc || req.result != 0) {
+    fprintf(stderr, "ERROR: testWatchdog: no fade or wake\n");
+    return -1;
+  } // if rc
+  printf("fades = %llu ioctls = %llu\n", stats.fades, stats.ioctls);
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testTrace() {
+  printf("testTrace\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testTrace: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  unsigned char buf[5] = { _PCA9685_BASEPWMREG, 0x00, 0x00, 0x00, 0x01 };
+  PCA9685_req req = { 0 };
+  PCA9685_req* done[1];
+  req.addr = addr;
+  req.buf = buf;
+  req.len = sizeof(buf);
+
+  // every second request is timed, from its source time when it has one
+  PCA9685_setBusTrace(bus, 2);
+  int rc = 0;
+  int i;
+  for (i=0; rc == 0 && i<4; i++) {
+    if (i < 2) clock_gettime(CLOCK_MONOTONIC, &req.source);
+    else req.source.tv_sec = req.source.tv_nsec = 0;
+    rc = PCA9685_submit(bus, &req);
+    if (rc == 0) rc = reapAll(bus, 1, done);
+  } // for reqs
+  PCA9685_busTrace trace;
+  PCA9685_getBusTrace(bus, &trace);
+  PCA9685_closeBus(bus);
+  if (rc) {
+    fprintf(stderr, "ERROR: testTrace: requests not handed back\n");
+    return rc;
+  } // if rc
+  unsigned long long buckets = 0;
+  int b;
+  for (b=0; b<_PCA9685_HISTBUCKETS; b++) buckets += trace.total.buckets[b];
+  printf("source = %llu queue = %llu pack = %llu ioctl = %llu total = %llu buckets = %llu\n",
+         trace.source.count, trace.queue.count, trace.pack.count, trace.ioctl.count,
+         trace.total.count, buckets);
+  if (trace.source.count != 1 || trace.queue.count != 2 || trace.total.count != 2 || buckets != 2) {
+    fprintf(stderr, "ERROR: testTrace: unexpected sample counts\n");
+    return -1;
+  } // if counts
+  printf("passed\n\n");
+  return 0;
+}
+
+
+unsigned long long metricsCounter(void* user) {
+  return *(unsigned long long*) user;
+}
+
+
+int testMetrics() {
+  printf("testMetrics\n");
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testMetrics: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  const char* path = "PCA9685test.sock";
+  PCA9685_metrics* metrics = PCA9685_openMetrics(path);
+  if (metrics == NULL) {
+    fprintf(stderr, "ERROR: testMetrics: PCA9685_openMetrics(%s) returned NULL\n", path);
+    PCA9685_closeBus(bus);
+    return -1;
+  } // if metrics
+  unsigned long long suppressed = 7;
+  PCA9685_addMetricsBus(metrics, bus, "test");
+  PCA9685_addMetricsCounter(metrics, "test_suppressed_total", "Frames suppressed.",
+                            metricsCounter, &suppressed);
+
+  unsigned char buf[5] = { _PCA9685_BASEPWMREG, 0x00, 0x00, 0x00, 0x01 };
+  PCA9685_req req = { 0 };
+  PCA9685_req* done[1];
+  req.addr = addr;
+  req.buf = buf;
+  req.len = sizeof(buf);
+  int rc = 0;
+  int i;
+  for (i=0; rc == 0 && i<3; i++) {
+    rc = PCA9685_submit(bus, &req);
+    if (rc == 0) rc = reapAll(bus, 1, done);
+  } // for reqs
+
+  // scrape it the way curl --unix-socket does
+  static char text[65536];
+  size_t len = 0;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  const char* get = "GET /metrics HTTP/1.0\r\n\r\n";
+  if (rc == 0 && (connect(sock, (struct sockaddr*) &sa, sizeof(sa)) != 0 ||
+                  write(sock, get, strlen(get)) != (ssize_t) strlen(get))) {
+    perror("ERROR: testMetrics: unable to scrape");
+    rc = -1;
+  } // if connect
+  ssize_t got;
+  while (rc == 0 && len < sizeof(text) - 1 &&
+         (got = read(sock, text + len, sizeof(text) - 1 - len)) > 0) len += got;
+  text[len] = '\0';
+  close(sock);
+  PCA9685_closeMetrics(metrics);
+  PCA9685_closeBus(bus);
+  if (rc) return rc;
+
+  char dev[80];
+  snprintf(dev, sizeof(dev), "pca9685_device_writes_total{bus=\"test\",addr=\"0x%02x\"} 3\n", addr);
+  const char* expect[5] = { "HTTP/1.0 200 OK\r\n", "pca9685_requests_written_total{bus=\"test\"} 3\n",
+                            dev, "pca9685_stage_seconds_count{bus=\"test\",stage=\"ioctl\"} 0\n",
+                            "test_suppressed_total 7\n" };
+  for (i=0; i<5; i++) {
+    if (strstr(text, expect[i]) == NULL) {
+      fprintf(stderr, "ERROR: testMetrics: no %s in\n%s\n", expect[i], text);
+      return -1;
+    } // if !found
+    printf("%.*s\n", (int) strcspn(expect[i], "\r\n"), expect[i]);
+  } // for expect
+  if (access(path, F_OK) == 0) {
+    fprintf(stderr, "ERROR: testMetrics: %s left behind\n", path);
+    return -1;
+  } // if path
+  printf("passed\n\n");
+  return 0;
+}
+
+
+int testPlan() {
+  printf("testPlan\n");
+  // full frames, one sparse channel with driver overheads, ALL_LED past
+  // the messages of one transaction
+  PCA9685_plan plans[3] = {
+    { .devices = 24, .hz = 400000, .chans = 0xFFFF, .rate = 200.0 },
+    { .devices = 24, .hz = 1000000, .chans = 0x0001, .msgUs = _PCA9685_MSGUS,
+      .xferUs = _PCA9685_XFERUS, .rate = 200.0 },
+    { .devices = 48, .hz = 100000, .allLed = true } };
+  int expect[3] = { 1, 0, 0 };
+  int i;
+  for (i=0; i<3; i++) {
+    int rc = PCA9685_planBus(&plans[i]);
+    printf("rc = %d msgs = %u bytes = %u ioctls = %u frame = %.1f us max = %.1f Hz use = %.2f\n",
+           rc, plans[i].msgs, plans[i].bytes, plans[i].ioctls, plans[i].frameUs,
+           plans[i].maxRate, plans[i].utilisation);
+    if (rc != expect[i]) {
+      fprintf(stderr, "ERROR: testPlan: PCA9685_planBus() returned %d for plan %d\n", rc, i);
+      return -1;
+    } // if rc
+  } // for plans
+
+  // the writer adds up the wire time of what it sends, 56 clocks here
+  PCA9685_bus* bus = PCA9685_openBus(fd);
+  if (bus == NULL) {
+    fprintf(stderr, "ERROR: testPlan: PCA9685_openBus(%d) returned NULL\n", fd);
+    return -1;
+  } // if bus
+  PCA9685_setBusClock(bus, 400000);
+  unsigned char buf[5] = { _PCA9685_BASEPWMREG, 0x00, 0x00, 0x00, 0x01 };
+  PCA9685_req req = { 0 };
+  PCA9685_req* done[1];
+  req.addr = addr;
+  req.buf = buf;
+  req.len = sizeof(buf);
+  int rc = PCA9685_submit(bus, &req);
+  if (rc == 0) rc = reapAll(bus, 1, done);
+  PCA9685_busStats stats;
+  PCA9685_getBusStats(bus, &stats);
+  PCA9685_closeBus(bus);
+  printf("wireNs = %llu\n", stats.wireNs);
+  if (rc || stats.wireNs != 140000) {
+    fprintf(stderr, "ERROR: testPlan: unexpected wire time\n");
+    return -1;
+  } // if wireNs
+  printf("passed\n\n");
+  return 0;
+}
+
+
 int main(int argc, char **argv) {
   int c;
   while ((c = getopt(argc, argv, "tdv")) != -1) {
@@ -198,6 +825,12 @@ int main(int argc, char **argv) {
     exit(-1);
   } // if rc
 
+  rc = testInitPWMs();
+  if (rc) {
+    fprintf(stderr, "ERROR: testInitPWMs() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
   rc = testFailWriteAllChannels();
   if (rc) {
     fprintf(stderr, "ERROR: testFailWriteAllChannels() returned %d\n", rc);
@@ -210,12 +843,78 @@ int main(int argc, char **argv) {
     exit(-1);
   } // if rc
 
+  rc = testWriteFrame();
+  if (rc) {
+    fprintf(stderr, "ERROR: testWriteFrame() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testWriteFrames();
+  if (rc) {
+    fprintf(stderr, "ERROR: testWriteFrames() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
   rc = testTurnOffAllChannels();
   if (rc) {
     fprintf(stderr, "ERROR: testTurnOffAllChannels() returned %d\n", rc);
     exit(-1);
   } // if rc
 
+  rc = testBus();
+  if (rc) {
+    fprintf(stderr, "ERROR: testBus() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testBusReap();
+  if (rc) {
+    fprintf(stderr, "ERROR: testBusReap() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testBusMerge();
+  if (rc) {
+    fprintf(stderr, "ERROR: testBusMerge() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testBlackout();
+  if (rc) {
+    fprintf(stderr, "ERROR: testBlackout() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testQuarantine();
+  if (rc) {
+    fprintf(stderr, "ERROR: testQuarantine() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testWatchdog();
+  if (rc) {
+    fprintf(stderr, "ERROR: testWatchdog() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testTrace();
+  if (rc) {
+    fprintf(stderr, "ERROR: testTrace() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testMetrics();
+  if (rc) {
+    fprintf(stderr, "ERROR: testMetrics() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
+  rc = testPlan();
+  if (rc) {
+    fprintf(stderr, "ERROR: testPlan() returned %d\n", rc);
+    exit(-1);
+  } // if rc
+
   printf("All tests passed.\n");
   return 0;
 }
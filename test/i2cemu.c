@@ -0,0 +1,433 @@
+// i2c-dev emulator for libPCA9685, preloaded into an unmodified program
+// it takes over /dev/i2c-N and answers I2C_SLAVE and I2C_RDWR like a bus
+// full of PCA9685s, holding each transaction for the time it would take
+// on the wire
+//
+//   $ LD_PRELOAD=./test/libi2cemu.so ./test/PCA9685test 1 40
+//
+// environment:
+//   I2CEMU_BUSES  adapters emulated, e.g. "1,3", default "1"
+//   I2CEMU_DEVS   addresses of the PCA9685s, e.g. "0x40-0x47,0x60",
+//                 default "0x40-0x5f", the general call 0x00 and the
+//                 ALLCALL address 0x70 always answer
+//   I2CEMU_HZ     bus clock, 100000, 400000 or 1000000, default 400000
+//   I2CEMU_MSGUS  overhead of every message in us, default 5
+//   I2CEMU_XFERUS overhead of every transaction in us, the syscall and
+//                 the driver, default 20
+//   I2CEMU_NACK   a device that drops off, "addr" for good or "addr:n"
+//                 for its next n transactions, as if power cycled
+//   I2CEMU_SPIN   1 to spin through the wire time instead of sleeping,
+//                 for timing below the scheduler's resolution
+//   I2CEMU_STATS  1 to print what each bus carried at exit
+//
+// a program that knows it runs on the emulator can pull a device off
+// later, and wait for it to answer again instead of sleeping, the symbols
+// are looked up with dlsym(RTLD_DEFAULT, ...):
+//   void i2cemu_nack(unsigned char addr, unsigned int xfers);
+//   int i2cemu_await(unsigned char addr, unsigned int xfers, unsigned int ms);
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+#define EMU_ADPTS	16
+#define EMU_FDS		1024
+// default ALLCALLADR of a PCA9685
+#define EMU_ALLCALL	0x70
+
+// register file of one PCA9685
+typedef struct emuDev {
+  unsigned char regs[256];
+  unsigned char ptr;            // register pointer, set by a write's first byte
+} emuDev;
+
+// one emulated adapter, the mutex is the bus, so transactions of several
+// threads or fds queue up as they would in the kernel
+typedef struct emuBus {
+  bool on;
+  pthread_mutex_t lock;
+  emuDev devs[0x80];
+  unsigned char nackAddr;       // device off the bus, 0 for none
+  unsigned int nackXfers;       // transactions it misses, UINT_MAX for good
+  unsigned long long xfers;
+  unsigned long long msgs;
+  unsigned long long bytes;
+  unsigned long long nacks;
+  unsigned long long wireNs;
+} emuBus;
+
+static emuBus buses[EMU_ADPTS];
+static bool present[0x80];
+static int fdBus[EMU_FDS];      // adapter + 1 of an emulated fd, 0 for none
+static unsigned short fdSlave[EMU_FDS];
+static unsigned long hz = 400000;
+static unsigned long msgNs = 5000;
+static unsigned long xferNs = 20000;
+static bool spin;
+static bool stats;
+// transactions answered by the device last pulled off
+static pthread_mutex_t answerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t answerCond = PTHREAD_COND_INITIALIZER;
+static unsigned char answerAddr;
+static unsigned int answers;
+
+static int (*realOpen)(const char* path, int flags, ...);
+static int (*realOpen64)(const char* path, int flags, ...);
+static int (*realClose)(int fd);
+static int (*realIoctl)(int fd, unsigned long request, ...);
+static ssize_t (*realRead)(int fd, void* buf, size_t len);
+static ssize_t (*realWrite)(int fd, const void* buf, size_t len);
+
+void i2cemu_nack(unsigned char addr, unsigned int xfers);
+int i2cemu_await(unsigned char addr, unsigned int xfers, unsigned int ms);
+
+
+// power-on state of a PCA9685, MODE1 asleep with ALLCALL, outputs off
+static void emuReset(emuDev* dev) {
+  memset(dev->regs, 0, sizeof(dev->regs));
+  dev->regs[0x00] = 0x11;
+  dev->regs[0x01] = 0x04;
+  dev->regs[0x02] = 0xE2;
+  dev->regs[0x03] = 0xE4;
+  dev->regs[0x04] = 0xE8;
+  dev->regs[0x05] = 0xE0;
+  unsigned int chan;
+  for (chan=0; chan<16; chan++) dev->regs[0x06 + chan * 4 + 3] = 0x10;
+  dev->regs[0xFD] = 0x10;
+  dev->regs[0xFE] = 0x1E;
+  dev->ptr = 0;
+}
+
+
+// parse "a,b-c" into flags, values taken with base 0
+static void emuList(const char* list, bool* flags, unsigned int max) {
+  while (list && *list) {
+    char* end;
+    unsigned long first = strtoul(list, &end, 0);
+    unsigned long last = first;
+    if (*end == '-') last = strtoul(end + 1, &end, 0);
+    unsigned long i;
+    for (i=first; i<=last && i<max; i++) flags[i] = true;
+    list = *end == ',' ? end + 1 : NULL;
+  } // while list
+}
+
+
+static void emuStats(void) {
+  unsigned int a;
+  for (a=0; a<EMU_ADPTS; a++) {
+    emuBus* bus = &buses[a];
+    if (!bus->on || bus->xfers == 0) continue;
+    fprintf(stderr, "i2cemu: bus %u at %lu Hz, %llu transactions %llu messages %llu bytes "
+            "%llu nacks, %.3f ms on the wire\n", a, hz, bus->xfers, bus->msgs, bus->bytes,
+            bus->nacks, bus->wireNs / 1e6);
+  } // for buses
+}
+
+
+__attribute__((constructor))
+static void emuInit(void) {
+  // ISO C has no cast from void* to a function pointer, POSIX has this
+  *(void**) &realOpen = dlsym(RTLD_NEXT, "open");
+  *(void**) &realOpen64 = dlsym(RTLD_NEXT, "open64");
+  *(void**) &realClose = dlsym(RTLD_NEXT, "close");
+  *(void**) &realIoctl = dlsym(RTLD_NEXT, "ioctl");
+  *(void**) &realRead = dlsym(RTLD_NEXT, "read");
+  *(void**) &realWrite = dlsym(RTLD_NEXT, "write");
+
+  const char* env;
+  bool on[EMU_ADPTS] = { false };
+  emuList((env = getenv("I2CEMU_BUSES")) ? env : "1", on, EMU_ADPTS);
+  emuList((env = getenv("I2CEMU_DEVS")) ? env : "0x40-0x5f", present, 0x80);
+  if ((env = getenv("I2CEMU_HZ"))) hz = strtoul(env, NULL, 0);
+  if (hz == 0) hz = 400000;
+  if ((env = getenv("I2CEMU_MSGUS"))) msgNs = strtoul(env, NULL, 0) * 1000;
+  if ((env = getenv("I2CEMU_XFERUS"))) xferNs = strtoul(env, NULL, 0) * 1000;
+  spin = (env = getenv("I2CEMU_SPIN")) && atoi(env);
+  stats = (env = getenv("I2CEMU_STATS")) && atoi(env);
+
+  unsigned int a, addr;
+  for (a=0; a<EMU_ADPTS; a++) {
+    buses[a].on = on[a];
+    pthread_mutex_init(&buses[a].lock, NULL);
+    for (addr=0; addr<0x80; addr++) emuReset(&buses[a].devs[addr]);
+  } // for buses
+  if ((env = getenv("I2CEMU_NACK"))) {
+    char* end;
+    unsigned long nack = strtoul(env, &end, 0);
+    i2cemu_nack(nack, *end == ':' ? strtoul(end + 1, NULL, 0) : UINT_MAX);
+  } // if nack
+  if (stats) atexit(emuStats);
+}
+
+
+// the device at addr on every bus misses its next xfers transactions,
+// then answers again with its power-on registers, 0 xfers brings it back
+void i2cemu_nack(unsigned char addr, unsigned int xfers) {
+  unsigned int a;
+  for (a=0; a<EMU_ADPTS; a++) {
+    pthread_mutex_lock(&buses[a].lock);
+    buses[a].nackAddr = addr & 0x7F;
+    buses[a].nackXfers = xfers;
+    if (xfers) emuReset(&buses[a].devs[addr & 0x7F]);
+    pthread_mutex_unlock(&buses[a].lock);
+  } // for buses
+  pthread_mutex_lock(&answerLock);
+  answerAddr = addr & 0x7F;
+  answers = 0;
+  pthread_mutex_unlock(&answerLock);
+}
+
+
+// wait until the device last pulled off by i2cemu_nack() has answered
+// xfers transactions, which are off the wire when it returns, -1 with
+// errno ETIMEDOUT after ms
+int i2cemu_await(unsigned char addr, unsigned int xfers, unsigned int ms) {
+  struct timespec until;
+  clock_gettime(CLOCK_MONOTONIC, &until);
+  unsigned long long ns = until.tv_nsec + ms * 1000000ULL;
+  until.tv_sec += ns / 1000000000ULL;
+  until.tv_nsec = ns % 1000000000ULL;
+  int ret = 0;
+  pthread_mutex_lock(&answerLock);
+  while (ret == 0 && (answerAddr != (addr & 0x7F) || answers < xfers)) {
+    ret = pthread_cond_clockwait(&answerCond, &answerLock, CLOCK_MONOTONIC, &until);
+  } // while waiting
+  pthread_mutex_unlock(&answerLock);
+  if (ret) {
+    errno = ret;
+    return -1;
+  } // if ret
+  return 0;
+}
+
+
+static unsigned long long emuNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// hold the bus until the transaction would have finished
+static void emuWait(unsigned long long until) {
+  if (spin) {
+    while (emuNowNs() < until);
+    return;
+  } // if spin
+  struct timespec ts = { until / 1000000000ULL, until % 1000000000ULL };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+// an addressed device takes the bytes of a write, the first sets the
+// register pointer, which increments after every byte if MODE1 AI is set
+static void emuWriteDev(emuDev* dev, const unsigned char* buf, unsigned int len) {
+  if (len == 0) return;
+  dev->ptr = buf[0];
+  unsigned int i;
+  for (i=1; i<len; i++) {
+    unsigned char reg = dev->ptr;
+    if (reg == 0xFE && !(dev->regs[0x00] & 0x10)) {
+      // PRE_SCALE is only written while asleep
+    } else if (reg >= 0xFA && reg <= 0xFD) {
+      // ALL_LED writes every channel, reads back as zero
+      unsigned int chan;
+      for (chan=0; chan<16; chan++) dev->regs[0x06 + chan * 4 + reg - 0xFA] = buf[i];
+    } else if (reg == 0x00) {
+      // writing RESTART with a one clears it
+      dev->regs[0x00] = buf[i] & 0x7F;
+    } else if (reg != 0xFF) {
+      dev->regs[reg] = buf[i];
+    } // if reg
+    if (dev->regs[0x00] & 0x20) dev->ptr = reg == 0x45 ? 0x00 : reg + 1;
+  } // for bytes
+}
+
+
+static void emuReadDev(emuDev* dev, unsigned char* buf, unsigned int len) {
+  unsigned int i;
+  for (i=0; i<len; i++) {
+    unsigned char reg = dev->ptr;
+    buf[i] = reg >= 0xFA && reg <= 0xFD ? 0x00 : dev->regs[reg];
+    if (dev->regs[0x00] & 0x20) dev->ptr = reg == 0x45 ? 0x00 : reg + 1;
+  } // for bytes
+}
+
+
+// one combined transaction, a start, the address and data bytes of every
+// message with a repeated start between them and a stop, 9 clocks a byte
+// it stops at the first address nobody acknowledges, as the kernel does
+static int emuXfer(emuBus* bus, struct i2c_msg* msgs, unsigned int n) {
+  if (n == 0 || n > I2C_RDWR_IOCTL_MAX_MSGS) {
+    errno = EINVAL;
+    return -1;
+  } // if n
+  pthread_mutex_lock(&bus->lock);
+  unsigned long long start = emuNowNs();
+  unsigned long long clocks = 1;
+  int ret = n;
+  bool answered = false;
+  unsigned int i;
+  for (i=0; i<n; i++) {
+    unsigned short addr = msgs[i].addr & 0x7F;
+    clocks += 1 + 9;
+    bool off = bus->nackXfers && addr == bus->nackAddr;
+    if (off && bus->nackXfers != UINT_MAX) bus->nackXfers--;
+    if (off || (!present[addr] && addr != 0x00 && addr != EMU_ALLCALL)) {
+      bus->nacks++;
+      errno = ENXIO;
+      ret = -1;
+      break;
+    } // if nack
+    clocks += 9 * msgs[i].len;
+    if (addr == bus->nackAddr) answered = true;
+    bus->msgs++;
+    bus->bytes += msgs[i].len;
+    if (msgs[i].flags & I2C_M_RD) {
+      emuReadDev(&bus->devs[addr], msgs[i].buf, msgs[i].len);
+    } else if (addr == 0x00) {
+      // general call SWRST resets every device
+      if (msgs[i].len == 1 && msgs[i].buf[0] == 0x06) {
+        unsigned int a;
+        for (a=0; a<0x80; a++) emuReset(&bus->devs[a]);
+      } // if swrst
+    } else if (addr == EMU_ALLCALL) {
+      // ALLCALLADR reaches every device with ALLCALL set
+      unsigned int a;
+      for (a=0; a<0x80; a++) {
+        if (present[a] && (bus->devs[a].regs[0x00] & 0x01)) {
+          emuWriteDev(&bus->devs[a], msgs[i].buf, msgs[i].len);
+        } // if allcall
+      } // for devs
+    } else {
+      emuWriteDev(&bus->devs[addr], msgs[i].buf, msgs[i].len);
+    } // if rd
+  } // for msgs
+  unsigned long long ns = clocks * 1000000000ULL / hz + (i + (i < n)) * msgNs + xferNs;
+  bus->xfers++;
+  bus->wireNs += ns;
+  emuWait(start + ns);
+  if (answered) {
+    pthread_mutex_lock(&answerLock);
+    answers++;
+    pthread_cond_broadcast(&answerCond);
+    pthread_mutex_unlock(&answerLock);
+  } // if answered
+  pthread_mutex_unlock(&bus->lock);
+  return ret;
+}
+
+
+// /dev/i2c-N of an emulated adapter, -1 for any other path
+static int emuAdpt(const char* path) {
+  unsigned int a;
+  char end;
+  if (path == NULL || sscanf(path, "/dev/i2c-%u%c", &a, &end) != 1) return -1;
+  return a;
+}
+
+
+static int emuOpen(const char* path, int flags, int (*next)(const char*, int, ...), mode_t mode) {
+  int a = emuAdpt(path);
+  if (a < 0) return next(path, flags, mode);
+  if (a >= EMU_ADPTS || !buses[a].on) {
+    errno = ENOENT;
+    return -1;
+  } // if !on
+  // a real fd, so the number is unique and poll() and close() work
+  int fd = next("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+  if (fd < 0 || fd >= EMU_FDS) {
+    if (fd >= 0) realClose(fd);
+    errno = EMFILE;
+    return -1;
+  } // if fd
+  fdBus[fd] = a + 1;
+  fdSlave[fd] = 0;
+  return fd;
+}
+
+
+int open(const char* path, int flags, ...) {
+  va_list ap;
+  va_start(ap, flags);
+  mode_t mode = va_arg(ap, mode_t);
+  va_end(ap);
+  return emuOpen(path, flags, realOpen, mode);
+}
+
+
+int open64(const char* path, int flags, ...) {
+  va_list ap;
+  va_start(ap, flags);
+  mode_t mode = va_arg(ap, mode_t);
+  va_end(ap);
+  return emuOpen(path, flags, realOpen64 ? realOpen64 : realOpen, mode);
+}
+
+
+int close(int fd) {
+  if (fd >= 0 && fd < EMU_FDS) fdBus[fd] = 0;
+  return realClose(fd);
+}
+
+
+int ioctl(int fd, unsigned long request, ...) {
+  va_list ap;
+  va_start(ap, request);
+  void* arg = va_arg(ap, void*);
+  va_end(ap);
+  if (fd < 0 || fd >= EMU_FDS || fdBus[fd] == 0) return realIoctl(fd, request, arg);
+
+  emuBus* bus = &buses[fdBus[fd] - 1];
+  switch (request) {
+    case I2C_SLAVE:
+    case I2C_SLAVE_FORCE:
+      if ((unsigned long) arg > 0x7F) {
+        errno = EINVAL;
+        return -1;
+      } // if addr
+      fdSlave[fd] = (unsigned long) arg;
+      return 0;
+    case I2C_RDWR: {
+      struct i2c_rdwr_ioctl_data* data = arg;
+      return emuXfer(bus, data->msgs, data->nmsgs);
+    }
+    case I2C_FUNCS:
+      *(unsigned long*) arg = I2C_FUNC_I2C;
+      return 0;
+    case I2C_TIMEOUT:
+    case I2C_RETRIES:
+      return 0;
+    default:
+      errno = ENOTTY;
+      return -1;
+  } // switch request
+}
+
+
+ssize_t read(int fd, void* buf, size_t len) {
+  if (fd < 0 || fd >= EMU_FDS || fdBus[fd] == 0) return realRead(fd, buf, len);
+  struct i2c_msg msg = { fdSlave[fd], I2C_M_RD, len, buf };
+  return emuXfer(&buses[fdBus[fd] - 1], &msg, 1) < 0 ? -1 : (ssize_t) len;
+}
+
+
+ssize_t write(int fd, const void* buf, size_t len) {
+  if (fd < 0 || fd >= EMU_FDS || fdBus[fd] == 0) return realWrite(fd, buf, len);
+  struct i2c_msg msg = { fdSlave[fd], 0, len, (unsigned char*) buf };
+  return emuXfer(&buses[fdBus[fd] - 1], &msg, 1) < 0 ? -1 : (ssize_t) len;
+}